@@ -0,0 +1,98 @@
+#include <sched.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <linux/filter.h>
+#include <vector>
+#include "affinity.h"
+#include "metrics.h"
+#include "log.h"
+
+static bool g_affinity = false;
+static cpu_set_t g_cpus;        // 进程启动时可用的CPU
+static int g_cpu_count = 0;
+
+bool affinity_init(bool enabled) {
+    CPU_ZERO(&g_cpus);
+    if(sched_getaffinity(0, sizeof(g_cpus), &g_cpus) != 0) {
+        LOG_ERROR("sched_getaffinity failure: %s", strerror(errno));
+        return false;
+    }
+    g_cpu_count = CPU_COUNT(&g_cpus);
+    g_affinity = enabled;
+    if(enabled) {
+        LOG_INFO("cpu affinity on %d cpus", g_cpu_count);
+    }
+    return true;
+}
+
+bool affinity_enabled() {
+    return g_affinity;
+}
+
+int affinity_cpus() {
+    cpu_set_t allowed;
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed) == 0) {
+        return 1;
+    }
+    return CPU_COUNT(&allowed);
+}
+
+void affinity_pin_thread(pthread_t thread, int index) {
+    if(!g_affinity) {
+        return;
+    }
+    // 多进程模式下进程已经绑定到一部分CPU 在其中轮流选择
+    cpu_set_t allowed;
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed) == 0) {
+        return;
+    }
+    int target = index % CPU_COUNT(&allowed);
+    for(int cpu = 0, n = 0; cpu < CPU_SETSIZE; cpu++) {
+        if(CPU_ISSET(cpu, &allowed) && n++ == target) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            int ret = pthread_setaffinity_np(thread, sizeof(set), &set);
+            if(ret != 0) {
+                LOG_WARN("thread %d pin to cpu %d failure: %s", index, cpu, strerror(ret));
+            }
+            return;
+        }
+    }
+}
+
+bool affinity_steer(int listenfd, int groups) {
+    if(!g_affinity || groups <= 1) {
+        return true;
+    }
+    if(groups > g_cpu_count) {
+        LOG_WARN("%d workers on %d cpus: reuseport steering by cpu disabled", groups, g_cpu_count);
+        return true;
+    }
+    // A = 处理该SYN的CPU; 依次比较可用的CPU 相等时返回对应worker的编号
+    std::vector<sock_filter> code;
+    code.push_back((sock_filter){ BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU) });
+    for(int cpu = 0, rank = 0; cpu < CPU_SETSIZE; cpu++) {
+        if(CPU_ISSET(cpu, &g_cpus)) {
+            code.push_back((sock_filter){ BPF_JMP | BPF_JEQ | BPF_K, 0, 1, (uint32_t)cpu });
+            code.push_back((sock_filter){ BPF_RET | BPF_K, 0, 0, (uint32_t)(rank++ % groups) });
+        }
+    }
+    code.push_back((sock_filter){ BPF_RET | BPF_K, 0, 0, (uint32_t)groups });
+    struct sock_fprog prog = { (unsigned short)code.size(), code.data() };
+    if(setsockopt(listenfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) != 0) {
+        LOG_ERROR("SO_ATTACH_REUSEPORT_CBPF failure: %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+void affinity_record(int connfd) {
+    int incoming = -1;
+    socklen_t len = sizeof(incoming);
+    if(getsockopt(connfd, SOL_SOCKET, SO_INCOMING_CPU, &incoming, &len) != 0 || incoming < 0) {
+        return;
+    }
+    metrics_add(incoming == sched_getcpu() ? M_LOCALITY_LOCAL : M_LOCALITY_REMOTE);
+}
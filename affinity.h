@@ -0,0 +1,32 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <pthread.h>
+
+/*
+    连接与CPU的局部性(-A)
+    一个连接的网卡中断与软中断(协议栈处理)、以及处理它的用户态线程可能分别在三个核上，
+    socket、连接状态和数据在核之间来回迁移缓存行。多进程模式下master已经把第i个worker绑定到第i个可用CPU上，-A时：
+        事件循环线程   :   连接归属和协程模式的每个线程、线程池模式的Reactor线程，各自绑定到进程可用CPU中的一个
+        SO_REUSEPORT组 :   多进程-U时，在每个TCP端口的socket组上挂一个经典BPF程序：按处理SYN的CPU查表，
+                          返回绑定在该CPU上的worker的编号(第r个可用CPU对应 r % N)，内核据此选择组中第几个socket，
+                          不在表中的CPU返回无效的编号，内核退回按四元组哈希选择
+                          (组中socket的顺序即创建顺序，master一直持有全部socket，worker重启不改变顺序)
+    不论是否使用-A，每个TCP连接accept时比较SO_INCOMING_CPU(最近处理该连接数据包的CPU)与当前线程所在的CPU，
+    计入指标webserver_connection_locality_total{result="local"|"remote"}。
+    回环测试时软中断在发送方(客户端)的CPU上执行，可以用taskset固定客户端的CPU验证。
+*/
+
+bool affinity_init(bool enabled);       // 记录进程启动时可用的CPU
+bool affinity_enabled();
+int affinity_cpus();                    // 当前进程可用的CPU数(多进程模式下worker只有绑定的那一个)
+
+// 把第index个事件循环线程绑定到当前进程可用CPU中的第(index % 个数)个 未启用时什么也不做
+void affinity_pin_thread(pthread_t thread, int index);
+// 在SO_REUSEPORT组(groups个socket)上挂载按CPU选择socket的BPF程序
+bool affinity_steer(int listenfd, int groups);
+
+// accept之后调用 统计连接是否在处理其数据包的CPU上被接收
+void affinity_record(int connfd);
+
+#endif
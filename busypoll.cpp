@@ -0,0 +1,120 @@
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include "busypoll.h"
+#include "metrics.h"
+#include "log.h"
+
+// 旧的内核头文件中没有 定义与linux/eventpoll.h相同
+#ifndef EPIOCSPARAMS
+struct epoll_params {
+    uint32_t busy_poll_usecs;
+    uint16_t busy_poll_budget;
+    uint8_t prefer_busy_poll;
+    uint8_t __pad;
+};
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+static const uint64_t SPIN_PERIOD_NS = 10000000;    // 统计周期 10ms
+static const uint16_t BUSY_POLL_BUDGET = 8;         // 内核每次轮询最多处理的数据包数(内核的默认值)
+
+static int g_spin_us = 0;
+static int g_budget_percent = 50;
+
+bool busy_poll_init(int spin_us, int budget_percent) {
+    if(spin_us < 0 || budget_percent <= 0 || budget_percent > 100) {
+        return false;
+    }
+    g_spin_us = spin_us;
+    g_budget_percent = budget_percent;
+    if(spin_us > 0) {
+        LOG_INFO("busy poll: spin %d us, budget %d%%", spin_us, budget_percent);
+        cpu_set_t set;
+        if(sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) == 1) {
+            // 自旋的线程与要唤醒的线程抢同一个核 只会更慢
+            LOG_WARN("busy poll on a single cpu delays the threads it waits for");
+        }
+    }
+    return true;
+}
+
+bool busy_poll_enabled() {
+    return g_spin_us > 0;
+}
+
+void busy_poll_epoll(int epollfd) {
+    if(g_spin_us == 0) {
+        return;
+    }
+    struct epoll_params params;
+    memset(&params, 0, sizeof(params));
+    params.busy_poll_usecs = g_spin_us;
+    params.busy_poll_budget = BUSY_POLL_BUDGET;
+    params.prefer_busy_poll = 1;
+    if(ioctl(epollfd, EPIOCSPARAMS, &params) != 0) {
+        static bool warned = false;
+        if(!warned) {
+            warned = true;
+            LOG_WARN("epoll busy poll unavailable: %s", strerror(errno));
+        }
+    }
+}
+
+void busy_poll_socket(int listenfd) {
+    if(g_spin_us == 0) {
+        return;
+    }
+    int usecs = g_spin_us;
+    int prefer = 1;
+    if(setsockopt(listenfd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) != 0
+            || setsockopt(listenfd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer)) != 0) {
+        static bool warned = false;
+        if(!warned) {
+            warned = true;
+            LOG_WARN("SO_BUSY_POLL unavailable: %s", strerror(errno));
+        }
+    }
+}
+
+spin_policy::spin_policy() {
+    m_limit_ns = g_spin_us * 1000ULL;
+    m_window_ns = m_limit_ns;
+    m_budget_ns = SPIN_PERIOD_NS * g_budget_percent / 100;
+    m_spent_ns = 0;
+    m_period_end = 0;
+}
+
+void spin_policy::refill(uint64_t now) {
+    if(now < m_period_end) {
+        return;
+    }
+    m_period_end = now + SPIN_PERIOD_NS;
+    m_spent_ns = 0;
+    if(m_window_ns == 0) {
+        // 上个周期一直落空 用较小的窗口试探负载是否回升
+        m_window_ns = m_limit_ns / 8 > 0 ? m_limit_ns / 8 : 1;
+    }
+}
+
+void spin_policy::finish(uint64_t start, uint64_t end, bool hit) {
+    uint64_t spent = end > start ? end - start : 0;
+    m_spent_ns += spent;
+    metrics_add(hit ? M_SPIN_HITS : M_SPIN_MISSES);
+    metrics_add(M_SPIN_NS, spent);
+    // 等到了事件说明事件间隔短于窗口 恢复完整的窗口；空转则减半，小于1微秒时停止自旋
+    m_window_ns = hit ? m_limit_ns : (m_window_ns / 2 >= 1000 ? m_window_ns / 2 : 0);
+}
+
+int busy_epoll_wait(spin_policy & spin, int epollfd, epoll_event * events, int max_events, int timeout_ms) {
+    int number = 0;
+    if(spin.spin([&]() {
+        number = epoll_wait(epollfd, events, max_events, 0);
+        return number != 0;
+    })) {
+        return number;
+    }
+    return epoll_wait(epollfd, events, max_events, timeout_ms);
+}
@@ -0,0 +1,90 @@
+#ifndef BUSYPOLL_H
+#define BUSYPOLL_H
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/epoll.h>
+
+/*
+    低延迟模式(-b spin_us[:budget])
+    Reactor阻塞在epoll_wait、工作线程阻塞在sem_wait，每个请求至少要经过两次调度器唤醒，
+    中低负载时这两次唤醒(以及CPU从空闲状态退出)占了延迟的大头。开启后：
+        用户态自旋    :   事件循环先以超时0反复epoll_wait，工作线程先反复sem_trywait，每次之间执行pause，
+                          超过自旋窗口仍没有事件才阻塞。窗口自适应：自旋等到了事件就恢复为spin_us，
+                          空转一次减半，减到0之后只阻塞，每个统计周期再试探一次。
+        CPU预算       :   每个线程在每个统计周期(10ms)内自旋的时间不超过budget%(默认50)，用尽后直到下个周期都直接阻塞
+        内核忙轮询    :   epoll实例设置EPIOCSPARAMS(Linux 6.9+)、TCP监听socket设置SO_BUSY_POLL/SO_PREFER_BUSY_POLL
+                          (accept的连接继承)，由内核在等待时直接轮询网卡队列；超过net.core.busy_read需要CAP_NET_ADMIN，
+                          不支持或没有权限时只记录一次警告
+    自旋命中/落空的次数和自旋的时间见webserver_busy_poll_total和webserver_busy_poll_seconds_total。
+*/
+
+bool busy_poll_init(int spin_us, int budget_percent);   // spin_us为0表示关闭
+bool busy_poll_enabled();
+void busy_poll_epoll(int epollfd);      // 设置epoll实例的内核忙轮询参数 未开启时什么也不做
+void busy_poll_socket(int listenfd);    // 设置监听socket的SO_BUSY_POLL
+
+// 自旋循环中让出流水线 减少对同核超线程的干扰和退出循环时的内存顺序冲突
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield" ::: "memory");
+#else
+    asm volatile("" ::: "memory");
+#endif
+}
+
+// 每个线程一个 记录自适应的自旋窗口和本周期已用的预算
+class spin_policy {
+public:
+    spin_policy();
+
+    // 自旋直到ready()返回true(返回true)或者窗口用完(返回false，调用者随后阻塞等待)
+    template<typename F>
+    bool spin(F ready) {
+        if(m_limit_ns == 0) {
+            return false;
+        }
+        uint64_t start = now_ns();
+        refill(start);
+        if(m_window_ns == 0 || m_spent_ns >= m_budget_ns) {
+            return false;
+        }
+        uint64_t deadline = start + m_window_ns;
+        uint64_t now = start;
+        for(int n = 1; ; n++) {
+            if(ready()) {
+                finish(start, now_ns(), true);
+                return true;
+            }
+            cpu_relax();
+            // 读时钟比pause贵得多 每16次检查一次是否超时
+            if((n & 15) == 0 && (now = now_ns()) >= deadline) {
+                break;
+            }
+        }
+        finish(start, now, false);
+        return false;
+    }
+
+private:
+    static uint64_t now_ns() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+    void refill(uint64_t now);      // 进入新的统计周期时恢复预算
+    void finish(uint64_t start, uint64_t end, bool hit);   // 记录本次自旋并调整窗口
+
+    uint64_t m_limit_ns;        // 自旋窗口的上限 0表示关闭
+    uint64_t m_window_ns;       // 当前的自旋窗口
+    uint64_t m_budget_ns;       // 每个统计周期允许自旋的时间
+    uint64_t m_spent_ns;        // 本周期已经自旋的时间
+    uint64_t m_period_end;
+};
+
+// 先自旋轮询再阻塞的epoll_wait
+int busy_epoll_wait(spin_policy & spin, int epollfd, epoll_event * events, int max_events, int timeout_ms);
+
+#endif
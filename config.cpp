@@ -0,0 +1,255 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/socket.h>
+#include "config.h"
+#include "log.h"
+
+// 默认配置
+server_config g_config = {
+    0,                                                  // port
+    {},                                                 // listens
+    0,                                                  // listen_count
+    "/home/gsq/文档/linux_cpp/webserver/resources",     // doc_root
+    MODE_POOL,                                          // mode
+    0,                                                  // thread_number
+    0,                                                  // max_threads
+    100,                                                // queue_target_ms
+    64,                                                 // cache_mb
+    { 4, 1 },                                           // lane_weights
+    LOG_LEVEL_INFO,                                     // log_level
+    NULL,                                               // access_log
+    NULL,                                               // capture_file
+    NULL,                                               // metrics_shm
+    NULL,                                               // trace_file
+    0.01,                                               // trace_rate
+    0,                                                  // workers
+    false,                                              // reuseport
+    SOMAXCONN,                                          // backlog
+    false,                                              // inherit
+    NULL,                                               // handoff_path
+    10,                                                 // drain_seconds
+    NULL,                                               // tls_cert
+    NULL,                                               // tls_key
+    { 0, 0 },                                           // ip_limits
+    { 0, 0 },                                           // net_limits
+    false,                                              // affinity
+    HUGE_THP,                                           // huge_pages
+    0,                                                  // spin_us
+    50,                                                 // spin_budget
+    NULL,                                               // warmup_manifest
+    1000,                                               // warmup_top
+    -1,                                                 // warmup_budget_mb
+};
+
+void usage(const char * prog) {
+    printf("按照如下格式运行： %s [-m pool|coro|owner|hybrid] [-t threads|min:max] [-Q queue_target_ms] [-c cache_mb] [-w cheap:expensive] [-l debug|info|warn|error|off] [-a access_log] [-W capture_file] [-M metrics_shm|off] [-T trace_file] [-S sample_rate] [-P workers] [-U] [-B backlog] [-I] [-H handoff_path] [-D drain_seconds] [-C cert_file -K key_file] [-L ip_conn:ip_req] [-N net_conn:net_req] [-u unix_socket_path]... [-A] [-G off|thp|hugetlb] [-b spin_us[:budget_pct]] [-F manifest[:top_n[:budget_mb]]] [-r doc_root] [port_number...]\n", basename((char *)prog));
+}
+
+static bool parse_mode(const char * text, DISPATCH_MODE * mode) {
+    if(strcmp(text, "pool") == 0) {
+        *mode = MODE_POOL;
+    } else if(strcmp(text, "coro") == 0) {
+        *mode = MODE_CORO;
+    } else if(strcmp(text, "owner") == 0) {
+        *mode = MODE_OWNER;
+    } else if(strcmp(text, "hybrid") == 0) {
+        *mode = MODE_HYBRID;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static bool add_listen(int port, const char * path) {
+    if(g_config.listen_count >= MAX_LISTEN) {
+        return false;
+    }
+    g_config.listens[g_config.listen_count].port = port;
+    g_config.listens[g_config.listen_count].path = path;
+    g_config.listen_count++;
+    return true;
+}
+
+static bool parse_huge_pages(const char * text, HUGE_PAGE_MODE * mode) {
+    if(strcmp(text, "off") == 0) {
+        *mode = HUGE_OFF;
+    } else if(strcmp(text, "thp") == 0) {
+        *mode = HUGE_THP;
+    } else if(strcmp(text, "hugetlb") == 0) {
+        *mode = HUGE_TLB;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// 连接数:请求数 每秒
+static bool parse_limits(const char * text, int limits[2]) {
+    return sscanf(text, "%d:%d", &limits[0], &limits[1]) == 2 && limits[0] >= 0 && limits[1] >= 0;
+}
+
+bool parse_config(int argc, char * argv[]) {
+    int opt;
+    while((opt = getopt(argc, argv, "m:t:r:c:w:l:a:W:M:T:S:P:UB:IH:D:C:K:L:N:u:AG:b:F:Q:")) != -1) {
+        switch(opt) {
+            case 'm':
+                if(!parse_mode(optarg, &g_config.mode)) {
+                    return false;
+                }
+                break;
+            case 't':
+                // 一个数为固定的线程数 min:max为线程池自动调整的范围
+                if(sscanf(optarg, "%d:%d", &g_config.thread_number, &g_config.max_threads) == 1) {
+                    g_config.max_threads = g_config.thread_number;
+                }
+                if(g_config.thread_number <= 0 || g_config.max_threads < g_config.thread_number) {
+                    return false;
+                }
+                break;
+            case 'Q':
+                g_config.queue_target_ms = atoi(optarg);
+                if(g_config.queue_target_ms <= 0) {
+                    return false;
+                }
+                break;
+            case 'c':
+                g_config.cache_mb = atoi(optarg);
+                if(g_config.cache_mb < 0) {
+                    return false;
+                }
+                break;
+            case 'w':
+                if(sscanf(optarg, "%d:%d", &g_config.lane_weights[0], &g_config.lane_weights[1]) != 2
+                        || g_config.lane_weights[0] <= 0 || g_config.lane_weights[1] <= 0) {
+                    return false;
+                }
+                break;
+            case 'l':
+                g_config.log_level = log_parse_level(optarg);
+                if(g_config.log_level < 0) {
+                    return false;
+                }
+                break;
+            case 'a':
+                g_config.access_log = optarg;
+                break;
+            case 'W':
+                g_config.capture_file = optarg;
+                break;
+            case 'M':
+                g_config.metrics_shm = optarg;
+                break;
+            case 'T':
+                g_config.trace_file = optarg;
+                break;
+            case 'S':
+                g_config.trace_rate = atof(optarg);
+                if(g_config.trace_rate <= 0 || g_config.trace_rate > 1) {
+                    return false;
+                }
+                break;
+            case 'P':
+                g_config.workers = atoi(optarg);
+                if(g_config.workers < 0) {
+                    return false;
+                }
+                break;
+            case 'U':
+                g_config.reuseport = true;
+                break;
+            case 'B':
+                g_config.backlog = atoi(optarg);
+                if(g_config.backlog <= 0) {
+                    return false;
+                }
+                break;
+            case 'I':
+                g_config.inherit = true;
+                break;
+            case 'H':
+                g_config.handoff_path = optarg;
+                break;
+            case 'D':
+                g_config.drain_seconds = atoi(optarg);
+                if(g_config.drain_seconds < 0) {
+                    return false;
+                }
+                break;
+            case 'C':
+                g_config.tls_cert = optarg;
+                break;
+            case 'K':
+                g_config.tls_key = optarg;
+                break;
+            case 'L':
+                if(!parse_limits(optarg, g_config.ip_limits)) {
+                    return false;
+                }
+                break;
+            case 'N':
+                if(!parse_limits(optarg, g_config.net_limits)) {
+                    return false;
+                }
+                break;
+            case 'u':
+                if(!add_listen(0, optarg)) {
+                    return false;
+                }
+                break;
+            case 'A':
+                g_config.affinity = true;
+                break;
+            case 'b':
+                // 自旋微秒数[:预算百分比]
+                if(sscanf(optarg, "%d:%d", &g_config.spin_us, &g_config.spin_budget) < 1
+                        || g_config.spin_us < 0 || g_config.spin_budget <= 0 || g_config.spin_budget > 100) {
+                    return false;
+                }
+                break;
+            case 'F': {
+                // 清单路径[:文件数[:MB]] 路径复制出来，不修改argv(升级时原样传给新进程)
+                static char manifest[256];
+                size_t len = strcspn(optarg, ":");
+                if(len == 0 || len >= sizeof(manifest)) {
+                    return false;
+                }
+                memcpy(manifest, optarg, len);
+                manifest[len] = '\0';
+                g_config.warmup_manifest = manifest;
+                if(optarg[len] == ':' && (sscanf(optarg + len + 1, "%d:%d", &g_config.warmup_top, &g_config.warmup_budget_mb) < 1
+                        || g_config.warmup_top < 0 || g_config.warmup_budget_mb < -1)) {
+                    return false;
+                }
+                break;
+            }
+            case 'G':
+                if(!parse_huge_pages(optarg, &g_config.huge_pages)) {
+                    return false;
+                }
+                break;
+            case 'r':
+                g_config.doc_root = optarg;
+                break;
+            default:
+                return false;
+        }
+    }
+
+    // 证书和私钥必须同时指定
+    if(!g_config.tls_cert != !g_config.tls_key) {
+        return false;
+    }
+
+    // 位置参数为TCP端口号 给出了-u时可以没有(只监听Unix域socket)
+    g_config.port = optind < argc ? atoi(argv[optind]) : 0;
+    for(int i = optind; i < argc; i++) {
+        int port = atoi(argv[i]);
+        if(port <= 0 || port > 65535 || !add_listen(port, NULL)) {
+            return false;
+        }
+    }
+    return g_config.listen_count > 0;
+}
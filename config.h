@@ -0,0 +1,70 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+/*
+    服务器的运行参数，由命令行解析得到
+    MODE_POOL   :   单Reactor + 线程池(默认)，读写在主线程，解析和应答在工作线程
+    MODE_CORO   :   每个线程一个调度器，每个连接是一个协程，在socket未就绪时co_await挂起
+    MODE_OWNER  :   每个线程一个事件循环，连接归属于接收它的线程，只注册一次epoll，处理后立即写回
+    MODE_HYBRID :   同MODE_POOL，但处理代价很小的请求(缓存命中的小GET)直接在Reactor线程中处理
+*/
+enum DISPATCH_MODE { MODE_POOL = 0, MODE_CORO, MODE_OWNER, MODE_HYBRID };
+
+/*
+    连接表和缓冲区使用的页(hugemem.h)
+    HUGE_OFF    :   普通的4KB页
+    HUGE_THP    :   透明大页 按2MB对齐后madvise(默认)
+    HUGE_TLB    :   MAP_HUGETLB预留的大页 不足时退回透明大页
+*/
+enum HUGE_PAGE_MODE { HUGE_OFF = 0, HUGE_THP, HUGE_TLB };
+
+static const int MAX_LISTEN = 16;   // 最多的监听地址数(TCP端口与Unix域socket合计)
+
+// 一个监听地址 path不为NULL时为Unix域socket，否则为TCP端口
+struct listen_spec {
+    int port;
+    const char * path;
+};
+
+struct server_config {
+    int port;                   // 第一个TCP监听端口，0表示只监听Unix域socket
+    listen_spec listens[MAX_LISTEN];    // 全部监听地址 连接不论来自哪一个都由同一个事件循环处理
+    int listen_count;
+    const char * doc_root;      // 网站根目录
+    DISPATCH_MODE mode;         // 事件分发模式
+    int thread_number;          // 线程数量(线程池的工作线程数或协程调度线程数)，0表示按可用的CPU数确定
+    int max_threads;            // 线程池自动调整的上限，0表示按可用的CPU数确定
+    int queue_target_ms;        // 线程池的目标排队时间 队列上限由它和平均服务时间推算
+    int cache_mb;               // 文件缓存的容量(MB)，0表示不使用缓存
+    int lane_weights[2];        // 线程池廉价通道和昂贵通道的权重
+    int log_level;              // 日志级别
+    const char * access_log;    // 二进制访问日志的路径，NULL表示不记录
+    const char * capture_file;  // 流量捕获文件的路径(供test_presure/replay回放)，NULL表示不捕获
+    const char * metrics_shm;   // 指标共享内存的名称，NULL表示按监听地址生成("/webserver.端口")，"off"表示不使用共享内存
+    const char * trace_file;    // 请求阶段追踪的输出文件(Chrome Trace格式)，NULL表示不追踪
+    double trace_rate;          // 追踪的采样率(0~1)
+    int workers;                // 多进程模式的worker进程数，0表示单进程
+    bool reuseport;             // 多进程模式下每个worker各自绑定一个SO_REUSEPORT的监听socket
+    int backlog;                // listen的全连接队列长度
+    bool inherit;               // 从正在运行的进程接管监听socket(升级时由旧进程添加)
+    const char * handoff_path;  // 交接监听socket的Unix socket路径，NULL表示按监听地址生成("/tmp/webserver.端口.sock")
+    int drain_seconds;          // 交接或SIGQUIT后排空连接的最长时间(秒)
+    const char * tls_cert;      // HTTPS证书链文件(PEM)，NULL表示明文HTTP
+    const char * tls_key;       // HTTPS私钥文件(PEM)
+    int ip_limits[2];           // 每个客户端IP每秒允许的连接数和请求数，0表示不限制
+    int net_limits[2];          // 每个/24网段每秒允许的连接数和请求数
+    bool affinity;              // 绑定worker和事件循环线程到CPU，多进程-U时按接收连接的CPU分发
+    HUGE_PAGE_MODE huge_pages;  // 连接表和连接缓冲区使用的页
+    int spin_us;                // 忙轮询的自旋窗口(微秒)，0表示关闭
+    int spin_budget;            // 每个线程自旋时间占CPU时间的上限(%)
+    const char * warmup_manifest;   // 热点文件清单的路径，NULL表示不预热也不保存
+    int warmup_top;             // 启动时最多预热的文件数
+    int warmup_budget_mb;       // 启动时最多预热的字节数(MB)，-1表示与文件缓存的容量相同
+};
+
+extern server_config g_config;
+
+bool parse_config(int argc, char * argv[]);     // 解析命令行参数，失败时返回false
+void usage(const char * prog);                  // 打印使用说明
+
+#endif
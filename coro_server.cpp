@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <vector>
+#include <unordered_set>
+#include "coroutine.h"
+#include "coro_server.h"
+#include "log.h"
+#include "metrics.h"
+#include "trace.h"
+#include "upgrade.h"
+#include "listener.h"
+#include "affinity.h"
+#include "config.h"
+
+// 每个调度线程的参数
+struct coro_thread_arg {
+    const int * listenfds;
+    int listen_count;
+    http_conn * users;
+    io_waiter * waiters;    // 与users一一对应 以文件描述符为下标
+    int max_fd;
+};
+
+// 调度线程上还未结束的连接协程(以文件描述符记录) 协程帧销毁时自动移除
+struct live_guard {
+    std::unordered_set<int> & live;
+    int fd;
+
+    live_guard(std::unordered_set<int> & set, int sockfd) : live(set), fd(sockfd) { live.insert(fd); }
+    ~live_guard() { live.erase(fd); }
+};
+
+// 一个连接的完整生命周期：读取并解析请求 -> 生成应答 -> 写回 -> (keep-alive时)处理下一个请求
+static task serve_conn(scheduler & sched, http_conn * conn, io_waiter * waiter, std::unordered_set<int> & live, int fd) {
+    live_guard guard(live, fd);
+    while(true) {
+        // 解析请求 请求不完整时继续读取
+        http_conn::HTTP_CODE read_ret;
+        while((read_ret = conn->process_read()) == http_conn::NO_REQUEST) {
+            http_conn::IO_STATUS status = conn->read_some();
+            if(status == http_conn::IO_AGAIN) {
+                co_await sched.readable(waiter);
+            } else if(status != http_conn::IO_OK) {
+                conn->close_conn();
+                co_return;
+            }
+        }
+
+        if(read_ret == http_conn::H2_SESSION) {
+            // HTTP/2：此后连接上的所有流都由会话处理 直到连接关闭
+            http_conn::IO_STATUS status;
+            while((status = conn->h2_process()) == http_conn::IO_OK) {
+                if(conn->h2_want_write()) {
+                    co_await sched.writable(waiter);
+                } else {
+                    co_await sched.readable(waiter);
+                }
+            }
+            conn->close_conn();
+            co_return;
+        }
+
+        if(!conn->admit()) {
+            read_ret = http_conn::TOO_MANY_REQUESTS;    // 超过请求速率限制 应答429后关闭
+        }
+
+        // 生成应答并写回
+        if(!conn->process_write(read_ret)) {
+            conn->close_conn();
+            co_return;
+        }
+        http_conn::IO_STATUS status;
+        while((status = conn->write_some()) == http_conn::IO_AGAIN) {
+            co_await sched.writable(waiter);
+        }
+        if(status != http_conn::IO_OK || !conn->keep_alive()) {
+            conn->close_conn();
+            co_return;
+        }
+        conn->unmap();
+        conn->reset();
+    }
+}
+
+// 接收新连接 直到EAGAIN时挂起等待监听socket再次可读 每个监听socket一个
+static task accept_loop(scheduler & sched, coro_thread_arg * arg, int listenfd, io_waiter * listen_waiter,
+                        std::unordered_set<int> & live) {
+    while(true) {
+        struct sockaddr_in client_address;
+        int connfd = listen_accept(listenfd, client_address, SOCK_NONBLOCK);
+        if(connfd < 0) {
+            if(errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                LOG_ERROR("accept errno is %d", errno);
+            }
+            co_await sched.readable(listen_waiter);
+            continue;
+        }
+
+        if(connfd >= arg->max_fd || http_conn::m_user_count >= arg->max_fd) {
+            // 目前连接数满了
+            close(connfd);
+            continue;
+        }
+
+        if(!rate_limit_allow(client_address.sin_addr.s_addr, RL_CONNECTION)) {
+            // 该IP或网段新建连接过快
+            close(connfd);
+            continue;
+        }
+
+        http_conn * conn = arg->users + connfd;
+        io_waiter * waiter = arg->waiters + connfd;
+        waiter->reader = nullptr;
+        waiter->writer = nullptr;
+        conn->attach(connfd, client_address, sched.epollfd());
+        if(!sched.add(connfd, waiter)) {
+            conn->close_conn();
+            continue;
+        }
+        serve_conn(sched, conn, waiter, live, connfd);
+    }
+}
+
+// 排空时不再accept 连接全部关闭或超过期限后退出
+struct coro_drain_state {
+    scheduler * sched;
+    coro_thread_arg * arg;
+    bool listening;
+};
+
+static bool coro_tick(void * arg) {
+    coro_drain_state * state = (coro_drain_state *)arg;
+    if(!draining()) {
+        return true;
+    }
+    if(state->listening) {
+        // accept_loop停留在挂起状态 线程结束时销毁
+        for(int i = 0; i < state->arg->listen_count; i++) {
+            epoll_ctl(state->sched->epollfd(), EPOLL_CTL_DEL, state->arg->listenfds[i], NULL);
+        }
+        state->listening = false;
+    }
+    return !drain_finished();
+}
+
+// 销毁挂起在io_waiter上的协程帧
+static void destroy_suspended(io_waiter * waiter) {
+    std::coroutine_handle<> h = waiter->reader ? waiter->reader : waiter->writer;
+    waiter->reader = nullptr;
+    waiter->writer = nullptr;
+    if(h) {
+        h.destroy();
+    }
+}
+
+static void * coro_worker(void * arg) {
+    coro_thread_arg * targ = (coro_thread_arg *)arg;
+    scheduler sched;
+    io_waiter listen_waiters[MAX_LISTEN] = {};
+    std::unordered_set<int> live;
+    bool ok = true;
+    for(int i = 0; i < targ->listen_count && ok; i++) {
+        // 多个线程共享同一个监听socket EPOLLEXCLUSIVE避免新连接到来时惊醒所有线程
+        if(!sched.add(targ->listenfds[i], listen_waiters + i, EPOLLIN | EPOLLET | EPOLLEXCLUSIVE)) {
+            LOG_ERROR("add listenfd failure");
+            ok = false;
+            break;
+        }
+        accept_loop(sched, targ, targ->listenfds[i], listen_waiters + i, live);
+    }
+    if(ok) {
+        coro_drain_state drain = { &sched, targ, true };
+        sched.set_tick(coro_tick, &drain, DRAIN_CHECK_MS);
+        sched.run();
+    }
+
+    // 排空到期时仍挂起的连接：关闭连接并销毁协程帧(帧销毁时从live中移除)
+    std::vector<int> remaining(live.begin(), live.end());
+    for(size_t i = 0; i < remaining.size(); i++) {
+        int fd = remaining[i];
+        targ->users[fd].close_conn();
+        destroy_suspended(targ->waiters + fd);
+    }
+    for(int i = 0; i < targ->listen_count; i++) {
+        destroy_suspended(listen_waiters + i);
+    }
+    // 交还线程私有的指标分片和日志、追踪缓冲区
+    metrics_thread_exit();
+    log_thread_exit();
+    trace_thread_exit();
+    return NULL;
+}
+
+int run_coro_server(const int * listenfds, int listen_count, http_conn * users, int max_fd, int thread_number) {
+    // 监听socket需要为非阻塞 accept在EAGAIN时挂起协程
+    for(int i = 0; i < listen_count; i++) {
+        fcntl(listenfds[i], F_SETFL, fcntl(listenfds[i], F_GETFL) | O_NONBLOCK);
+    }
+
+    io_waiter * waiters = new io_waiter[max_fd];
+    coro_thread_arg arg = { listenfds, listen_count, users, waiters, max_fd };
+    pthread_t * threads = new pthread_t[thread_number];
+    int created = 0;
+    for(; created < thread_number; created++) {
+        LOG_INFO("create the %d th coroutine scheduler", created);
+        if(pthread_create(threads + created, NULL, coro_worker, &arg) != 0) {
+            break;
+        }
+        affinity_pin_thread(threads[created], created);
+    }
+    for(int i = 0; i < created; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    delete [] threads;
+    delete [] waiters;
+    return created == thread_number ? 0 : -1;
+}
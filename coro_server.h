@@ -0,0 +1,14 @@
+#ifndef CORO_SERVER_H
+#define CORO_SERVER_H
+#include "http_conn.h"
+
+/*
+    协程模式：启动thread_number个线程，每个线程一个scheduler，
+    各自从同一组监听socket(TCP和Unix域)上accept连接，连接此后只由接收它的线程处理。
+    每个连接是一个协程，读请求、解析、应答、写回都是顺序代码，遇到EAGAIN时co_await挂起，
+    不再需要主线程与线程池之间的任务传递，也不再需要EPOLLONESHOT的重复注册。
+    函数阻塞直到所有调度线程退出，成功返回0
+*/
+int run_coro_server(const int * listenfds, int listen_count, http_conn * users, int max_fd, int thread_number);
+
+#endif
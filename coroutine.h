@@ -0,0 +1,126 @@
+#ifndef COROUTINE_H
+#define COROUTINE_H
+#include <coroutine>
+#include <exception>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <sys/epoll.h>
+#include "log.h"
+#include "busypoll.h"
+
+/*
+    协程模式下的基础设施
+    task        :   "发射后不管"的协程返回类型，创建后立即运行，结束时自动销毁协程帧
+    io_waiter   :   每个文件描述符一个，记录挂起在该描述符上等待可读/可写的协程
+    scheduler   :   每个线程一个的调度器，拥有自己的epollfd，epoll_wait返回后恢复对应的协程
+
+    描述符只在注册时调用一次epoll_ctl(EPOLLIN | EPOLLOUT | EPOLLET)，之后不再修改。
+    协程总是在读写返回EAGAIN之后才挂起，因此边沿触发不会丢失事件；
+    多余的唤醒是无害的，协程被唤醒后会重新尝试读写。
+*/
+
+struct task {
+    struct promise_type {
+        task get_return_object() noexcept { return task(); }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+};
+
+struct io_waiter {
+    std::coroutine_handle<> reader;     // 等待可读的协程
+    std::coroutine_handle<> writer;     // 等待可写的协程
+};
+
+// co_await的对象 挂起时把协程句柄登记到io_waiter对应的槽位
+struct io_awaiter {
+    std::coroutine_handle<> * slot;
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) noexcept { *slot = h; }
+    void await_resume() const noexcept {}
+};
+
+class scheduler {
+public:
+    static const int MAX_EVENT_NUMBER = 1024;   // 每次epoll_wait最多返回的事件数
+
+    scheduler() : m_stop(false), m_tick(NULL), m_tick_arg(NULL), m_tick_ms(-1) {
+        m_epollfd = epoll_create1(EPOLL_CLOEXEC);
+        if(m_epollfd < 0) {
+            throw std::exception();
+        }
+        busy_poll_epoll(m_epollfd);
+    }
+
+    ~scheduler() {
+        close(m_epollfd);
+    }
+
+    // 注册文件描述符 整个生命周期内只注册一次
+    bool add(int fd, io_waiter * waiter, unsigned int events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP) {
+        epoll_event event;
+        event.data.ptr = waiter;
+        event.events = events;
+        return epoll_ctl(m_epollfd, EPOLL_CTL_ADD, fd, &event) == 0;
+    }
+
+    io_awaiter readable(io_waiter * waiter) { return io_awaiter{ &waiter->reader }; }
+    io_awaiter writable(io_waiter * waiter) { return io_awaiter{ &waiter->writer }; }
+
+    int epollfd() const { return m_epollfd; }
+    void stop() { m_stop = true; }
+
+    // 每次epoll_wait返回(至少每interval_ms毫秒)后调用tick，返回false时事件循环退出
+    void set_tick(bool (*tick)(void *), void * arg, int interval_ms) {
+        m_tick = tick;
+        m_tick_arg = arg;
+        m_tick_ms = interval_ms;
+    }
+
+    // 事件循环 恢复就绪描述符上挂起的协程
+    void run() {
+        epoll_event events[MAX_EVENT_NUMBER];
+        spin_policy spin;
+        while(!m_stop) {
+            int number = busy_epoll_wait(spin, m_epollfd, events, MAX_EVENT_NUMBER, m_tick_ms);
+            if((number < 0) && (errno != EINTR)) {
+                LOG_ERROR("epoll failure");
+                break;
+            }
+            for(int i = 0; i < number; i++) {
+                io_waiter * waiter = (io_waiter *)events[i].data.ptr;
+                unsigned int ev = events[i].events;
+                // 出错或对方关闭时同时唤醒读写两方，由协程在读写时发现错误
+                if((ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && waiter->reader) {
+                    resume(waiter->reader);
+                }
+                if((ev & (EPOLLOUT | EPOLLHUP | EPOLLERR)) && waiter->writer) {
+                    resume(waiter->writer);
+                }
+            }
+            if(m_tick && !m_tick(m_tick_arg)) {
+                break;
+            }
+        }
+    }
+
+private:
+    // 先清空槽位再恢复，协程可能在运行期间再次挂起到同一个槽位
+    static void resume(std::coroutine_handle<> & slot) {
+        std::coroutine_handle<> h = slot;
+        slot = nullptr;
+        h.resume();
+    }
+
+    int m_epollfd;
+    bool m_stop;
+    bool (*m_tick)(void *);
+    void * m_tick_arg;
+    int m_tick_ms;
+};
+
+#endif
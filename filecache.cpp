@@ -0,0 +1,157 @@
+#include <fcntl.h>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "filecache.h"
+
+file_cache g_file_cache(64 << 20);
+
+file_cache::file_cache(size_t capacity) : m_capacity(capacity), m_size(0) {
+}
+
+file_cache::~file_cache() {
+    for(std::list<entry *>::iterator it = m_lru.begin(); it != m_lru.end(); ++it) {
+        destroy(*it);
+    }
+}
+
+file_cache::entry * file_cache::acquire(const char * path) {
+    m_locker.lock();
+    std::unordered_map<std::string, entry *>::iterator it = m_entries.find(path);
+    if(it == m_entries.end()) {
+        m_locker.unlock();
+        return NULL;
+    }
+    entry * e = it->second;
+    e->refs++;
+    e->hits++;
+    m_lru.splice(m_lru.begin(), m_lru, e->lru);    // 移动到最近使用的位置
+    m_locker.unlock();
+    return e;
+}
+
+file_cache::entry * file_cache::load(const char * path, const struct stat & st) {
+    if(!enabled() || st.st_size <= 0 || st.st_size > MAX_FILE_SIZE) {
+        return NULL;
+    }
+
+    // 打开和映射文件时不持有锁
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        return NULL;
+    }
+    char * address = (char *)mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(address == MAP_FAILED) {
+        return NULL;
+    }
+
+    entry * e = new entry;
+    e->path = path;
+    e->address = address;
+    e->st = st;
+    e->checked = time(NULL);
+    e->refs = 1;
+    e->hits = 1;
+    e->cached = true;
+
+    m_locker.lock();
+    std::unordered_map<std::string, entry *>::iterator it = m_entries.find(e->path);
+    if(it != m_entries.end()) {
+        // 其他线程已经加载了同一个文件 替换掉旧的缓存项
+        remove(it->second);
+    }
+    m_lru.push_front(e);
+    e->lru = m_lru.begin();
+    m_entries[e->path] = e;
+    m_size += st.st_size;
+
+    // 超出容量时从最久未使用的一端淘汰 当前加载的缓存项不淘汰
+    while(m_size > m_capacity && m_lru.back() != e) {
+        remove(m_lru.back());
+    }
+    m_locker.unlock();
+    return e;
+}
+
+void file_cache::release(entry * e) {
+    m_locker.lock();
+    bool last = (--e->refs == 0) && !e->cached;
+    m_locker.unlock();
+    if(last) {
+        destroy(e);
+    }
+}
+
+void file_cache::invalidate(entry * e) {
+    m_locker.lock();
+    if(e->cached) {
+        remove(e);
+    }
+    m_locker.unlock();
+}
+
+void file_cache::checked(entry * e, time_t now) {
+    m_locker.lock();
+    e->checked = now;
+    m_locker.unlock();
+}
+
+bool file_cache::contains(const char * path) {
+    m_locker.lock();
+    bool hit = m_entries.find(path) != m_entries.end();
+    m_locker.unlock();
+    return hit;
+}
+
+bool file_cache::preload(const char * path, const struct stat & st, uint64_t hits) {
+    if(contains(path)) {
+        return false;
+    }
+    entry * e = load(path, st);
+    if(!e) {
+        return false;
+    }
+    // 页缓存中的页映射进来 之后的请求不再缺页
+#ifdef MADV_POPULATE_READ
+    if(madvise(e->address, st.st_size, MADV_POPULATE_READ) != 0)
+#endif
+    {
+        for(off_t i = 0; i < st.st_size; i += 4096) {
+            *(volatile char *)(e->address + i);
+        }
+    }
+    m_locker.lock();
+    e->hits = hits;
+    m_locker.unlock();
+    release(e);
+    return true;
+}
+
+void file_cache::snapshot(std::vector<hot_file> & files) {
+    m_locker.lock();
+    files.reserve(m_entries.size());
+    for(std::list<entry *>::iterator it = m_lru.begin(); it != m_lru.end(); ++it) {
+        hot_file file = { (*it)->path, (*it)->st.st_size, (*it)->hits };
+        files.push_back(file);
+    }
+    m_locker.unlock();
+    std::stable_sort(files.begin(), files.end(), [](const hot_file & a, const hot_file & b) {
+        return a.hits > b.hits;
+    });
+}
+
+void file_cache::remove(entry * e) {
+    m_entries.erase(e->path);
+    m_lru.erase(e->lru);
+    m_size -= e->st.st_size;
+    e->cached = false;
+    if(e->refs == 0) {
+        destroy(e);
+    }
+}
+
+void file_cache::destroy(entry * e) {
+    munmap(e->address, e->st.st_size);
+    delete e;
+}
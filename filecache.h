@@ -0,0 +1,70 @@
+#ifndef FILECACHE_H
+#define FILECACHE_H
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <stdint.h>
+#include <string>
+#include <list>
+#include <vector>
+#include <unordered_map>
+#include "locker.h"
+
+/*
+    静态文件缓存：把较小的文件mmap一次后在所有连接间共享，避免每个请求都 stat/open/mmap/munmap。
+    缓存项带有引用计数，被淘汰或失效时如果仍有连接在发送，则等引用归零后再munmap。
+    缓存项每隔CHECK_INTERVAL秒由使用者重新stat校验一次，文件被修改后失效重新加载。
+    每个缓存项记录命中次数，热点文件的列表由warmup定期保存，重启后据此预先加载。
+*/
+class file_cache {
+public:
+    static const off_t MAX_FILE_SIZE = 1 << 20;    // 只缓存不超过1MB的文件
+    static const int CHECK_INTERVAL = 1;            // 缓存项的校验间隔(秒)
+
+    struct entry {
+        std::string path;       // 文件的完整路径
+        char * address;         // 文件被mmap到内存中的起始地址
+        struct stat st;         // 加载时的文件状态
+        time_t checked;         // 上次校验的时间
+        int refs;               // 正在使用该缓存项的连接数
+        uint64_t hits;          // 命中次数(预先加载时为保存的次数)
+        bool cached;            // 是否仍在缓存中(被淘汰或失效后为false)
+        std::list<entry *>::iterator lru;
+    };
+
+    struct hot_file {
+        std::string path;
+        off_t size;
+        uint64_t hits;
+    };
+
+    explicit file_cache(size_t capacity);
+    ~file_cache();
+
+    void set_capacity(size_t capacity) { m_capacity = capacity; }
+    bool enabled() const { return m_capacity > 0; }
+
+    entry * acquire(const char * path);                         // 命中时增加引用计数并返回，未命中返回NULL
+    entry * load(const char * path, const struct stat & st);    // 把文件加载进缓存，返回已增加引用的缓存项，失败返回NULL
+    void release(entry * e);                                    // 归还缓存项
+    void invalidate(entry * e);                                 // 文件已被修改，使缓存项失效
+    void checked(entry * e, time_t now);                        // 记录缓存项已在now时刻校验过
+    bool contains(const char * path);                           // 仅判断是否命中，不增加引用计数
+    // 加载文件并预先触发所有页的缺页 hits为命中次数的初始值；已经缓存或不能缓存时返回false
+    bool preload(const char * path, const struct stat & st, uint64_t hits);
+    void snapshot(std::vector<hot_file> & files);               // 当前缓存的全部文件 按命中次数从多到少
+
+private:
+    void remove(entry * e);     // 从缓存中移除，调用者需持有锁
+    static void destroy(entry * e);
+
+    size_t m_capacity;          // 缓存的最大字节数
+    size_t m_size;              // 当前缓存的字节数
+    std::unordered_map<std::string, entry *> m_entries;
+    std::list<entry *> m_lru;   // 最近使用的在前
+    locker m_locker;
+};
+
+extern file_cache g_file_cache;
+
+#endif
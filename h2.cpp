@@ -0,0 +1,668 @@
+#include <string.h>
+#include <vector>
+#include "h2.h"
+
+// 帧类型
+enum H2_FRAME_TYPE {
+    H2_DATA = 0, H2_HEADERS, H2_PRIORITY, H2_RST_STREAM, H2_SETTINGS,
+    H2_PUSH_PROMISE, H2_PING, H2_GOAWAY, H2_WINDOW_UPDATE, H2_CONTINUATION
+};
+
+// 帧标志
+static const uint8_t FLAG_END_STREAM = 0x1;
+static const uint8_t FLAG_ACK = 0x1;
+static const uint8_t FLAG_END_HEADERS = 0x4;
+static const uint8_t FLAG_PADDED = 0x8;
+static const uint8_t FLAG_PRIORITY = 0x20;
+
+// 错误码
+enum H2_ERROR {
+    H2_NO_ERROR = 0, H2_PROTOCOL_ERROR, H2_INTERNAL_ERROR, H2_FLOW_CONTROL_ERROR, H2_SETTINGS_TIMEOUT,
+    H2_STREAM_CLOSED, H2_FRAME_SIZE_ERROR, H2_REFUSED_STREAM, H2_CANCEL, H2_COMPRESSION_ERROR,
+    H2_CONNECT_ERROR, H2_ENHANCE_YOUR_CALM
+};
+
+// SETTINGS参数
+enum H2_SETTING {
+    SETTINGS_HEADER_TABLE_SIZE = 1, SETTINGS_ENABLE_PUSH, SETTINGS_MAX_CONCURRENT_STREAMS,
+    SETTINGS_INITIAL_WINDOW_SIZE, SETTINGS_MAX_FRAME_SIZE, SETTINGS_MAX_HEADER_LIST_SIZE
+};
+
+static const char PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+static const size_t PREFACE_LEN = sizeof(PREFACE) - 1;
+static const uint32_t DEFAULT_FRAME_SIZE = 16384;   // 本端接收的最大帧 没有通告更大的值
+static const int64_t MAX_WINDOW = 0x7fffffff;
+static const uint32_t DEFAULT_WINDOW = 65535;
+
+extern const char * error_400_form;
+extern const char * error_403_form;
+extern const char * error_404_form;
+extern const char * error_429_form;
+extern const char * error_500_form;
+
+static uint32_t get32(const uint8_t * p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void put32(uint8_t * p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+// HTTP2-Settings头部的值：base64url编码且省略填充
+static bool base64url_decode(const char * text, std::string & out) {
+    uint32_t acc = 0;
+    int bits = 0;
+    for(; *text && *text != '='; text++) {
+        char c = *text;
+        int v;
+        if(c >= 'A' && c <= 'Z') v = c - 'A';
+        else if(c >= 'a' && c <= 'z') v = c - 'a' + 26;
+        else if(c >= '0' && c <= '9') v = c - '0' + 52;
+        else if(c == '-' || c == '+') v = 62;
+        else if(c == '_' || c == '/') v = 63;
+        else return false;
+        acc = (acc << 6) | v;
+        bits += 6;
+        if(bits >= 8) {
+            bits -= 8;
+            out.push_back((char)(acc >> bits));
+        }
+    }
+    return true;
+}
+
+h2_session::h2_session(int fd, uint32_t ip)
+    : m_fd(fd), m_ip(ip), m_preface(0), m_settings_received(false), m_failed(false), m_goaway(false),
+      m_last_stream(0), m_continuation(0), m_header_flags(0),
+      m_window(DEFAULT_WINDOW), m_initial_window(DEFAULT_WINDOW), m_max_frame(DEFAULT_FRAME_SIZE),
+      m_opened(0), m_resets(0), m_recv_unacked(0), m_next(0), m_out_offset(0), m_queued(0), m_written(0) {
+    metrics_add(M_H2_CONNECTIONS);
+}
+
+h2_session::~h2_session() {
+    for(std::map<uint32_t, stream *>::iterator it = m_streams.begin(); it != m_streams.end(); ++it) {
+        http_conn::release_body(it->second->body);
+        delete it->second;
+    }
+    release(true);
+}
+
+void h2_session::start() {
+    settings();
+}
+
+bool h2_session::upgrade(const char * settings_text, http_conn::METHOD method, const char * url) {
+    std::string payload;
+    if(!base64url_decode(settings_text, payload) || payload.size() % 6 != 0) {
+        return false;
+    }
+    static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+    control(switching, sizeof(switching) - 1);
+    settings();
+    // HTTP2-Settings相当于对方的第一个SETTINGS 101应答即是确认
+    if(on_settings((const uint8_t *)payload.data(), payload.size()) != H2_NO_ERROR) {
+        goaway(H2_PROTOCOL_ERROR);
+        return true;
+    }
+    m_last_stream = 1;
+    respond(1, method, url);
+    return true;
+}
+
+bool h2_session::want_read() {
+    release(false);     // 先释放已经写出的流 剩下的流都还有数据等待写出
+    return m_queued - m_written < INPUT_PAUSE_WATER && m_finished.size() < MAX_CONCURRENT_STREAMS;
+}
+
+bool h2_session::done() const {
+    return m_goaway && m_streams.empty() && m_out.empty();
+}
+
+void h2_session::control(const void * data, size_t len) {
+    if(!m_out.empty() && !m_out.back().data && m_out.back().offset + m_out.back().len == m_control.size()) {
+        m_out.back().len += len;
+    } else {
+        segment seg = { NULL, m_control.size(), len };
+        m_out.push_back(seg);
+    }
+    m_control.append((const char *)data, len);
+    m_queued += len;
+}
+
+void h2_session::frame_header(uint32_t len, uint8_t type, uint8_t flags, uint32_t id) {
+    uint8_t header[9];
+    header[0] = len >> 16;
+    header[1] = len >> 8;
+    header[2] = len;
+    header[3] = type;
+    header[4] = flags;
+    put32(header + 5, id & 0x7fffffff);
+    control(header, sizeof(header));
+}
+
+void h2_session::settings() {
+    static const uint16_t ids[] = { SETTINGS_MAX_CONCURRENT_STREAMS, SETTINGS_MAX_HEADER_LIST_SIZE };
+    static const uint32_t values[] = { MAX_CONCURRENT_STREAMS, hpack_decoder::MAX_HEADER_LIST_SIZE };
+    uint8_t payload[12];
+    for(int i = 0; i < 2; i++) {
+        payload[i * 6] = ids[i] >> 8;
+        payload[i * 6 + 1] = ids[i];
+        put32(payload + i * 6 + 2, values[i]);
+    }
+    frame_header(sizeof(payload), H2_SETTINGS, 0, 0);
+    control(payload, sizeof(payload));
+}
+
+// 发送GOAWAY 连接错误时丢弃所有未完成的流
+void h2_session::goaway(uint32_t error) {
+    if(m_goaway && error == H2_NO_ERROR) {
+        return;
+    }
+    uint8_t payload[8];
+    put32(payload, m_last_stream);
+    put32(payload + 4, error);
+    frame_header(sizeof(payload), H2_GOAWAY, 0, 0);
+    control(payload, sizeof(payload));
+    m_goaway = true;
+    if(error != H2_NO_ERROR) {
+        LOG_DEBUG("h2 connection error %u on fd %d", error, m_fd);
+        m_failed = true;
+        while(!m_streams.empty()) {
+            close_stream(m_streams.begin()->second);
+        }
+    }
+}
+
+void h2_session::rst_stream(uint32_t id, uint32_t error) {
+    uint8_t payload[4];
+    put32(payload, error);
+    frame_header(sizeof(payload), H2_RST_STREAM, 0, id);
+    control(payload, sizeof(payload));
+}
+
+void h2_session::window_update(uint32_t id, uint32_t increment) {
+    uint8_t payload[4];
+    put32(payload, increment);
+    frame_header(sizeof(payload), H2_WINDOW_UPDATE, 0, id);
+    control(payload, sizeof(payload));
+}
+
+void h2_session::feed(const char * data, size_t len) {
+    if(m_failed) {
+        return;
+    }
+    // 连接前言 可能分多次到达
+    while(m_preface < PREFACE_LEN && len > 0) {
+        if(*data != PREFACE[m_preface]) {
+            goaway(H2_PROTOCOL_ERROR);
+            return;
+        }
+        m_preface++;
+        data++;
+        len--;
+    }
+    if(len == 0) {
+        return;
+    }
+
+    m_input.append(data, len);
+    size_t pos = 0;
+    while(!m_failed && m_input.size() - pos >= 9) {
+        const uint8_t * p = (const uint8_t *)m_input.data() + pos;
+        uint32_t length = (p[0] << 16) | (p[1] << 8) | p[2];
+        if(length > DEFAULT_FRAME_SIZE) {
+            goaway(H2_FRAME_SIZE_ERROR);
+            break;
+        }
+        if(m_input.size() - pos < 9 + length) {
+            break;
+        }
+        uint32_t error = process_frame(p[3], p[4], get32(p + 5) & 0x7fffffff, p + 9, length);
+        if(error != H2_NO_ERROR) {
+            goaway(error);
+            break;
+        }
+        pos += 9 + length;
+    }
+    m_input.erase(0, pos);
+}
+
+uint32_t h2_session::process_frame(uint8_t type, uint8_t flags, uint32_t id, const uint8_t * payload, uint32_t len) {
+    // 对方的第一个帧必须是SETTINGS 头部块必须连续
+    if(!m_settings_received && type != H2_SETTINGS) {
+        return H2_PROTOCOL_ERROR;
+    }
+    if(m_continuation && (type != H2_CONTINUATION || id != m_continuation)) {
+        return H2_PROTOCOL_ERROR;
+    }
+
+    switch(type) {
+        case H2_DATA: {
+            if(id == 0 || id > m_last_stream) {
+                return H2_PROTOCOL_ERROR;
+            }
+            // 请求体不会被使用 直接归还连接的接收窗口 累计到一半时才发送
+            m_recv_unacked += len;
+            if(m_recv_unacked >= DEFAULT_WINDOW / 2) {
+                window_update(0, m_recv_unacked);
+                m_recv_unacked = 0;
+            }
+            return H2_NO_ERROR;
+        }
+        case H2_HEADERS:
+            return on_headers(flags, id, payload, len);
+        case H2_PRIORITY: {
+            if(id == 0) {
+                return H2_PROTOCOL_ERROR;
+            }
+            return len == 5 ? H2_NO_ERROR : H2_FRAME_SIZE_ERROR;
+        }
+        case H2_RST_STREAM: {
+            if(id == 0 || id > m_last_stream) {
+                return H2_PROTOCOL_ERROR;
+            }
+            if(len != 4) {
+                return H2_FRAME_SIZE_ERROR;
+            }
+            std::map<uint32_t, stream *>::iterator it = m_streams.find(id);
+            if(it != m_streams.end()) {
+                close_stream(it->second);
+            }
+            // 打开后立即取消的流同样要查找并打开应答内容 大量取消时断开连接
+            if(++m_resets > MAX_RESETS && m_resets * 2 > m_opened) {
+                return H2_ENHANCE_YOUR_CALM;
+            }
+            return H2_NO_ERROR;
+        }
+        case H2_SETTINGS: {
+            if(id != 0) {
+                return H2_PROTOCOL_ERROR;
+            }
+            if(flags & FLAG_ACK) {
+                return len == 0 ? H2_NO_ERROR : H2_FRAME_SIZE_ERROR;
+            }
+            if(len % 6 != 0) {
+                return H2_FRAME_SIZE_ERROR;
+            }
+            uint32_t error = on_settings(payload, len);
+            if(error == H2_NO_ERROR) {
+                m_settings_received = true;
+                frame_header(0, H2_SETTINGS, FLAG_ACK, 0);
+            }
+            return error;
+        }
+        case H2_PUSH_PROMISE:
+            return H2_PROTOCOL_ERROR;   // 客户端不能推送
+        case H2_PING: {
+            if(id != 0) {
+                return H2_PROTOCOL_ERROR;
+            }
+            if(len != 8) {
+                return H2_FRAME_SIZE_ERROR;
+            }
+            if(!(flags & FLAG_ACK)) {
+                frame_header(8, H2_PING, FLAG_ACK, 0);
+                control(payload, 8);
+            }
+            return H2_NO_ERROR;
+        }
+        case H2_GOAWAY: {
+            if(id != 0) {
+                return H2_PROTOCOL_ERROR;
+            }
+            // 对方不再发起新的流 已有的流应答完后关闭连接
+            goaway(H2_NO_ERROR);
+            return H2_NO_ERROR;
+        }
+        case H2_WINDOW_UPDATE:
+            return on_window_update(id, payload, len);
+        case H2_CONTINUATION: {
+            if(!m_continuation) {
+                return H2_PROTOCOL_ERROR;
+            }
+            m_header_block.append((const char *)payload, len);
+            if(m_header_block.size() > hpack_decoder::MAX_HEADER_LIST_SIZE) {
+                return H2_ENHANCE_YOUR_CALM;
+            }
+            return (flags & FLAG_END_HEADERS) ? on_header_block(id) : H2_NO_ERROR;
+        }
+        default:
+            return H2_NO_ERROR;     // 未知类型的帧必须忽略
+    }
+}
+
+uint32_t h2_session::on_headers(uint8_t flags, uint32_t id, const uint8_t * payload, uint32_t len) {
+    if(id == 0 || !(id & 1)) {
+        return H2_PROTOCOL_ERROR;
+    }
+    if(flags & FLAG_PADDED) {
+        if(len < 1 || payload[0] >= len) {
+            return H2_PROTOCOL_ERROR;
+        }
+        len -= 1 + payload[0];
+        payload++;
+    }
+    if(flags & FLAG_PRIORITY) {
+        if(len < 5) {
+            return H2_PROTOCOL_ERROR;
+        }
+        payload += 5;
+        len -= 5;
+    }
+    m_header_block.assign((const char *)payload, len);
+    m_header_flags = flags;
+    if(!(flags & FLAG_END_HEADERS)) {
+        m_continuation = id;
+        return H2_NO_ERROR;
+    }
+    return on_header_block(id);
+}
+
+// 头部块接收完整 解码(即使流被拒绝也必须解码以保持动态表同步)并开始应答
+uint32_t h2_session::on_header_block(uint32_t id) {
+    m_continuation = 0;
+    std::vector<hpack_header> headers;
+    if(!m_decoder.decode((const uint8_t *)m_header_block.data(), m_header_block.size(), headers)) {
+        return H2_COMPRESSION_ERROR;
+    }
+    m_header_block.clear();
+    if(id <= m_last_stream) {
+        // 已经在应答的流上的尾部头部 忽略
+        return H2_NO_ERROR;
+    }
+    m_last_stream = id;
+    if(m_goaway) {
+        return H2_NO_ERROR;
+    }
+    // 应答还没写完的流对方仍计为打开 并且仍占用应答内容
+    if(m_streams.size() + m_finished.size() >= MAX_CONCURRENT_STREAMS) {
+        rst_stream(id, H2_REFUSED_STREAM);
+        return H2_NO_ERROR;
+    }
+
+    const char * method = NULL;
+    const char * path = NULL;
+    for(size_t i = 0; i < headers.size(); i++) {
+        if(headers[i].name == ":method") {
+            method = headers[i].value.c_str();
+        } else if(headers[i].name == ":path") {
+            path = headers[i].value.c_str();
+        }
+    }
+    if(!method || !path || path[0] != '/') {
+        rst_stream(id, H2_PROTOCOL_ERROR);
+        return H2_NO_ERROR;
+    }
+    http_conn::METHOD m = http_conn::POST;     // 不支持的方法应答400
+    if(strcmp(method, "GET") == 0) {
+        m = http_conn::GET;
+    } else if(strcmp(method, "HEAD") == 0) {
+        m = http_conn::HEAD;
+    }
+    respond(id, m, path);
+    return H2_NO_ERROR;
+}
+
+uint32_t h2_session::on_settings(const uint8_t * payload, uint32_t len) {
+    for(uint32_t i = 0; i + 6 <= len; i += 6) {
+        uint16_t setting = (payload[i] << 8) | payload[i + 1];
+        uint32_t value = get32(payload + i + 2);
+        switch(setting) {
+            case SETTINGS_ENABLE_PUSH:
+                if(value > 1) {
+                    return H2_PROTOCOL_ERROR;
+                }
+                break;
+            case SETTINGS_INITIAL_WINDOW_SIZE: {
+                if(value > MAX_WINDOW) {
+                    return H2_FLOW_CONTROL_ERROR;
+                }
+                // 按差值调整所有流的发送窗口 可能变为负数
+                int64_t delta = (int64_t)value - m_initial_window;
+                for(std::map<uint32_t, stream *>::iterator it = m_streams.begin(); it != m_streams.end(); ++it) {
+                    it->second->window += delta;
+                    if(it->second->window > MAX_WINDOW) {
+                        return H2_FLOW_CONTROL_ERROR;
+                    }
+                }
+                m_initial_window = value;
+                break;
+            }
+            case SETTINGS_MAX_FRAME_SIZE:
+                if(value < DEFAULT_FRAME_SIZE || value > 0xffffff) {
+                    return H2_PROTOCOL_ERROR;
+                }
+                m_max_frame = value;
+                break;
+            default:
+                // 编码器不使用动态表 HEADER_TABLE_SIZE无需处理；未知的参数必须忽略
+                break;
+        }
+    }
+    return H2_NO_ERROR;
+}
+
+uint32_t h2_session::on_window_update(uint32_t id, const uint8_t * payload, uint32_t len) {
+    if(len != 4) {
+        return H2_FRAME_SIZE_ERROR;
+    }
+    uint32_t increment = get32(payload) & 0x7fffffff;
+    if(id == 0) {
+        if(increment == 0) {
+            return H2_PROTOCOL_ERROR;
+        }
+        m_window += increment;
+        return m_window > MAX_WINDOW ? H2_FLOW_CONTROL_ERROR : H2_NO_ERROR;
+    }
+    if(id > m_last_stream) {
+        return H2_PROTOCOL_ERROR;
+    }
+    std::map<uint32_t, stream *>::iterator it = m_streams.find(id);
+    if(it == m_streams.end()) {
+        return H2_NO_ERROR;     // 已经应答完的流
+    }
+    stream * s = it->second;
+    s->window += increment;
+    if(increment == 0 || s->window > MAX_WINDOW) {
+        rst_stream(id, increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+        close_stream(s);
+    }
+    return H2_NO_ERROR;
+}
+
+// 查找应答内容并生成HEADERS帧 DATA帧由generate()按窗口逐步生成
+void h2_session::respond(uint32_t id, http_conn::METHOD method, const char * url) {
+    metrics_add(M_H2_STREAMS);
+    m_opened++;
+    stream * s = new stream();
+    s->id = id;
+    s->window = m_initial_window;
+    s->method = method;
+    s->url = url;
+    s->start = metrics_now();
+    s->body_sent = 0;
+    s->release_at = 0;
+    memset(&s->body, 0, sizeof(s->body));
+    s->body.content_type = "text/html";
+
+    char path[http_conn::FILENAME_LEN];
+    http_conn::HTTP_CODE ret = http_conn::BAD_REQUEST;
+    if(!rate_limit_allow(m_ip, RL_REQUEST)) {
+        ret = http_conn::TOO_MANY_REQUESTS;
+    } else if(method == http_conn::GET || method == http_conn::HEAD) {
+        ret = http_conn::open_body(url, path, s->body);
+    }
+    switch(ret) {
+        case http_conn::FILE_REQUEST:
+            s->status = 200;
+            s->data = s->body.address;
+            s->body_len = s->body.st.st_size;
+            break;
+        case http_conn::FORBIDDEN_REQUEST:
+            s->status = 403;
+            s->data = error_403_form;
+            break;
+        case http_conn::NO_RESOURCE:
+            s->status = 404;
+            s->data = error_404_form;
+            break;
+        case http_conn::BAD_REQUEST:
+            s->status = 400;
+            s->data = error_400_form;
+            break;
+        case http_conn::TOO_MANY_REQUESTS:
+            s->status = 429;
+            s->data = error_429_form;
+            break;
+        default:
+            s->status = 500;
+            s->data = error_500_form;
+            break;
+    }
+    if(ret != http_conn::FILE_REQUEST) {
+        http_conn::release_body(s->body);
+        s->body_len = strlen(s->data);
+        s->body.content_type = "text/html";
+    }
+
+    std::string block;
+    char length[24];
+    int n = snprintf(length, sizeof(length), "%zu", s->body_len);
+    hpack_encode_status(block, s->status);
+    hpack_encode_literal(block, HPACK_CONTENT_LENGTH, length, n);
+    hpack_encode_literal(block, HPACK_CONTENT_TYPE, s->body.content_type, strlen(s->body.content_type));
+
+    bool end = s->body_len == 0 || method == http_conn::HEAD;
+    frame_header(block.size(), H2_HEADERS, FLAG_END_HEADERS | (end ? FLAG_END_STREAM : 0), id);
+    control(block.data(), block.size());
+    if(end) {
+        s->body_sent = s->body_len = 0;
+        s->release_at = m_queued;
+        m_finished.push_back(s);
+    } else {
+        m_streams[id] = s;
+    }
+}
+
+// 流被取消或连接出错 已经生成的帧可能仍引用应答内容，同样等写出后再释放
+void h2_session::close_stream(stream * s) {
+    m_streams.erase(s->id);
+    s->status = 0;
+    s->release_at = m_queued;
+    m_finished.push_back(s);
+}
+
+// 轮流为各个流生成DATA帧 直到窗口用完或待发送的数据足够多
+void h2_session::generate() {
+    if(http_conn::m_draining && !m_goaway) {
+        // 进程正在排空 不再接受新的流 已有的流应答完后关闭连接
+        goaway(H2_NO_ERROR);
+    }
+    if(!m_settings_received) {
+        // h2c升级后等待客户端的连接前言和SETTINGS 客户端在此之前只能缓存101之后很少的数据
+        return;
+    }
+    while(!m_streams.empty() && m_window > 0 && m_queued - m_written < OUTPUT_HIGH_WATER) {
+        std::map<uint32_t, stream *>::iterator it = m_streams.lower_bound(m_next);
+        stream * s = NULL;
+        for(size_t i = 0; i < m_streams.size(); i++, ++it) {
+            if(it == m_streams.end()) {
+                it = m_streams.begin();
+            }
+            if(it->second->window > 0) {
+                s = it->second;
+                break;
+            }
+        }
+        if(!s) {
+            break;      // 所有流都在等待WINDOW_UPDATE
+        }
+
+        size_t len = s->body_len - s->body_sent;
+        len = std::min<size_t>(len, m_window);
+        len = std::min<size_t>(len, s->window);
+        len = std::min<size_t>(len, m_max_frame);
+        bool last = s->body_sent + len == s->body_len;
+        frame_header(len, H2_DATA, last ? FLAG_END_STREAM : 0, s->id);
+        segment seg = { s->data + s->body_sent, 0, len };
+        m_out.push_back(seg);
+        m_queued += len;
+        s->body_sent += len;
+        s->window -= len;
+        m_window -= len;
+        m_next = s->id + 1;
+        if(last) {
+            m_streams.erase(s->id);
+            s->release_at = m_queued;
+            m_finished.push_back(s);
+        }
+    }
+}
+
+int h2_session::pending(struct iovec * iov, int max) {
+    if(!m_failed) {
+        generate();
+    }
+    int count = 0;
+    size_t skip = m_out_offset;
+    for(std::deque<segment>::iterator it = m_out.begin(); it != m_out.end() && count < max; ++it) {
+        const char * base = it->data ? it->data : m_control.data() + it->offset;
+        iov[count].iov_base = (void *)(base + skip);
+        iov[count].iov_len = it->len - skip;
+        skip = 0;
+        count++;
+    }
+    return count;
+}
+
+void h2_session::sent(size_t n) {
+    m_written += n;
+    n += m_out_offset;
+    while(!m_out.empty() && n >= m_out.front().len) {
+        n -= m_out.front().len;
+        m_out.pop_front();
+    }
+    m_out_offset = m_out.empty() ? 0 : n;
+    release(false);
+    compact();
+}
+
+// 写出的数据不再引用的控制字节可以丢弃 连续传输大文件时m_control不会一直增长
+void h2_session::compact() {
+    if(m_out.empty()) {
+        m_control.clear();
+        return;
+    }
+    size_t first = m_control.size();
+    for(std::deque<segment>::iterator it = m_out.begin(); it != m_out.end(); ++it) {
+        if(!it->data) {
+            first = it->offset;
+            break;
+        }
+    }
+    if(first < OUTPUT_HIGH_WATER) {
+        return;
+    }
+    m_control.erase(0, first);
+    for(std::deque<segment>::iterator it = m_out.begin(); it != m_out.end(); ++it) {
+        if(!it->data) {
+            it->offset -= first;
+        }
+    }
+}
+
+// 释放已经全部写出的流 all为true时(连接关闭)全部释放
+void h2_session::release(bool all) {
+    while(!m_finished.empty() && (all || m_finished.front()->release_at <= m_written)) {
+        stream * s = m_finished.front();
+        m_finished.pop_front();
+        if(s->status && !all) {
+            http_conn::record_response(m_fd, s->method, s->url.c_str(), s->status, s->body_len, s->start);
+        }
+        http_conn::release_body(s->body);
+        delete s;
+    }
+}
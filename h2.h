@@ -0,0 +1,135 @@
+#ifndef H2_H
+#define H2_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+#include <string>
+#include <deque>
+#include <map>
+#include "hpack.h"
+#include "http_conn.h"
+
+/*
+    HTTP/2(RFC 7540)
+    一个连接上的所有流共用连接的读缓冲区和一个h2_session，会话只负责协议本身，不做任何IO：
+    http_conn把读到的字节交给feed()，再用pending()取出待发送的数据块writev(或SSL_write)，
+    写出后调用sent()。因此线程池、协程和连接归属三种模式都只需要在原来的读写位置调用同一组函数。
+
+    建立方式：
+        明文先验知识(prior knowledge) :   连接的第一个请求以连接前言"PRI * HTTP/2.0"开头
+        明文升级(h2c)                :   HTTP/1.1请求带Upgrade: h2c和HTTP2-Settings，应答101后该请求成为流1
+        HTTPS                       :   握手时ALPN协商为"h2"
+
+    应答与HTTP/1共用http_conn::open_body：文件缓存、mmap或/metrics。DATA帧只生成9字节的帧头，
+    负载直接指向缓存或映射区，和帧头一起writev，文件内容不复制；流在内容全部写出后才归还缓存项或munmap。
+    多个流的DATA帧轮流生成，受连接和流两级发送窗口以及对方的SETTINGS_MAX_FRAME_SIZE限制，
+    已生成未写出的数据不超过OUTPUT_HIGH_WATER，新的请求不需要排在大文件的全部内容之后。
+
+    对不读取应答的客户端的防护：
+        控制帧(PING、SETTINGS的ACK，RST_STREAM)和帧头也计入待写出的字节数，超过INPUT_PAUSE_WATER，
+            或等待写出的流(仍占用缓存项或映射区)达到MAX_CONCURRENT_STREAMS时，want_read()为false，
+            http_conn暂停读取(只等待可写)，写出之后再继续
+        并发流的计数包括已生成全部帧但还没写出的流
+        客户端取消的流超过MAX_RESETS个且超过已打开的流的一半时("rapid reset")，发送GOAWAY(ENHANCE_YOUR_CALM)
+        请求体占用的连接接收窗口累计到一半时才发送一次WINDOW_UPDATE，而不是每个DATA帧一次
+
+    只支持GET和HEAD(与HTTP/1一致)，其他方法应答400。不支持服务器推送；请求的优先级被忽略。
+*/
+
+class h2_session {
+public:
+    static const uint32_t MAX_CONCURRENT_STREAMS = 100;     // 通告给客户端的并发流上限
+    static const size_t OUTPUT_HIGH_WATER = 64 * 1024;      // 预先生成的待发送字节数上限
+    static const int MAX_IOV = 64;                          // pending()一次最多给出的数据块数
+    static const size_t INPUT_PAUSE_WATER = 2 * OUTPUT_HIGH_WATER;  // 待写出的字节数超过它时暂停读取
+    static const uint32_t MAX_RESETS = 100;                 // 客户端取消流的次数超过它才检查比例
+
+    h2_session(int fd, uint32_t ip);    // ip为客户端地址(网络字节序)，用于按流限流
+    ~h2_session();
+
+    void start();       // 先验知识或ALPN：发送服务器的SETTINGS，等待连接前言
+    // h2c升级：应答101，按HTTP2-Settings(base64url)设置对方参数，原请求作为流1处理
+    bool upgrade(const char * settings, http_conn::METHOD method, const char * url);
+
+    void feed(const char * data, size_t len);   // 处理读到的数据 协议错误时发送GOAWAY并停止处理之后的输入
+    int pending(struct iovec * iov, int max);   // 取出待发送的数据块(不移除) 没有可发送的数据时返回0
+    void sent(size_t n);                        // pending()给出的数据块中已经写出了n字节
+    bool want_write() const { return !m_out.empty(); }
+    bool want_read();                           // 待写出的数据和等待写出的流都没有积压 可以继续读取
+    bool done() const;                          // 已发送GOAWAY且全部写出 可以关闭连接
+
+private:
+    // 待发送的数据块 控制帧和帧头位于m_control中(以偏移记录，追加时地址可能变化)，DATA负载直接指向应答内容
+    struct segment {
+        const char * data;      // 为NULL时表示m_control中从offset开始的字节
+        size_t offset;
+        size_t len;
+    };
+
+    struct stream {
+        uint32_t id;
+        int64_t window;         // 流的发送窗口
+        http_conn::METHOD method;
+        std::string url;
+        int status;
+        http_body body;         // 应答内容(文件缓存、映射区或动态生成)
+        const char * data;      // DATA帧的负载 错误应答时指向静态的错误页面
+        size_t body_len;
+        size_t body_sent;       // 已经生成DATA帧的字节数
+        uint64_t start;         // 收到请求头的时刻
+        uint64_t release_at;    // 全部帧已生成 m_written超过该值后归还应答内容
+    };
+
+    void control(const void * data, size_t len);
+    void frame_header(uint32_t len, uint8_t type, uint8_t flags, uint32_t id);
+    void settings();
+    void goaway(uint32_t error);
+    void rst_stream(uint32_t id, uint32_t error);
+    void window_update(uint32_t id, uint32_t increment);
+
+    // 以下处理函数返回连接错误的错误码 0表示没有错误
+    uint32_t process_frame(uint8_t type, uint8_t flags, uint32_t id, const uint8_t * payload, uint32_t len);
+    uint32_t on_headers(uint8_t flags, uint32_t id, const uint8_t * payload, uint32_t len);
+    uint32_t on_header_block(uint32_t id);
+    uint32_t on_settings(const uint8_t * payload, uint32_t len);
+    uint32_t on_window_update(uint32_t id, const uint8_t * payload, uint32_t len);
+
+    void respond(uint32_t id, http_conn::METHOD method, const char * url);
+    void close_stream(stream * s);
+    void generate();
+    void release(bool all);
+    void compact();
+
+    int m_fd;
+    uint32_t m_ip;
+    hpack_decoder m_decoder;
+    std::string m_input;            // 不完整的帧
+    size_t m_preface;               // 已经收到的连接前言字节数
+    bool m_settings_received;       // 已收到对方的第一个SETTINGS
+    bool m_failed;                  // 发生连接错误 不再处理输入
+    bool m_goaway;                  // 已发送GOAWAY 不再接受新的流
+    uint32_t m_last_stream;         // 已处理的最大的流ID
+    uint32_t m_continuation;        // 正在等待CONTINUATION的流 0表示没有
+    uint8_t m_header_flags;         // 该头部块的HEADERS帧带有的标志
+    std::string m_header_block;     // 正在拼接的头部块
+
+    int64_t m_window;               // 连接的发送窗口
+    uint32_t m_initial_window;      // 对方的SETTINGS_INITIAL_WINDOW_SIZE
+    uint32_t m_max_frame;           // 对方的SETTINGS_MAX_FRAME_SIZE
+
+    uint32_t m_opened;              // 已打开的流数
+    uint32_t m_resets;              // 客户端取消的流数
+    uint32_t m_recv_unacked;        // 已接收、尚未用WINDOW_UPDATE归还的连接窗口
+
+    std::map<uint32_t, stream *> m_streams;     // 还在生成应答的流
+    uint32_t m_next;                // 轮转生成DATA帧时下一次从该流ID开始
+    std::deque<stream *> m_finished;            // 帧已全部生成、等待写出后释放的流 release_at递增
+
+    std::string m_control;
+    std::deque<segment> m_out;
+    size_t m_out_offset;            // m_out第一个数据块中已经写出的字节数
+    uint64_t m_queued;              // 累计生成的字节数
+    uint64_t m_written;             // 累计写出的字节数
+};
+
+#endif
@@ -0,0 +1,341 @@
+#include <stdio.h>
+#include <string.h>
+#include "hpack.h"
+
+struct static_entry {
+    const char * name;
+    const char * value;
+};
+
+// RFC 7541 附录A 静态表 下标从1开始
+static const static_entry STATIC_TABLE[] = {
+    { "", "" },
+    { ":authority", "" }, { ":method", "GET" }, { ":method", "POST" }, { ":path", "/" },
+    { ":path", "/index.html" }, { ":scheme", "http" }, { ":scheme", "https" }, { ":status", "200" },
+    { ":status", "204" }, { ":status", "206" }, { ":status", "304" }, { ":status", "400" },
+    { ":status", "404" }, { ":status", "500" }, { "accept-charset", "" }, { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" }, { "accept-ranges", "" }, { "accept", "" }, { "access-control-allow-origin", "" },
+    { "age", "" }, { "allow", "" }, { "authorization", "" }, { "cache-control", "" },
+    { "content-disposition", "" }, { "content-encoding", "" }, { "content-language", "" }, { "content-length", "" },
+    { "content-location", "" }, { "content-range", "" }, { "content-type", "" }, { "cookie", "" },
+    { "date", "" }, { "etag", "" }, { "expect", "" }, { "expires", "" },
+    { "from", "" }, { "host", "" }, { "if-match", "" }, { "if-modified-since", "" },
+    { "if-none-match", "" }, { "if-range", "" }, { "if-unmodified-since", "" }, { "last-modified", "" },
+    { "link", "" }, { "location", "" }, { "max-forwards", "" }, { "proxy-authenticate", "" },
+    { "proxy-authorization", "" }, { "range", "" }, { "referer", "" }, { "refresh", "" },
+    { "retry-after", "" }, { "server", "" }, { "set-cookie", "" }, { "strict-transport-security", "" },
+    { "transfer-encoding", "" }, { "user-agent", "" }, { "vary", "" }, { "via", "" },
+    { "www-authenticate", "" },
+};
+static const uint64_t STATIC_TABLE_SIZE = sizeof(STATIC_TABLE) / sizeof(STATIC_TABLE[0]) - 1;
+
+// RFC 7541 附录B 霍夫曼编码表 第256项为EOS
+static const uint32_t HUFFMAN_CODES[257] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+    0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+    0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+    0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+    0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+    0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+    0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+    0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+    0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+    0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+    0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+    0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+    0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+    0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+    0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+    0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+    0x3fffffff,
+};
+static const uint8_t HUFFMAN_BITS[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+// 霍夫曼编码是规范编码：同一长度的编码连续递增，按长度分组即可逐位解码
+struct huffman_decode_table {
+    uint32_t first[31];     // 每种长度的最小编码
+    uint16_t count[31];     // 每种长度的编码数
+    uint16_t offset[31];    // 每种长度在symbols中的起始位置
+    uint16_t symbols[257];  // 按(长度, 编码)排序的符号
+
+    huffman_decode_table() {
+        memset(this, 0, sizeof(*this));
+        int n = 0;
+        for(int bits = 1; bits <= 30; bits++) {
+            offset[bits] = n;
+            for(int sym = 0; sym < 257; sym++) {
+                if(HUFFMAN_BITS[sym] != bits) {
+                    continue;
+                }
+                if(count[bits] == 0) {
+                    first[bits] = HUFFMAN_CODES[sym];
+                }
+                count[bits]++;
+                symbols[n++] = sym;
+            }
+        }
+    }
+};
+
+static const huffman_decode_table & decode_table() {
+    static const huffman_decode_table table;
+    return table;
+}
+
+static bool huffman_decode(const uint8_t * data, size_t len, std::string & out) {
+    const huffman_decode_table & table = decode_table();
+    uint32_t code = 0;
+    int bits = 0;
+    for(size_t i = 0; i < len; i++) {
+        for(int b = 7; b >= 0; b--) {
+            code = (code << 1) | ((data[i] >> b) & 1);
+            bits++;
+            if(table.count[bits] && code - table.first[bits] < table.count[bits]) {
+                int sym = table.symbols[table.offset[bits] + code - table.first[bits]];
+                if(sym == 256) {
+                    return false;   // 字符串中不能出现EOS
+                }
+                out.push_back((char)sym);
+                code = 0;
+                bits = 0;
+            } else if(bits >= 30) {
+                return false;
+            }
+        }
+    }
+    // 末尾的填充必须是不超过7位的EOS前缀(全1)
+    return bits <= 7 && code == (1u << bits) - 1;
+}
+
+static size_t huffman_length(const char * value, size_t len) {
+    uint64_t bits = 0;
+    for(size_t i = 0; i < len; i++) {
+        bits += HUFFMAN_BITS[(uint8_t)value[i]];
+    }
+    return (bits + 7) / 8;
+}
+
+static void huffman_encode(std::string & out, const char * value, size_t len) {
+    uint64_t acc = 0;
+    int bits = 0;
+    for(size_t i = 0; i < len; i++) {
+        uint8_t sym = value[i];
+        acc = (acc << HUFFMAN_BITS[sym]) | HUFFMAN_CODES[sym];
+        bits += HUFFMAN_BITS[sym];
+        while(bits >= 8) {
+            bits -= 8;
+            out.push_back((char)(acc >> bits));
+        }
+    }
+    if(bits > 0) {
+        // 用EOS的高位(全1)填充
+        out.push_back((char)((acc << (8 - bits)) | (0xff >> bits)));
+    }
+}
+
+// 带N位前缀的整数 first为前缀所在字节中前缀之外的标志位
+static void encode_integer(std::string & out, uint8_t first, int prefix_bits, uint64_t value) {
+    uint64_t max = (1u << prefix_bits) - 1;
+    if(value < max) {
+        out.push_back((char)(first | value));
+        return;
+    }
+    out.push_back((char)(first | max));
+    value -= max;
+    while(value >= 128) {
+        out.push_back((char)(0x80 | (value & 0x7f)));
+        value >>= 7;
+    }
+    out.push_back((char)value);
+}
+
+static bool decode_integer(const uint8_t *& p, const uint8_t * end, int prefix_bits, uint64_t & value) {
+    if(p >= end) {
+        return false;
+    }
+    uint64_t max = (1u << prefix_bits) - 1;
+    value = *p++ & max;
+    if(value < max) {
+        return true;
+    }
+    for(int shift = 0; shift <= 28; shift += 7) {
+        if(p >= end) {
+            return false;
+        }
+        uint8_t b = *p++;
+        value += (uint64_t)(b & 0x7f) << shift;
+        if(!(b & 0x80)) {
+            return true;
+        }
+    }
+    return false;   // 超过2^35 不可能是合法的长度或下标
+}
+
+static bool decode_string(const uint8_t *& p, const uint8_t * end, std::string & out) {
+    if(p >= end) {
+        return false;
+    }
+    bool huffman = *p & 0x80;
+    uint64_t len;
+    if(!decode_integer(p, end, 7, len) || len > (uint64_t)(end - p)) {
+        return false;
+    }
+    out.clear();
+    bool ok = true;
+    if(huffman) {
+        ok = huffman_decode(p, len, out);
+    } else {
+        out.assign((const char *)p, len);
+    }
+    p += len;
+    return ok;
+}
+
+static void encode_string(std::string & out, const char * value, size_t len) {
+    size_t huffman = huffman_length(value, len);
+    if(huffman < len) {
+        encode_integer(out, 0x80, 7, huffman);
+        huffman_encode(out, value, len);
+    } else {
+        encode_integer(out, 0, 7, len);
+        out.append(value, len);
+    }
+}
+
+bool hpack_decoder::lookup(uint64_t index, hpack_header & out) const {
+    if(index == 0) {
+        return false;
+    }
+    if(index <= STATIC_TABLE_SIZE) {
+        out.name = STATIC_TABLE[index].name;
+        out.value = STATIC_TABLE[index].value;
+        return true;
+    }
+    index -= STATIC_TABLE_SIZE + 1;
+    if(index >= m_table.size()) {
+        return false;
+    }
+    out = m_table[index];
+    return true;
+}
+
+void hpack_decoder::evict(size_t limit) {
+    while(m_size > limit && !m_table.empty()) {
+        m_size -= m_table.back().name.size() + m_table.back().value.size() + 32;
+        m_table.pop_back();
+    }
+}
+
+void hpack_decoder::insert(const hpack_header & header) {
+    size_t size = header.name.size() + header.value.size() + 32;
+    // 比整个表还大的项使表变空 本身也不加入
+    evict(size <= m_max_size ? m_max_size - size : 0);
+    if(size <= m_max_size) {
+        m_table.push_front(header);
+        m_size += size;
+    }
+}
+
+bool hpack_decoder::decode(const uint8_t * data, size_t len, std::vector<hpack_header> & headers) {
+    const uint8_t * p = data;
+    const uint8_t * end = data + len;
+    size_t list_size = 0;
+    bool first = true;
+    while(p < end) {
+        uint8_t b = *p;
+        hpack_header header;
+        uint64_t index;
+        if(b & 0x80) {
+            // 索引的头部字段
+            if(!decode_integer(p, end, 7, index) || !lookup(index, header)) {
+                return false;
+            }
+        } else if((b & 0xe0) == 0x20) {
+            // 动态表大小更新 只能出现在头部块的开头
+            if(!first || !decode_integer(p, end, 5, index) || index > DEFAULT_TABLE_SIZE) {
+                return false;
+            }
+            m_max_size = index;
+            evict(m_max_size);
+            continue;
+        } else {
+            // 字面量：0x40加入索引(6位前缀)，0x00不加入索引、0x10永不索引(4位前缀)
+            bool indexing = (b & 0xc0) == 0x40;
+            if(!decode_integer(p, end, indexing ? 6 : 4, index)) {
+                return false;
+            }
+            if(index == 0) {
+                if(!decode_string(p, end, header.name)) {
+                    return false;
+                }
+            } else if(!lookup(index, header)) {
+                return false;
+            }
+            if(!decode_string(p, end, header.value)) {
+                return false;
+            }
+            if(indexing) {
+                insert(header);
+            }
+        }
+        first = false;
+        list_size += header.name.size() + header.value.size() + 32;
+        if(list_size > MAX_HEADER_LIST_SIZE) {
+            return false;
+        }
+        headers.push_back(header);
+    }
+    return true;
+}
+
+void hpack_encode_status(std::string & out, int status) {
+    static const int indexed[] = { 200, 204, 206, 304, 400, 404, 500 };
+    for(int i = 0; i < (int)(sizeof(indexed) / sizeof(indexed[0])); i++) {
+        if(indexed[i] == status) {
+            encode_integer(out, 0x80, 7, HPACK_STATUS + i);
+            return;
+        }
+    }
+    char value[16];
+    int len = snprintf(value, sizeof(value), "%d", status);
+    hpack_encode_literal(out, HPACK_STATUS, value, len);
+}
+
+void hpack_encode_literal(std::string & out, int name_index, const char * value, size_t len) {
+    encode_integer(out, 0x00, 4, name_index);
+    encode_string(out, value, len);
+}
@@ -0,0 +1,53 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <deque>
+#include <vector>
+
+/*
+    HTTP/2的头部压缩(RFC 7541)
+    解码器完整实现静态表、动态表(含大小更新和淘汰)、整数和霍夫曼编码的字符串；
+    编码器只用于服务器的应答头：:status尽量使用静态表，其余为"不加入索引"的字面量，
+    不使用动态表，因此不需要跟踪对方的SETTINGS_HEADER_TABLE_SIZE，值在更短时用霍夫曼编码。
+*/
+
+// RFC 7541 附录A 静态表中本服务器用到的项
+enum HPACK_STATIC_INDEX {
+    HPACK_STATUS = 8,               // :status 200
+    HPACK_CONTENT_LENGTH = 28,
+    HPACK_CONTENT_TYPE = 31,
+};
+
+struct hpack_header {
+    std::string name;
+    std::string value;
+};
+
+class hpack_decoder {
+public:
+    static const size_t DEFAULT_TABLE_SIZE = 4096;      // SETTINGS_HEADER_TABLE_SIZE的初始值
+    static const size_t MAX_HEADER_LIST_SIZE = 65536;   // 一个头部块解码后的上限 防止压缩炸弹
+
+    hpack_decoder() : m_size(0), m_max_size(DEFAULT_TABLE_SIZE) {}
+
+    // 解码一个完整的头部块 失败时返回false(连接错误COMPRESSION_ERROR)
+    bool decode(const uint8_t * data, size_t len, std::vector<hpack_header> & headers);
+
+private:
+    bool lookup(uint64_t index, hpack_header & out) const;
+    void insert(const hpack_header & header);
+    void evict(size_t limit);
+
+    std::deque<hpack_header> m_table;   // 动态表 最新插入的项在最前面
+    size_t m_size;                      // 动态表的大小 每项为名称长度+值长度+32
+    size_t m_max_size;                  // 编码方通过大小更新设置的上限 不超过DEFAULT_TABLE_SIZE
+};
+
+void hpack_encode_status(std::string & out, int status);
+// 以静态表中的名称编码一个不加入索引的字面量头部
+void hpack_encode_literal(std::string & out, int name_index, const char * value, size_t len);
+
+#endif
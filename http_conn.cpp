@@ -1,4 +1,9 @@
 #include "http_conn.h"
+#include "pthreadpool.h"
+#include "h2.h"
+#include <algorithm>
+#include <new>
+#include <openssl/err.h>
 // 定义HTTP响应的一些状态信息
 const char * ok_200_title = "OK";
 const char * error_400_title = "Bad Request";
@@ -9,15 +14,21 @@ const char * error_404_title = "Not Found";
 const char * error_404_form = "The requested file was not found on this server.\n";
 const char * error_500_title = "Internal Error";
 const char * error_500_form = "There was an unusual problem serving the requested file.\n";
+const char * error_429_title = "Too Many Requests";
+const char * error_429_form = "You have sent too many requests, please slow down.\n";
+const char * error_503_title = "Service Unavailable";
+const char * error_503_form = "The server is overloaded, please try again later.\n";
 
-// 网站的根目录
+// 网站的根目录 由main根据启动参数设置
 const char * doc_root = "/home/gsq/文档/linux_cpp/webserver/resources";
 
 
 
 
-int http_conn::m_epollfd = -1;
-int http_conn::m_user_count = 0;
+alignas(64) int http_conn::m_epollfd = -1;   // 只在启动时写入 与其他变量隔开
+padded_atomic<int> http_conn::m_user_count(0);
+padded_atomic<bool> http_conn::m_draining(false);
+node_pool http_conn::m_cold_pool(sizeof(http_conn::cold_state));
 // 设置文件描述符非阻塞
 void setnonblocking(int fd) {
     // fcntl为可对文件描述符进行操作  根据不同命令执行不同操作
@@ -26,10 +37,10 @@ void setnonblocking(int fd) {
     fcntl(fd, F_SETFL, new_flag);
 }
 
-// 向epoll中添加需要监听的文件描述符
-void addfd(int epollfd, int fd, bool one_shot) {
+// 向epoll中添加需要监听的文件描述符 handle为事件中带回的句柄(连接句柄或监听socket本身)
+void addfd(int epollfd, int fd, bool one_shot, uint64_t handle) {
     epoll_event event;
-    event.data.fd = fd;
+    event.data.u64 = handle;
     event.events = EPOLLIN | EPOLLRDHUP;
     if(one_shot) {
         event.events |= EPOLLONESHOT;
@@ -45,130 +56,362 @@ void removefd(int epollfd, int fd) {
 }
 
 // 修改文件描述符 重置socket上的EPOLLONESHOT事件，确保下一次可读时，EPOLLIN事件被触发
-void modfd(int epollfd, int fd, int ev) {
+void modfd(int epollfd, uint64_t handle, int ev) {
     epoll_event event;
-    event.data.fd = fd;
+    event.data.u64 = handle;
     event.events = ev | EPOLLET | EPOLLONESHOT | EPOLLRDHUP;
-    epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event);
+    epoll_ctl(epollfd, EPOLL_CTL_MOD, http_conn::handle_fd(handle), &event);
 }
 
 void http_conn::init(int sockfd, const sockaddr_in & addr) {
+    attach(sockfd, addr, m_epollfd);
+    addfd(m_epollfd, sockfd, true, handle());
+}
+
+void http_conn::attach(int sockfd, const sockaddr_in & addr, int epollfd) {
+    // 文件描述符在上一个连接释放槽位之后才关闭，accept得到它时槽位一定是空闲的
+    uint32_t lifecycle = m_lifecycle.load(std::memory_order_acquire);
+    assert((lifecycle & 3) == CONN_FREE);
     m_socket = sockfd;
-    address = addr;
+    m_epfd = epollfd;
     // 端口复用
     int reuse = 1;  // 1 表示复用 0 表示不复用
     setsockopt(m_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
-    addfd(m_epollfd, sockfd, true);
     m_user_count++; // 总用户数+1
+    metrics_add(M_ACCEPTS);
+    // HTTPS连接 握手在第一次读取时开始
+    m_ssl = tls_enabled() ? tls_new(sockfd) : NULL;
+    m_tls_established = false;
+    m_ktls_send = false;
+    m_h2 = NULL;
 
     init();
+    m_cold->address = addr;
+    // 代数加一 之前注册的句柄全部失效
+    m_lifecycle.store((((lifecycle >> 2) + 1) << 2) | CONN_OPEN, std::memory_order_release);
+    log_capture(CAPTURE_OPEN, handle(), NULL, 0);
 }
 
 
 void http_conn::init() {
+    if(!m_cold) {
+        // 该槽位第一次使用 之后的连接和请求都复用
+        void * cold = m_cold_pool.get();
+        if(!cold) {
+            throw std::bad_alloc();     // 与new失败时的行为一致
+        }
+        m_cold = new(cold) cold_state;
+    }
     m_check_state = CHECK_STATE_REQUESTLINE;    // 初始化状态为解析请求首行
     m_checked_index = 0;
     m_start_line = 0;
     m_read_index = 0;
-    m_method = GET;
-    m_url = 0;
-    m_version = 0;
+    m_cold->method = GET;
+    m_cold->url = 0;
+    m_cold->version = 0;
     m_linger = false;
-    m_content_length = 0;
+    m_cold->content_length = 0;
     m_write_index = 0;
-    m_host = 0; 
-
-    bzero(m_read_buffer, READ_BUFFER_SIZE);     // 读缓冲清空
-    bzero(m_write_buffer, WRITE_BUFFER_SIZE);   // 写缓存清空
-    bzero(m_real_file, FILENAME_LEN);           // 文件路径 
+    m_cold->host = 0; 
+    memset(&m_cold->body, 0, sizeof(m_cold->body));
+    m_cold->body.content_type = "text/html";
+    m_cold->iv_count = 0;
+    m_bytes_to_send = 0;
+    m_bytes_have_send = 0;
+    m_cold->status = 0;
+    m_cold->request_start = 0;
+    m_cold->write_start = 0;
+    m_cold->parse_ns = 0;
+    m_cold->handle_ns = 0;
+    m_traced = false;
+    m_cold->upgrade_h2c = false;
+    m_cold->h2_settings = 0;
+
+    // 不再清空整个缓冲区(3KB，约50个缓存行)：读取后总在数据末尾补结束符，写缓冲区和文件路径写入时都会结束
+    m_cold->read_buffer[0] = '\0';
 }
 
+/*
+    关闭连接 工作线程和Reactor可能同时调用，由CAS选出唯一的执行者。
+    槽位的回收推迟到最后：先清理并把槽位标记为空闲，最后才从epoll中删除并close文件描述符。
+    在close之前该文件描述符不会被accept复用，新连接attach时不会与这里的清理交错。
+*/
 void http_conn::close_conn() {
-    if(m_socket != -1) {
-        removefd(m_epollfd, m_socket);
-        m_socket = -1;
-        m_user_count--; // 关闭一个连接 客户总数量需要对应减少
+    uint32_t lifecycle = m_lifecycle.load(std::memory_order_acquire);
+    if((lifecycle & 3) != CONN_OPEN
+            || !m_lifecycle.compare_exchange_strong(lifecycle, (lifecycle & ~3u) | CONN_CLOSING, std::memory_order_acq_rel)) {
+        return;
     }
+    unmap();
+    if(m_h2) {
+        delete m_h2;
+        m_h2 = NULL;
+    }
+    if(m_ssl) {
+        tls_close(m_ssl, m_tls_established);
+        m_ssl = NULL;
+    }
+    log_capture(CAPTURE_CLOSE, handle(), NULL, 0);
+    int sockfd = m_socket;
+    int epollfd = m_epfd;
+    m_socket = -1;
+    m_user_count--; // 关闭一个连接 客户总数量需要对应减少
+    metrics_add(M_CLOSES);
+    m_lifecycle.store((lifecycle & ~3u) | CONN_FREE, std::memory_order_release);
+    removefd(epollfd, sockfd);
 }
 
 
 // 循环读取客户数据，直到无数据刻度或者对方关闭连接
 bool http_conn::read() {
     // printf("一次性读出所有数据\n");
-    if(m_read_index >= READ_BUFFER_SIZE) {
+    IO_STATUS ret = read_some();
+    if(ret == IO_CLOSED || ret == IO_ERROR) {
         return false;
     }
+    LOG_DEBUG("读取到了数据： %s", m_cold->read_buffer);
+    return true;
+}
+
+// 循环读取客户数据直到EAGAIN，读缓冲区最后保留一个字节作为字符串结束符
+http_conn::IO_STATUS http_conn::read_some() {
+    if(m_read_index >= READ_BUFFER_SIZE - 1) {
+        return IO_ERROR;
+    }
+    if(m_ssl && !m_tls_established) {
+        IO_STATUS ret = tls_handshake();
+        if(ret != IO_OK) {
+            return ret;
+        }
+    }
 
     int bytes_read = 0;
-    while(true) {
-        bytes_read = recv(m_socket, m_read_buffer + m_read_index, READ_BUFFER_SIZE - m_read_index, 0);
+    int total = 0;
+    uint64_t read_start = g_trace_enabled ? trace_now() : 0;
+    while(m_read_index < READ_BUFFER_SIZE - 1) {
+        bytes_read = recv_some(m_cold->read_buffer + m_read_index, READ_BUFFER_SIZE - 1 - m_read_index);
         if(bytes_read == -1) {
             if(errno == EAGAIN || errno == EWOULDBLOCK) {
                 // 没有数据可读
                 break;
+            } else if(errno == EINTR) {
+                continue;
             }
-            return false;
+            return IO_ERROR;
         } else if(bytes_read == 0) {
             // 对方关闭连接
-            return false;
+            return IO_CLOSED;
+        }
+        if(m_read_index == 0) {
+            // 一个新请求的第一个字节 用于统计请求的处理时间
+            m_cold->request_start = metrics_now();
+            if(g_trace_enabled && (m_traced = trace_sample())) {
+                memset(&m_cold->trace, 0, sizeof(m_cold->trace));
+                m_cold->trace.ts[TP_WAKE] = m_cold->trace_wake;
+                m_cold->trace.ts[TP_READ] = read_start;
+                m_cold->trace.tid[TP_WAKE] = m_cold->trace.tid[TP_READ] = trace_tid();
+            }
         }
+        log_capture(CAPTURE_DATA, handle(), m_cold->read_buffer + m_read_index, bytes_read);
         m_read_index += bytes_read;
+        total += bytes_read;
     }
-    printf("读取到了数据： %s\n", m_read_buffer);
-    return true;
+    m_cold->read_buffer[m_read_index] = '\0';
+    m_cold->trace_wake = 0;
+    trace_point(TP_READ_END);
+    return total > 0 ? IO_OK : IO_AGAIN;
 }
 
 
 http_conn::HTTP_CODE http_conn::do_request() {
+    return open_body(m_cold->url, m_cold->real_file, m_cold->body);
+}
+
+http_conn::HTTP_CODE http_conn::open_body(const char * url, char * real_file, http_body & body) {
     /*
         当得到一个完整的、正确的http请求时，分析目标文件的属性，如果目标文件存在、多所有用户可读且不是目录。
-        则使用mmap将其映射到内存地址m_file_address处，并告诉调用者获取文件成功。
+        则使用mmap将其映射到内存地址body.address处，并告诉调用者获取文件成功。
     */
-   strcpy(m_real_file, doc_root);   // 先获取根目录
+   strcpy(real_file, doc_root);   // 先获取根目录
    int len = strlen(doc_root);
-   strncpy(m_real_file + len, m_url, FILENAME_LEN - len - 1);   // 从m_url复制FILENAME_LEN - len - 1个字符
-   // 获取m_real_file 文件相关的状态信息 -1表示失败 0 表示成功
+   strncpy(real_file + len, url, FILENAME_LEN - len - 1);   // 从url复制FILENAME_LEN - len - 1个字符
+   real_file[FILENAME_LEN - 1] = '\0';
+
+   if(strcmp(url, "/metrics") == 0) {
+        return render_metrics(body);
+   }
+
+   // 先查找文件缓存 命中时省去stat/open/mmap，并定期重新stat校验文件是否被修改
+   body.cache_entry = g_file_cache.acquire(real_file);
+   if(body.cache_entry) {
+        time_t now = time(NULL);
+        if(now - body.cache_entry->checked >= file_cache::CHECK_INTERVAL) {
+            if(stat(real_file, &body.st) < 0
+                    || body.st.st_mtime != body.cache_entry->st.st_mtime
+                    || body.st.st_size != body.cache_entry->st.st_size) {
+                g_file_cache.invalidate(body.cache_entry);
+                g_file_cache.release(body.cache_entry);
+                body.cache_entry = 0;
+            } else {
+                g_file_cache.checked(body.cache_entry, now);
+            }
+        }
+   }
+   if(body.cache_entry) {
+        body.st = body.cache_entry->st;
+        body.address = body.cache_entry->address;
+        metrics_add(M_CACHE_HITS);
+        return FILE_REQUEST;
+   }
+   metrics_add(M_CACHE_MISSES);
+
+   // 获取real_file 文件相关的状态信息 -1表示失败 0 表示成功
    // 函数说明: 通过文件名filename获取文件信息，并保存在buf所指的结构体stat中
-   if(stat(m_real_file, &m_file_stat) < 0) {
+   if(stat(real_file, &body.st) < 0) {
         return NO_RESOURCE;
     }
 
     // 判断访问权限
-    if(!(m_file_stat.st_mode & S_IROTH)) {
+    if(!(body.st.st_mode & S_IROTH)) {
         return FORBIDDEN_REQUEST;   // 客户对资源没有足够的访问权限
     }
 
     // 判断是否是目录
-    if(S_ISDIR(m_file_stat.st_mode)) {
+    if(S_ISDIR(body.st.st_mode)) {
         return BAD_REQUEST;
     }
 
+    // 较小的文件加载进缓存 供后续请求共享
+    body.cache_entry = g_file_cache.load(real_file, body.st);
+    if(body.cache_entry) {
+        body.address = body.cache_entry->address;
+        return FILE_REQUEST;
+    }
+
+    if(body.st.st_size == 0) {
+        return FILE_REQUEST;    // 空文件 不能mmap长度为0的区域
+    }
+
     // 以只读方式打开
-    int fd = open(m_real_file, O_RDONLY);
-    // 创建内存映射  将保存在m_file_address内存地址位置的数据发送给客户
-    m_file_address = (char*) mmap(0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    int fd = open(real_file, O_RDONLY);
+    if(fd < 0) {
+        return FORBIDDEN_REQUEST;
+    }
+    // 创建内存映射  将保存在body.address内存地址位置的数据发送给客户
+    void * address = mmap(0, body.st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
     close(fd);
+    if(address == MAP_FAILED) {
+        return INTERNAL_ERROR;
+    }
+    body.address = (char*) address;
     return FILE_REQUEST;    // 文件请求,获取文件成功
 
 }
 
+// 调用do_request并记录其耗时
+http_conn::HTTP_CODE http_conn::handle_request() {
+    uint64_t start = metrics_now();
+    trace_point(TP_HANDLE);
+    HTTP_CODE ret = do_request();
+    trace_point(TP_HANDLE_END);
+    m_cold->handle_ns = metrics_now() - start;
+    metrics_record(H_HANDLE, m_cold->handle_ns);
+    return ret;
+}
+
+// 请求要求升级到h2c：应答101，该请求作为流1在HTTP/2中应答
+http_conn::HTTP_CODE http_conn::upgrade_h2c() {
+    h2_session * session = new h2_session(m_socket, m_cold->address.sin_addr.s_addr);
+    if(!session->upgrade(m_cold->h2_settings, m_cold->method, m_cold->url)) {
+        // HTTP2-Settings无效 忽略升级 照常以HTTP/1.1应答
+        delete session;
+        return handle_request();
+    }
+    m_h2 = session;
+    // 请求之后已经读入的数据(连接前言)留给会话处理
+    m_read_index -= m_checked_index;
+    memmove(m_cold->read_buffer, m_cold->read_buffer + m_checked_index, m_read_index);
+    m_checked_index = 0;
+    return H2_SESSION;
+}
+
+// 生成Prometheus文本格式的指标 作为动态内容代替文件发送
+http_conn::HTTP_CODE http_conn::render_metrics(http_body & body) {
+    const metrics_region * region = metrics_get_region();
+    if(!region) {
+        return INTERNAL_ERROR;
+    }
+    static const int METRICS_BODY_SIZE = 64 * 1024;
+    body.dynamic = new char[METRICS_BODY_SIZE];
+    body.address = body.dynamic;
+    body.st.st_size = metrics_render(region, body.dynamic, METRICS_BODY_SIZE);
+    body.content_type = "text/plain; version=0.0.4";
+    return FILE_REQUEST;
+}
+
 // 对内存映射区执行munmap操作 解除地址映射
 void http_conn::unmap() {
-    if(m_file_address) {
-        munmap(m_file_address, m_file_stat.st_size);
-        m_file_address = 0;
+    release_body(m_cold->body);
+}
+
+void http_conn::release_body(http_body & body) {
+    if(body.dynamic) {
+        delete [] body.dynamic;
+        body.dynamic = 0;
+        body.address = 0;
+    } else if(body.cache_entry) {
+        // 来自文件缓存 只需归还引用
+        g_file_cache.release(body.cache_entry);
+        body.cache_entry = 0;
+        body.address = 0;
+    } else if(body.address) {
+        munmap(body.address, body.st.st_size);
+        body.address = 0;
     }
 }
 
 
 
-// 从主状态机中解析请求
+// 解析请求 请求完整时记录解析耗时(不含do_request)
 http_conn::HTTP_CODE http_conn::process_read() {
+    if(m_h2) {
+        return H2_SESSION;
+    }
+    uint64_t start = metrics_now();
+    if(m_traced && !m_cold->trace.ts[TP_PARSE]) {
+        trace_point(TP_PARSE);
+    }
+    m_cold->handle_ns = 0;
+    HTTP_CODE ret = parse_request();
+    m_cold->parse_ns += metrics_now() - start - m_cold->handle_ns;
+    if(ret != NO_REQUEST) {
+        metrics_record(H_PARSE, m_cold->parse_ns);
+        trace_point(TP_PARSE_END);
+    }
+    return ret;
+}
+
+// 从主状态机中解析请求
+http_conn::HTTP_CODE http_conn::parse_request() {
     // 定义初始状态
     LINE_STATUS line_statue = LINE_OK;
     HTTP_CODE ret = NO_REQUEST; // 最终解析的结果
     char * text = 0;            // 存储获取一行的数据
 
+    // 连接的第一个请求以HTTP/2连接前言开头：客户端已知服务器支持HTTP/2(prior knowledge)
+    if(m_check_state == CHECK_STATE_REQUESTLINE && m_checked_index == 0 && m_read_index > 0) {
+        static const char preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+        int n = std::min<int>(m_read_index, sizeof(preface) - 1);
+        if(memcmp(m_cold->read_buffer, preface, n) == 0) {
+            if(n < (int)sizeof(preface) - 1) {
+                return NO_REQUEST;
+            }
+            m_h2 = new h2_session(m_socket, m_cold->address.sin_addr.s_addr);
+            m_h2->start();
+            return H2_SESSION;
+        }
+    }
+
     while(((m_check_state == CHECK_STATE_CONTENT) && (line_statue == LINE_OK)) 
             ||((line_statue = parse_line()) == LINE_OK)) {
         // 检测到请求体的同时行状态为ok 可进行解析 或者检测到请求行状态为ok
@@ -177,7 +420,7 @@ http_conn::HTTP_CODE http_conn::process_read() {
         // 获取一行数据
         text = get_line();
         m_start_line = m_checked_index;
-        printf("got 1 http line : %s\n", text);
+        LOG_DEBUG("got 1 http line : %s", text);
         switch(m_check_state) {
             case CHECK_STATE_REQUESTLINE: {  // 当前正在分析请求行
             
@@ -190,10 +433,13 @@ http_conn::HTTP_CODE http_conn::process_read() {
             case CHECK_STATE_HEADER: {       // 当前正在分析头部字段
             
                 ret = parse_heders(text);
-                if(ret = BAD_REQUEST) {
+                if(ret == BAD_REQUEST) {
                     return BAD_REQUEST;
                 } else if(ret == GET_REQUEST) {
-                    return do_request();    // do_request为解析具体的请求信息
+                    if(m_cold->upgrade_h2c && m_cold->h2_settings && !m_ssl) {
+                        return upgrade_h2c();
+                    }
+                    return handle_request();    // do_request为解析具体的请求信息
                 }
                 break;
             }
@@ -201,7 +447,7 @@ http_conn::HTTP_CODE http_conn::process_read() {
             
                 ret = parse_content(text);
                 if(ret == GET_REQUEST) {    //获得一个完整的请求
-                    return do_request();    
+                    return handle_request();
                 }
                 line_statue = LINE_OPEN;
                 break;
@@ -210,48 +456,47 @@ http_conn::HTTP_CODE http_conn::process_read() {
                 return INTERNAL_ERROR;
             }
         }
-        return NO_REQUEST;      // 请求不完整 需要重新获取客户信息
     }
 
-    return NO_REQUEST;
+    return NO_REQUEST;      // 请求不完整 需要重新获取客户信息
 }
 
 // 解析http请求行，获取请求方法，目标URL HTTP版本
 http_conn::HTTP_CODE http_conn::parse_request_line(char *text) {
     // GET /index.html HTTP/1.1 
-    m_url = strpbrk(text, " \t");   // strbrk()方法 返回指向str1中第一次出现的作为str2一部分的任何字符的指针，没有匹配则返回空指针
-    if(!m_url) {
+    m_cold->url = strpbrk(text, " \t");   // strbrk()方法 返回指向str1中第一次出现的作为str2一部分的任何字符的指针，没有匹配则返回空指针
+    if(!m_cold->url) {
         return BAD_REQUEST;
     }
 
-    *m_url++ = '\0';               // 置\0之后再向后移动一个位置 此时指向index之前的/
+    *m_cold->url++ = '\0';               // 置\0之后再向后移动一个位置 此时指向index之前的/
     
     // GET\0/index.html HTTP/1.1 
     char * method = text;   // 字符串只取到 \0 处 遇到\0就停止了
     if(strcasecmp(method, "GET") == 0) {        // 忽略大小写比较
-        m_method = GET;
+        m_cold->method = GET;
     } else {
         return BAD_REQUEST;
     }
 
     // /index.html HTTP/1.1 
-    m_version = strpbrk(m_url, " \t");
-    if(!m_version){
+    m_cold->version = strpbrk(m_cold->url, " \t");
+    if(!m_cold->version){
         return BAD_REQUEST;
     }
-    *m_version++ = '\0';
+    *m_cold->version++ = '\0';
 
     // /index.html\0HTTP/1.1 
-    if(strcasecmp(m_version, "HTTP/1.1") != 0) {
+    if(strcasecmp(m_cold->version, "HTTP/1.1") != 0) {
         return BAD_REQUEST;
     }
 
-    if(strncasecmp(m_url, "http://", 7) == 0) {  // 此时m_url为  /index.html\0
-        m_url += 7;     // 如果是以http://打头的  则向后移动7个位置
-        m_url = strpbrk(m_url, '/');
+    if(strncasecmp(m_cold->url, "http://", 7) == 0) {  // 此时m_url为  /index.html\0
+        m_cold->url += 7;     // 如果是以http://打头的  则向后移动7个位置
+        m_cold->url = strchr(m_cold->url, '/');
     }
 
-    if(!m_url || m_url[0] != '/') {
+    if(!m_cold->url || m_cold->url[0] != '/') {
         return BAD_REQUEST;
     }
 
@@ -266,7 +511,7 @@ http_conn::HTTP_CODE http_conn::parse_heders(char *text) {
     if(text[0] == '\0') {
         // 如果http请求有消息体，则还需要读取m_content_length 字节的消息体
         // 状态机转移到CHECK_STATE_CONTENT （解析请求体状态）
-        if(m_content_length != 0) {
+        if(m_cold->content_length != 0) {
             m_check_state = CHECK_STATE_CONTENT;
             return NO_REQUEST;
         }
@@ -284,16 +529,27 @@ http_conn::HTTP_CODE http_conn::parse_heders(char *text) {
         // 处理请求体Content-Length字段
         text += 15;
         text += strspn(text, " \t");
-        m_content_length = atol(text);  // string 转为 int
+        m_cold->content_length = atol(text);  // string 转为 int
 
     } else if(strncasecmp(text, "Host:", 5) == 0) {
 
         text += 5;
         text += strspn(text, " \t");
-        m_host = text;
+        m_cold->host = text;
+
+    } else if(strncasecmp(text, "Upgrade:", 8) == 0) {
+        // 升级到明文HTTP/2  Upgrade: h2c
+        text += 8;
+        text += strspn(text, " \t");
+        m_cold->upgrade_h2c = strcasecmp(text, "h2c") == 0;
+
+    } else if(strncasecmp(text, "HTTP2-Settings:", 15) == 0) {
+        text += 15;
+        text += strspn(text, " \t");
+        m_cold->h2_settings = text;
 
     } else {
-        printf("oop! unknow header %s\n", text);
+        LOG_DEBUG("oop! unknow header %s", text);
     }
 
     return NO_REQUEST;
@@ -301,8 +557,8 @@ http_conn::HTTP_CODE http_conn::parse_heders(char *text) {
 
 // 在此并未真正解析http请求的消息体，只是判断是否被完整读入
 http_conn::HTTP_CODE http_conn::parse_content(char *text) {
-    if(m_read_index >= (m_content_length + m_checked_index)) {
-        text[m_content_length] = '\0';
+    if(m_read_index >= (m_cold->content_length + m_checked_index)) {
+        text[m_cold->content_length] = '\0';
         return GET_REQUEST;
     }
     return NO_REQUEST;
@@ -313,20 +569,20 @@ http_conn::HTTP_CODE http_conn::parse_content(char *text) {
 http_conn::LINE_STATUS http_conn::parse_line() {
     char temp;
     for(; m_checked_index < m_read_index; ++m_checked_index) {
-        temp = m_read_buffer[m_checked_index];
+        temp = m_cold->read_buffer[m_checked_index];
         if(temp == '\r') {
             if((m_checked_index + 1) == m_read_index) {
                 return LINE_OPEN;
-            } else if(m_read_buffer[m_checked_index + 1] == '\n') {
-                m_read_buffer[m_checked_index++] = '\0';    // 将后面的 \r\n 全部改为 \0
-                m_read_buffer[m_checked_index++] = '\0';
+            } else if(m_cold->read_buffer[m_checked_index + 1] == '\n') {
+                m_cold->read_buffer[m_checked_index++] = '\0';    // 将后面的 \r\n 全部改为 \0
+                m_cold->read_buffer[m_checked_index++] = '\0';
                 return LINE_OK;
             }
             return LINE_BAD;
         } else if(temp == '\n') {
-            if((m_checked_index > 1) && (m_read_buffer[m_checked_index - 1] == '\r')) {
-                m_read_buffer[m_checked_index - 1] = '\0';
-                m_read_buffer[m_checked_index++] = '\0';
+            if((m_checked_index > 1) && (m_cold->read_buffer[m_checked_index - 1] == '\r')) {
+                m_cold->read_buffer[m_checked_index - 1] = '\0';
+                m_cold->read_buffer[m_checked_index++] = '\0';
                 return LINE_OK;
             }
             return LINE_BAD;
@@ -339,44 +595,265 @@ http_conn::LINE_STATUS http_conn::parse_line() {
 // 写http响应
 bool http_conn::write() {
     // printf("一次性写入所有数据\n");
-    int temp = 0;
-    int bytes_have_send = 0;    // 已经发送的字节
-    int bytes_to_send = m_write_index; // 将要发送的字节  m_write_index为写缓冲区中待发送的字节数
-    
-    if(bytes_to_send == 0) {
+    if(m_h2) {
+        // HTTP/2连接可写时同样读取新到达的帧
+        if(h2_process() != IO_OK) {
+            return false;
+        }
+        modfd(m_epfd, handle(), h2_events());
+        return true;
+    }
+    if(m_bytes_to_send == 0) {
         // 没有待发送的字节
-        modfd(m_epollfd, m_socket, EPOLLIN);
+        modfd(m_epfd, handle(), EPOLLIN);
         init();
         return true;
     }
-    while(1) {
-        // 分散写 两块要写入的内存数据 一块为响应头数据， 一块为响应体数据
-        temp = writev(m_socket, m_iv, m_iv_count);  // 全部写入
+
+    IO_STATUS ret = write_some();
+    if(ret == IO_AGAIN) {
+        // 如果TCP写缓冲没有空间，则等待下一轮EPOLLOUT事件，虽然在此期间，
+        // 服务器无法立即收到同一个客户的下一个请求，但可以保证连接的完整性
+        modfd(m_epfd, handle(), EPOLLOUT);
+        return true;
+    }
+    unmap();
+    if(ret != IO_OK) {
+        return false;
+    }
+
+    // 发送http响应成功，根据http请求中的Connection字段决定是否立即关闭连接
+    modfd(m_epfd, handle(), EPOLLIN);
+    if(m_linger) {
+        init();
+        return true;
+    }
+    return false;
+}
+
+// 分散写 两块要写入的内存数据 一块为响应头数据， 一块为响应体数据
+// 每次写入后根据已发送的字节数调整m_iv，EAGAIN时保留进度以便下次继续发送
+http_conn::IO_STATUS http_conn::write_some() {
+    bool pending = m_bytes_to_send > 0;
+    while(m_bytes_to_send > 0) {
+        int temp = send_iov(m_cold->iv, m_cold->iv_count);
         if(temp <= -1) {
-            // 如果TCP写缓冲没有空间，则等待下一轮EPOLLOUT事件，虽然在此期间，
-            // 服务器无法立即收到同一个客户的下一个请求，但可以保证连接的完整性
-            if(errno == EAGAIN) {
-                modfd(m_epollfd, m_socket, EPOLLOUT);
-                return true;
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                return IO_AGAIN;
+            } else if(errno == EINTR) {
+                continue;
             }
-            unmap();
-            return false;
+            return IO_ERROR;
         }
-        bytes_to_send -= temp;  // 因为是全部写入 则写入之后待发送的字节数必然小于已发送的字节数
-        bytes_have_send += temp;
-        if(bytes_to_send <= bytes_have_send) {
-            // 发送http响应成功，根据http请求中的Connection字段决定是否立即关闭连接
-            unmap();
-            if(m_linger) {
-                init();
-                modfd(m_epollfd, m_socket, EPOLLIN);
-                return true;
-            } else {
-                modfd(m_epollfd, m_socket, EPOLLIN);
-                return false;
+        m_bytes_to_send -= temp;
+        m_bytes_have_send += temp;
+        if(m_bytes_have_send >= m_write_index) {
+            // 响应头已经发送完毕 只剩下文件内容
+            m_cold->iv[0].iov_len = 0;
+            m_cold->iv[1].iov_base = m_cold->body.address + (m_bytes_have_send - m_write_index);
+            m_cold->iv[1].iov_len = m_bytes_to_send;
+        } else {
+            m_cold->iv[0].iov_base = m_cold->write_buffer + m_bytes_have_send;
+            m_cold->iv[0].iov_len = m_write_index - m_bytes_have_send;
+        }
+    }
+    if(pending) {
+        finish_request();
+    }
+    return IO_OK;
+}
+
+// 非阻塞握手 需要等待对方数据(或socket可写)时返回IO_AGAIN，由下一次可读事件继续
+http_conn::IO_STATUS http_conn::tls_handshake() {
+    ERR_clear_error();
+    int ret = SSL_do_handshake(m_ssl);
+    if(ret == 1) {
+        m_tls_established = true;
+        m_ktls_send = tls_established(m_ssl);
+        if(tls_alpn_h2(m_ssl)) {
+            m_h2 = new h2_session(m_socket, m_cold->address.sin_addr.s_addr);
+            m_h2->start();
+        }
+        return IO_OK;
+    }
+    int err = SSL_get_error(m_ssl, ret);
+    if(err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+        return IO_AGAIN;
+    }
+    metrics_add(M_TLS_FAILURES);
+    LOG_DEBUG("tls handshake failure on fd %d: %lu", m_socket, ERR_peek_error());
+    return IO_ERROR;
+}
+
+int http_conn::recv_some(char * buf, int len) {
+    if(!m_ssl) {
+        return recv(m_socket, buf, len, 0);
+    }
+    ERR_clear_error();
+    int ret = SSL_read(m_ssl, buf, len);
+    if(ret > 0) {
+        return ret;
+    }
+    switch(SSL_get_error(m_ssl, ret)) {
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;   // 对方发送了close_notify
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_SYSCALL:
+            if(ERR_peek_error() == 0 && errno == 0) {
+                return 0;   // 没有close_notify直接断开
             }
+            return -1;
+        default:
+            errno = EPROTO;
+            return -1;
+    }
+}
+
+int http_conn::send_iov(const struct iovec * iov, int count) {
+    if(!m_ssl || m_ktls_send) {
+        // 明文连接或kTLS：内核负责加密 文件内容直接从映射区发送
+        return writev(m_socket, iov, count);
+    }
+
+    // 用户态TLS：开头较小的数据块(响应头、HTTP/2帧头)和之后的内容合并为一个记录 避免每块各占一个记录和TCP报文
+    static const int TLS_RECORD_SIZE = 16384;
+    static thread_local char record[TLS_RECORD_SIZE];
+    const void * data;
+    int len;
+    while(count > 0 && iov[0].iov_len == 0) {
+        iov++;
+        count--;
+    }
+    if(count == 0) {
+        return 0;
+    }
+    if(count == 1 || iov[0].iov_len >= (size_t)TLS_RECORD_SIZE) {
+        data = iov[0].iov_base;
+        len = iov[0].iov_len;
+    } else {
+        len = 0;
+        for(int i = 0; i < count && len < TLS_RECORD_SIZE; i++) {
+            int n = std::min<size_t>(iov[i].iov_len, TLS_RECORD_SIZE - len);
+            memcpy(record + len, iov[i].iov_base, n);
+            len += n;
+        }
+        data = record;
+    }
+    ERR_clear_error();
+    int ret = SSL_write(m_ssl, data, len);
+    if(ret > 0) {
+        return ret;
+    }
+    int err = SSL_get_error(m_ssl, ret);
+    // EAGAIN后下一次必须以相同的内容重试 iov没有变化 合并的结果也相同
+    errno = (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ) ? EAGAIN : EPIPE;
+    return -1;
+}
+
+// HTTP/2连接：处理读缓冲区中的数据并继续读取直到EAGAIN，再写出会话生成的帧直到写完或EAGAIN
+// 待写出的数据积压时暂停读取 全部写出后再继续读取；写到EAGAIN时由EPOLLOUT继续
+http_conn::IO_STATUS http_conn::h2_process() {
+    while(true) {
+        bool paused = false;
+        while(true) {
+            if(m_read_index > 0) {
+                m_h2->feed(m_cold->read_buffer, m_read_index);
+                m_read_index = 0;
+            }
+            if(!m_h2->want_read()) {
+                paused = true;
+                break;
+            }
+            IO_STATUS ret = read_some();
+            if(ret == IO_AGAIN) {
+                break;
+            } else if(ret != IO_OK) {
+                return ret;
+            }
+        }
+
+        struct iovec iov[h2_session::MAX_IOV];
+        int count;
+        while((count = m_h2->pending(iov, h2_session::MAX_IOV)) > 0) {
+            int ret = send_iov(iov, count);
+            if(ret < 0) {
+                if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return IO_OK;
+                } else if(errno == EINTR) {
+                    continue;
+                }
+                return IO_ERROR;
+            }
+            m_h2->sent(ret);
+        }
+        if(!paused || m_h2->done()) {
+            break;
         }
     }
+    return m_h2->done() ? IO_CLOSED : IO_OK;
+}
+
+bool http_conn::h2_want_write() const {
+    return m_h2 && m_h2->want_write();
+}
+
+// HTTP/2连接应当等待的事件 积压时只等待可写
+int http_conn::h2_events() {
+    return (m_h2->want_read() ? EPOLLIN : 0) | (m_h2->want_write() ? EPOLLOUT : 0);
+}
+
+void http_conn::finish_request() {
+    metrics_record(H_WRITE, metrics_now() - m_cold->write_start);
+    log_capture(CAPTURE_RESPONSE, handle(), NULL, 0);
+    if(m_traced) {
+        trace_point(TP_WRITE_END);
+        m_cold->trace.fd = m_socket;
+        m_cold->trace.status = m_cold->status;
+        strncpy(m_cold->trace.url, m_cold->url ? m_cold->url : "", sizeof(m_cold->trace.url) - 1);
+        m_cold->trace.url[sizeof(m_cold->trace.url) - 1] = '\0';
+        trace_submit(m_cold->trace);
+        m_traced = false;
+    }
+    record_response(m_socket, m_cold->method, m_cold->url, m_cold->status, m_bytes_have_send, m_cold->request_start);
+}
+
+void http_conn::record_response(int fd, METHOD method, const char * url, int status, uint64_t bytes, uint64_t start) {
+    uint64_t latency = start ? metrics_now() - start : 0;
+    metrics_add(M_REQUESTS);
+    metrics_add(M_BYTES_OUT, bytes);
+    switch(status) {
+        case 200: metrics_add(M_STATUS_200); break;
+        case 400: metrics_add(M_STATUS_400); break;
+        case 403: metrics_add(M_STATUS_403); break;
+        case 404: metrics_add(M_STATUS_404); break;
+        case 429: metrics_add(M_STATUS_429); break;
+        case 500: metrics_add(M_STATUS_500); break;
+        case 503: metrics_add(M_STATUS_503); break;
+        default: metrics_add(M_STATUS_OTHER); break;
+    }
+    if(start) {
+        metrics_record(H_LATENCY, latency);
+    }
+
+    if(!access_log_enabled()) {
+        return;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    access_record record;
+    record.timestamp_us = ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+    record.latency_us = latency / 1000;
+    record.fd = fd;
+    record.path_id = 0;
+    record.bytes = bytes;
+    record.status = status;
+    record.method = method;
+    record.reserved = 0;
+    log_access(record, url);
 }
 
 
@@ -388,7 +865,7 @@ bool http_conn::add_response(const char * format, ...) {
     }
     va_list arg_list;   // 用于解析参数 参数列表
     va_start(arg_list, format); // 
-    int len = vsnprintf(m_write_buffer + m_write_index, WRITE_BUFFER_SIZE - 1 - m_write_index, format, arg_list);
+    int len = vsnprintf(m_cold->write_buffer + m_write_index, WRITE_BUFFER_SIZE - 1 - m_write_index, format, arg_list);
     if(len >= (WRITE_BUFFER_SIZE - 1 - m_write_index)) {
         return false;
     }
@@ -400,6 +877,7 @@ bool http_conn::add_response(const char * format, ...) {
 
 
 bool http_conn::add_status_line(int status, const char * title) {  // 添加响应状态首行
+    m_cold->status = status;
     return add_response("%s %d %s \r\n", "HTTP/1.1", status, title);
 }
 
@@ -407,12 +885,12 @@ bool http_conn::add_headers(int content_length) {                  // 增加响
     add_content_length(content_length);
     add_content_type();
     add_linger();
-    add_blank_line();
+    return add_blank_line();
 }
 
 
 bool http_conn::add_content_type() {
-    return add_response("Content-Type: %s\r\n", "text/html");
+    return add_response("Content-Type: %s\r\n", m_cold->body.content_type);
 }
 
 bool http_conn::add_content_length(int content_length) {
@@ -434,6 +912,12 @@ bool http_conn::add_content(const char * content) {
 
 // 根据服务器处理HTTP请求的结果，决定返回给客户端的内容
 bool http_conn::process_write(HTTP_CODE ret) {
+    m_cold->write_start = metrics_now();
+    trace_point(TP_WRITE);
+    if(m_draining) {
+        // 排空期间应答后关闭连接 客户端在新进程上重新连接
+        m_linger = false;
+    }
     switch (ret)
     {
     case INTERNAL_ERROR:
@@ -454,45 +938,176 @@ bool http_conn::process_write(HTTP_CODE ret) {
     case FORBIDDEN_REQUEST: // 没有访问权限
         add_status_line(403, error_403_title);
         add_headers(strlen(error_403_form));
-        if(!add_content(error_404_form)) {
+        if(!add_content(error_403_form)) {
+            return false;
+        }
+        break;
+    case TOO_MANY_REQUESTS:     // 超过限流 应答后关闭连接
+        m_linger = false;
+        add_status_line(429, error_429_title);
+        add_headers(strlen(error_429_form));
+        if(!add_content(error_429_form)) {
+            return false;
+        }
+        break;
+    case SERVICE_UNAVAILABLE:   // 过载丢弃
+        add_status_line(503, error_503_title);
+        add_headers(strlen(error_503_form));
+        if(!add_content(error_503_form)) {
             return false;
         }
         break;
     case FILE_REQUEST:  // 获取文件成功
         add_status_line(200, ok_200_title);
-        add_headers(m_file_stat.st_size);
-        m_iv[0].iov_base = m_write_buffer;
-        m_iv[0].iov_len = m_write_index;
-        m_iv[1].iov_base = m_file_address;
-        m_iv[1].iov_len = m_file_stat.st_size;
-        m_iv_count = 2;
+        add_headers(m_cold->body.st.st_size);
+        m_cold->iv[0].iov_base = m_cold->write_buffer;
+        m_cold->iv[0].iov_len = m_write_index;
+        m_cold->iv[1].iov_base = m_cold->body.address;
+        m_cold->iv[1].iov_len = m_cold->body.st.st_size;
+        m_cold->iv_count = 2;
+        m_bytes_to_send = m_write_index + m_cold->body.st.st_size;
+        m_bytes_have_send = 0;
         return true;
+    case NO_RESOURCE:
+        add_status_line(404, error_404_title);
+        add_headers(strlen(error_404_form));
+        if(!add_content(error_404_form)) {
+            return false;
+        }
+        break;
     default:
         return false;
     }
-    m_iv[0].iov_base = m_write_buffer;
-    m_iv[0].iov_len = m_write_index;
-    m_iv_count = 1;
+    m_cold->iv[0].iov_base = m_cold->write_buffer;
+    m_cold->iv[0].iov_len = m_write_index;
+    m_cold->iv_count = 1;
+    m_bytes_to_send = m_write_index;
+    m_bytes_have_send = 0;
     return true;
 }
 
 
 void http_conn::process() {
+    trace_point(TP_DEQUEUE);
     // 解析HTTP请求
     HTTP_CODE read_ret = process_read();
     if(read_ret == NO_REQUEST) {
         // 如果请求不完整还需要继续读取数据 则修该监听事件 重新监听
-        modfd(m_epollfd, m_socket, EPOLLIN);
+        modfd(m_epfd, handle(), EPOLLIN);
         return;
     }
+    if(read_ret == H2_SESSION) {
+        if(h2_process() != IO_OK) {
+            close_conn();
+            return;
+        }
+        modfd(m_epfd, handle(), h2_events());
+        return;
+    }
+    if(!admit()) {
+        read_ret = TOO_MANY_REQUESTS;   // 超过请求速率限制 应答429后关闭
+    }
 
     // printf("parse requese, create response\n");
     // 生成响应
     bool write_ret = process_write(read_ret);
     if(!write_ret) {
         close_conn();
+        return;
     }
     // 因为使用了oneshot 只监听一次，因此写成功后还需将写时间重新添加到监听中
-    modfd(m_epollfd, m_socket, EPOLLOUT);
+    modfd(m_epfd, handle(), EPOLLOUT);
+
+}
+
+// 不解析请求 直接生成503应答 写完后关闭连接
+void http_conn::shed() {
+    metrics_add(M_SHED);
+    if(m_h2) {
+        // HTTP/2连接上不能直接写HTTP/1的应答
+        close_conn();
+        return;
+    }
+    m_linger = false;
+    if(!process_write(SERVICE_UNAVAILABLE)) {
+        close_conn();
+        return;
+    }
+    modfd(m_epfd, handle(), EPOLLOUT);
+}
+
+// 按客户端IP检查请求速率 HTTP/2连接上的请求由会话按流检查
+bool http_conn::admit() {
+    return m_h2 || rate_limit_allow(m_cold->address.sin_addr.s_addr, RL_REQUEST);
+}
+
+// 在Reactor线程中直接解析、应答并尝试写回 省去交给线程池以及写事件的两次跨线程切换
+bool http_conn::process_inline() {
+    metrics_add(M_INLINE);
+    HTTP_CODE read_ret = process_read();
+    if(read_ret == NO_REQUEST) {
+        modfd(m_epfd, handle(), EPOLLIN);
+        return true;
+    }
+    if(read_ret == H2_SESSION) {
+        // 带Upgrade: h2c的请求在这里切换为HTTP/2 与process()相同
+        if(h2_process() != IO_OK) {
+            return false;
+        }
+        modfd(m_epfd, handle(), h2_events());
+        return true;
+    }
+    if(!admit()) {
+        read_ret = TOO_MANY_REQUESTS;
+    }
+    if(!process_write(read_ret)) {
+        return false;
+    }
+    return write();
+}
+
+// 缓存命中的小请求进入廉价通道，冷文件、带请求体的请求进入昂贵通道
+int http_conn::classify() {
+    // 请求头还不完整(或者是上次未解析完的请求)时，工作线程通常只需重新注册读事件
+    const char * end = header_end();
+    if(!end) {
+        return LANE_CHEAP;
+    }
+    return cheap_request(end) ? LANE_CHEAP : LANE_EXPENSIVE;
+}
+
+// 读缓冲区中请求头的结束位置(指向"\r\n\r\n") 请求头还不完整时返回NULL
+const char * http_conn::header_end() {
+    return strstr(m_cold->read_buffer, "\r\n\r\n");
+}
 
-}
\ No newline at end of file
+// 请求头已经完整、没有请求体、且目标文件已在文件缓存中时，认为处理代价很小
+// end是调用者已经找到的请求头结束位置 为NULL表示请求头不完整
+bool http_conn::cheap_request(const char * end) {
+    if(!end || m_h2 || m_check_state != CHECK_STATE_REQUESTLINE || m_checked_index != 0) {
+        return false;
+    }
+    // 只在请求头范围内按行首匹配 url、查询串或其他头部的值中出现的"Content-Length:"不算
+    for(const char * p = m_cold->read_buffer; (p = (const char *)memmem(p, end - p, "\r\n", 2)) != NULL; p += 2) {
+        if(strncasecmp(p + 2, "Content-Length:", 15) == 0) {
+            return false;
+        }
+    }
+
+    // GET /index.html HTTP/1.1  不修改读缓冲区 只取出url拼接文件路径
+    const char * url = strpbrk(m_cold->read_buffer, " \t");
+    if(!url || url[1] != '/') {
+        return false;
+    }
+    url++;
+    int url_len = strcspn(url, " \t\r\n");
+    int len = strlen(doc_root);
+    if(len + url_len >= FILENAME_LEN) {
+        return false;
+    }
+    char path[FILENAME_LEN];
+    memcpy(path, doc_root, len);
+    memcpy(path + len, url, url_len);
+    path[len + url_len] = '\0';
+    return g_file_cache.contains(path);
+}
@@ -17,14 +17,46 @@
 #include <stdarg.h>
 #include <errno.h>
 #include "locker.h"
+#include "filecache.h"
+#include "log.h"
+#include "metrics.h"
+#include "trace.h"
+#include "tls.h"
+#include "ratelimit.h"
+#include "hugemem.h"
+#include <atomic>
 #include <sys/uio.h>
 #include <string.h>
 
+class h2_session;
 
-class  http_conn {
+// 应答内容 来自文件缓存、mmap映射或动态生成 HTTP/1和HTTP/2共用
+struct http_body {
+    struct stat st;             // 目标文件的状态 st_size为内容的长度
+    char * address;             // 内容的起始地址
+    file_cache::entry * cache_entry;    // 来自文件缓存时指向缓存项，否则为NULL
+    char * dynamic;             // 动态生成的内容(如/metrics)，需要delete[]
+    const char * content_type;
+};
+
+// 独占一个缓存行的原子变量 被所有线程频繁修改时不与相邻的数据伪共享
+template<typename T>
+struct alignas(64) padded_atomic : public std::atomic<T> {
+    using std::atomic<T>::atomic;
+    using std::atomic<T>::operator=;
+};
+
+/*
+    连接对象只保留热数据，正好64字节并按缓存行对齐，users数组以文件描述符为下标连续存放；
+    读写缓冲区、文件路径、解析结果和统计信息放在单独分配的cold_state中。
+    分发一个事件只需访问连接所在的一个缓存行，不再跨过3KB的缓冲区去读状态机的字段。
+*/
+class alignas(64) http_conn {
 public:
     static int m_epollfd; // 所有的socket上的事件都被注册到同一个epollfd中
-    static int m_user_count; // 统计用户的数量
+    static padded_atomic<int> m_user_count; // 统计用户的数量 由Reactor和工作线程共同修改
+    static padded_atomic<bool> m_draining;  // 进程正在排空 之后的应答都关闭连接
+    static node_pool m_cold_pool;           // 连接的缓冲区 从第一次使用槽位的线程所在的NUMA节点分配
     static const int READ_BUFFER_SIZE = 2048; // 读缓存大小
     static const int WRITE_BUFFER_SIZE = 1024; // 写缓存大小
     static const int FILENAME_LEN = 200;
@@ -39,7 +71,7 @@ public:
         CHECK_STATE_CONTENT:当前正在解析请求体
     */
 
-    enum CHECK_STATE { CHECK_STATE_REQUESTLINE = 0, CHECK_STATE_HEADER, CHECK_STATE_CONTENT };
+    enum CHECK_STATE : uint8_t { CHECK_STATE_REQUESTLINE = 0, CHECK_STATE_HEADER, CHECK_STATE_CONTENT };
 
     /*
         服务器处理HTTP请求的可能结果，报文解析的结果
@@ -51,25 +83,95 @@ public:
         FILE_REQUEST        :   文件请求,获取文件成功
         INTERNAL_ERROR      :   表示服务器内部错误
         CLOSED_CONNECTION   :   表示客户端已经关闭连接了
+        SERVICE_UNAVAILABLE :   表示服务器过载，请求被丢弃
+        H2_SESSION          :   连接已切换到HTTP/2，由h2_process处理
+        TOO_MANY_REQUESTS   :   客户端超过了请求速率限制
     */
-    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION };
+    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION, SERVICE_UNAVAILABLE, H2_SESSION, TOO_MANY_REQUESTS };
     
     // 从状态机的三种可能状态，即 行的读取状态，分别表示
     // 1.读取到一个完整的行 2.行出错 3.行数据尚且不完整
     enum LINE_STATUS { LINE_OK = 0, LINE_BAD, LINE_OPEN };
 
+    /*
+        非阻塞读写的结果
+        IO_OK       :   读到了新数据 / 响应已经全部写完
+        IO_AGAIN    :   socket暂时不可读写(EAGAIN)，需要等待下一次就绪
+        IO_CLOSED   :   对方关闭了连接
+        IO_ERROR    :   读写出错或读缓冲区已满
+    */
+    enum IO_STATUS { IO_OK = 0, IO_AGAIN, IO_CLOSED, IO_ERROR };
+
+    /*
+        槽位(users数组中以文件描述符为下标的对象)的生命周期 与代数一起保存在m_lifecycle中
+        CONN_FREE       :   没有连接使用该槽位
+        CONN_OPEN       :   attach之后 连接正在使用
+        CONN_CLOSING    :   某个线程正在关闭连接 其他线程的close_conn直接返回
+    */
+    enum CONN_STATE { CONN_FREE = 0, CONN_OPEN, CONN_CLOSING };
+
+    /*
+        连接句柄 注册到epoll_event.data.u64中：低32位是文件描述符(槽位下标)，高32位是该槽位的代数。
+        每次attach代数加一，关闭后文件描述符被新连接复用时，旧连接遗留的事件代数不符，分发前由current丢弃。
+        监听socket直接以文件描述符注册，代数为0，不与任何连接的句柄相同。
+    */
+    static int handle_fd(uint64_t handle) { return (int)(uint32_t)handle; }
+    uint64_t handle() const {
+        return ((uint64_t)(m_lifecycle.load(std::memory_order_relaxed) >> 2) << 32) | (uint32_t)m_socket;
+    }
+    // 事件的句柄是否仍然属于槽位中打开着的连接
+    bool current(uint64_t handle) const {
+        uint32_t lifecycle = m_lifecycle.load(std::memory_order_acquire);
+        return (lifecycle & 3) == CONN_OPEN && (lifecycle >> 2) == (uint32_t)(handle >> 32);
+    }
 
 
-    http_conn() {}
-    ~http_conn() {};
+
+    http_conn() : m_socket(-1), m_lifecycle(CONN_FREE), m_cold(NULL), m_ssl(NULL), m_h2(NULL) {}
+    ~http_conn() { m_cold_pool.put(m_cold); }
     void process(); // 处理客户端请求 
+    void shed();            // 线程池过载时丢弃请求，直接应答503并关闭连接
+    bool admit();           // 按客户端IP的请求速率限制检查，解析出完整请求后调用 HTTP/2连接按流在会话中检查
+    bool process_inline();  // 在Reactor线程中直接处理请求并写回，返回false表示需要关闭连接
+    const char * header_end();              // 请求头已完整时返回"\r\n\r\n"的位置，否则返回NULL
+    bool cheap_request(const char * end);   // 估计请求的处理代价是否足够小，可以不交给线程池
+    int classify();         // 加入线程池时对请求分类，返回所属的通道(LANE)
     void init(int sockfd, const sockaddr_in & addr); // 初始化新接收的连接
-    void close_conn();
+    void attach(int sockfd, const sockaddr_in & addr, int epollfd); // 初始化新连接，但由调用者负责将其注册到自己的epollfd中
+    void close_conn();  // 可以被多个线程同时调用 只有一个执行关闭
     bool read();        // 非阻塞读数据
     bool write();       // 非阻塞写数据
 
+    // 以下供协程等自行驱动IO的模式使用
+    IO_STATUS read_some();  // 循环读取数据直到EAGAIN
+    IO_STATUS write_some(); // 循环写出响应直到写完或EAGAIN
+    void reset() { init(); }    // 一个请求应答完毕，为同一连接上的下一个请求重置状态
+    bool keep_alive() const { return m_linger; }
+    int get_socket() const { return m_socket; }
+
+    // HTTP/2连接 process_read返回H2_SESSION之后使用
+    IO_STATUS h2_process();     // 读取并处理所有帧，再写出待发送的数据直到写完或EAGAIN，连接应当关闭时返回IO_CLOSED
+    int h2_events();            // h2_process之后应当等待的epoll事件 待写出的数据积压时不等待可读
+    bool h2_want_write() const; // 还有数据等待socket可写
+    bool is_h2() const { return m_h2 != NULL; }
+
+    // 查找url对应的应答内容 real_file为FILENAME_LEN大小的缓冲区，返回FILE_REQUEST或错误
+    static HTTP_CODE open_body(const char * url, char * real_file, http_body & body);
+    static void release_body(http_body & body);
+    // 记录一个请求的指标和访问日志 start为读到请求的时刻
+    static void record_response(int fd, METHOD method, const char * url, int status, uint64_t bytes, uint64_t start);
+
+    // 请求阶段追踪 只对被采样的请求记录时间戳
+    void trace_dispatch(uint64_t wake) { if(g_trace_enabled) m_cold->trace_wake = wake; }    // Reactor在读取之前传入epoll_wait返回的时刻
+    void trace_point(TRACE_POINT point) {
+        if(m_traced) {
+            m_cold->trace.ts[point] = trace_now();
+            m_cold->trace.tid[point] = trace_tid();
+        }
+    }
+
     // 以下被process_read调用用于分析http请求
-    HTTP_CODE process_read();               // 解析http请求
+    HTTP_CODE process_read();               // 解析http请求 并统计解析耗时
     HTTP_CODE parse_request_line(char *text);       // 解析请求首行
     HTTP_CODE parse_heders(char *text);     // 解析请求头
     HTTP_CODE parse_content(char *text);    // 解析请求体
@@ -93,38 +195,70 @@ public:
 
 
 private:
-    int m_socket; // 该http连接的socket
-    sockaddr_in address;
-    char m_read_buffer[READ_BUFFER_SIZE];   // 读缓冲区
-    int m_read_index;           // 标识读缓冲区中已经读入的客户端数据的最后一个字节的下一个位置    
+    // 冷数据：缓冲区、请求的解析结果和统计信息 只在真正解析或写出时访问，放在对象之外
+    struct cold_state {
+        char read_buffer[READ_BUFFER_SIZE];     // 读缓冲区
+        char write_buffer[WRITE_BUFFER_SIZE];   // 写缓冲区
+        char real_file[FILENAME_LEN];   // 客户请求的目标文件的完整路径，其内容等于 doc_root + url, doc_root是网站根目录
+        sockaddr_in address;
+        char * url;                 // 客户请求的目标文件的文件名
+        char * version;             // HTTP协议版本号，我们仅支持HTTP1.1
+        char * host;                // 主机名
+        METHOD method;              // 请求方法
+        int content_length;         // 请求体字节数
+        int status;                 // 响应的状态码
+        int iv_count;
+        struct iovec iv[2];         // 采用writev来执行写操作，iv_count表示被写内存块的数量
+        http_body body;             // 应答的文件内容(缓存、mmap)或动态内容
+        uint64_t request_start;     // 读到请求第一个字节的时刻(CLOCK_MONOTONIC 纳秒)
+        uint64_t write_start;       // 应答生成完毕的时刻
+        uint64_t parse_ns;          // 解析请求累计的耗时
+        uint64_t handle_ns;         // 本次process_read中do_request的耗时
+        uint64_t trace_wake;        // 最近一次epoll_wait返回的时刻(trace_now)
+        trace_record trace;         // 被追踪请求各阶段的时间戳
+        bool upgrade_h2c;           // 请求带有Upgrade: h2c
+        char * h2_settings;         // 请求的HTTP2-Settings头部
+    };
 
+    // 热数据：每次分发事件、推进状态机或写出时都会访问 正好一个缓存行
+    int m_socket;               // 该http连接的socket
+    int m_epfd;                 // 该连接注册到的epollfd
+    int m_read_index;           // 标识读缓冲区中已经读入的客户端数据的最后一个字节的下一个位置
     int m_checked_index;        // 当前读缓冲区中正在分析的字符所处的位置
     int m_start_line;           // 当前正在解析的行的起始位置
+    int m_write_index;          // 写缓冲区中待发送的字节数
+    int m_bytes_to_send;        // 剩余待发送的字节数
+    int m_bytes_have_send;      // 已经发送的字节数
+    std::atomic<uint32_t> m_lifecycle;  // 代数 << 2 | CONN_STATE 关闭时用CAS保证只关闭一次
     CHECK_STATE m_check_state;  // 主状态机当前所处的状态
-    char * m_url;               // 客户请求的目标文件的文件名
-    char * m_version;           // HTTP协议版本号，我们仅支持HTTP1.1
-    METHOD m_method;            // 请求方法
-    char * m_host;              // 主机名
-    bool m_linger;              // HTTP请求是否要求保持连接
-    int m_content_length;       // 请求体字节数
-    char m_real_file[FILENAME_LEN]; // 客户请求的目标文件的完整路径，其内容等于 doc_root + m_url, doc_root是网站根目录
-
-
-    char m_write_buffer[WRITE_BUFFER_SIZE];    // 写缓冲区
-    int m_write_index;            // 写缓冲区中待发送的字节数
-    char* m_file_address;       // 客户请求的目标文件被mmap到内存中的起始
-    struct stat m_file_stat; // 目标文件的状态 通过该状态可以判断文件是否存在、是否为目录、是否可读、并获取文件大小等信息
-    struct iovec m_iv[2];       // 采用writev来执行写操作，所有定义以下两个成员，其中m_iv_count表示被写内存块的数量
-    int m_iv_count;
-
-
+    // 同一时刻只有持有连接的线程修改 放在一个字节中
+    bool m_linger : 1;          // HTTP请求是否要求保持连接
+    bool m_traced : 1;          // 当前请求是否被采样追踪
+    bool m_tls_established : 1; // TLS握手已经完成
+    bool m_ktls_send : 1;       // 内核负责加密发送 应答可以直接writev到socket
+    cold_state * m_cold;        // 第一次使用该槽位时从m_cold_pool分配 连接关闭后留给下一个连接
+    SSL * m_ssl;                // HTTPS连接的SSL对象，明文连接为NULL
+    h2_session * m_h2;          // 已切换到HTTP/2的连接的会话 否则为NULL
 
     void init(); // 初始化连接的一些信息
 
-    char * get_line() { return m_read_buffer + m_start_line; }
+    char * get_line() { return m_cold->read_buffer + m_start_line; }
+    HTTP_CODE parse_request();  // process_read的实际实现：从主状态机中解析请求
+    HTTP_CODE handle_request(); // 调用do_request并记录耗时
+    HTTP_CODE upgrade_h2c();    // 应答101并把连接切换到HTTP/2
+    static HTTP_CODE render_metrics(http_body & body); // 生成 /metrics 的应答内容
+    void finish_request();      // 响应写完后记录指标和访问日志
+    IO_STATUS tls_handshake();  // 推进非阻塞的TLS握手 完成时返回IO_OK
+    int recv_some(char * buf, int len);     // 同recv 经过TLS时读取解密后的数据
+    int send_iov(const struct iovec * iov, int count);  // 同writev 经过TLS且没有kTLS时用SSL_write
 
+    friend class microbench;    // 微基准测试直接填充读写缓冲区(test_presure/microbench.cpp)
 };
 
+static_assert(sizeof(http_conn) == 64, "http_conn should stay within one cache line");
+
+
 
+extern const char * doc_root;  // 网站的根目录
 
 #endif
\ No newline at end of file
@@ -0,0 +1,276 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include "hugemem.h"
+#include "log.h"
+
+static HUGE_PAGE_MODE g_huge_mode = HUGE_OFF;
+static int g_node_count = 1;
+static short g_cpu_node[CPU_SETSIZE];   // CPU所在的节点 未知为0
+
+static const char * mode_name(HUGE_PAGE_MODE mode) {
+    return mode == HUGE_TLB ? "hugetlb" : mode == HUGE_THP ? "thp" : "off";
+}
+
+// 解析"0-3,8-11"形式的列表 对其中每个编号调用fn
+template<typename F>
+static void parse_list(const char * text, F fn) {
+    while(*text) {
+        char * end;
+        long first = strtol(text, &end, 10);
+        if(end == text) {
+            break;
+        }
+        long last = first;
+        if(*end == '-') {
+            text = end + 1;
+            last = strtol(text, &end, 10);
+        }
+        for(long i = first; i <= last; i++) {
+            fn((int)i);
+        }
+        text = *end == ',' ? end + 1 : end;
+        if(*text == '\n') {
+            break;
+        }
+    }
+}
+
+static bool read_line(const char * path, char * buf, int size) {
+    FILE * f = fopen(path, "r");
+    if(!f) {
+        return false;
+    }
+    bool ok = fgets(buf, size, f) != NULL;
+    fclose(f);
+    return ok;
+}
+
+bool hugemem_init(HUGE_PAGE_MODE mode) {
+    g_huge_mode = mode;
+    memset(g_cpu_node, 0, sizeof(g_cpu_node));
+    char buf[1024];
+    if(read_line("/sys/devices/system/node/online", buf, sizeof(buf))) {
+        parse_list(buf, [](int node) {
+            if(node < 0 || node >= HUGEMEM_MAX_NODES) {
+                return;
+            }
+            g_node_count = node + 1 > g_node_count ? node + 1 : g_node_count;
+            char path[64], cpus[1024];
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+            if(read_line(path, cpus, sizeof(cpus))) {
+                parse_list(cpus, [node](int cpu) {
+                    if(cpu >= 0 && cpu < CPU_SETSIZE) {
+                        g_cpu_node[cpu] = node;
+                    }
+                });
+            }
+        });
+    }
+    LOG_INFO("hugemem: %d numa nodes, huge pages %s, home node %d", g_node_count, mode_name(mode), hugemem_home_node());
+    return true;
+}
+
+int hugemem_nodes() {
+    return g_node_count;
+}
+
+int hugemem_node_of_cpu(int cpu) {
+    return cpu >= 0 && cpu < CPU_SETSIZE ? g_cpu_node[cpu] : 0;
+}
+
+int hugemem_current_node() {
+    return hugemem_node_of_cpu(sched_getcpu());
+}
+
+int hugemem_home_node() {
+    cpu_set_t set;
+    if(sched_getaffinity(0, sizeof(set), &set) != 0) {
+        return HUGEMEM_INTERLEAVE;
+    }
+    int home = HUGEMEM_INTERLEAVE;
+    for(int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if(!CPU_ISSET(cpu, &set)) {
+            continue;
+        }
+        if(home != HUGEMEM_INTERLEAVE && g_cpu_node[cpu] != home) {
+            return HUGEMEM_INTERLEAVE;
+        }
+        home = g_cpu_node[cpu];
+    }
+    return home;
+}
+
+// 在首次访问之前设置区域的节点策略 只有一个节点时不需要
+static void bind_node(void * addr, size_t len, int node) {
+    if(g_node_count <= 1) {
+        return;
+    }
+    unsigned long mask[HUGEMEM_MAX_NODES / (8 * sizeof(unsigned long))] = {};
+    int policy = MPOL_PREFERRED;
+    if(node == HUGEMEM_INTERLEAVE) {
+        policy = MPOL_INTERLEAVE;
+        for(int i = 0; i < g_node_count; i++) {
+            mask[i / (8 * sizeof(unsigned long))] |= 1UL << (i % (8 * sizeof(unsigned long)));
+        }
+    } else {
+        mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+    }
+    if(syscall(SYS_mbind, addr, len, policy, mask, HUGEMEM_MAX_NODES + 1, 0) != 0) {
+        LOG_WARN("mbind node %d failure: %s", node, strerror(errno));
+    }
+}
+
+void * hugemem_alloc(size_t size, int node) {
+    size_t len = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    void * addr = MAP_FAILED;
+    if(g_huge_mode == HUGE_TLB) {
+        addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if(addr == MAP_FAILED) {
+            // 预留的大页不足 之后的分配都使用透明大页
+            LOG_WARN("MAP_HUGETLB failure (%s), fall back to transparent huge pages", strerror(errno));
+            g_huge_mode = HUGE_THP;
+        }
+    }
+    if(addr == MAP_FAILED) {
+        // 多映射2MB再去掉首尾 使区域按大页对齐，透明大页才能覆盖整个区域
+        size_t map_len = g_huge_mode == HUGE_OFF ? len : len + HUGE_PAGE_SIZE;
+        char * base = (char *)mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(base == MAP_FAILED) {
+            LOG_ERROR("mmap %zu bytes failure: %s", len, strerror(errno));
+            return NULL;
+        }
+        char * aligned = base;
+        if(g_huge_mode != HUGE_OFF) {
+            aligned = (char *)(((uintptr_t)base + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+            if(aligned > base) {
+                munmap(base, aligned - base);
+            }
+            if(base + map_len > aligned + len) {
+                munmap(aligned + len, base + map_len - (aligned + len));
+            }
+            madvise(aligned, len, MADV_HUGEPAGE);
+        }
+        addr = aligned;
+    }
+    bind_node(addr, len, node);
+    return addr;
+}
+
+void hugemem_free(void * addr, size_t size) {
+    size_t len = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    munmap(addr, len);
+}
+
+// 区域所在映射中透明大页的大小(KB) 从/proc/self/smaps读取
+static long anon_huge_kb(const void * addr) {
+    FILE * f = fopen("/proc/self/smaps", "r");
+    if(!f) {
+        return -1;
+    }
+    char line[256];
+    bool found = false;
+    long kb = -1;
+    while(fgets(line, sizeof(line), f)) {
+        unsigned long start, end;
+        if(sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+            // 每个映射以"起始-结束 权限 ..."开头 之后是它的各项统计
+            found = (uintptr_t)addr >= start && (uintptr_t)addr < end;
+        } else if(found && sscanf(line, "AnonHugePages: %ld kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(f);
+    return kb;
+}
+
+void hugemem_report(const char * name, const void * addr, size_t size) {
+    // 最多抽查1024个4KB页
+    const int SAMPLES = 1024;
+    size_t pages = (size + 4095) / 4096;
+    size_t step = pages > (size_t)SAMPLES ? pages / SAMPLES : 1;
+    void * sample[SAMPLES];
+    int status[SAMPLES];
+    int count = 0;
+    for(size_t i = 0; i < pages && count < SAMPLES; i += step) {
+        sample[count++] = (char *)addr + i * 4096;
+    }
+    int per_node[HUGEMEM_MAX_NODES] = {};
+    int absent = 0;
+    if(syscall(SYS_move_pages, 0, count, sample, NULL, status, 0) != 0) {
+        LOG_WARN("hugemem %s: move_pages failure: %s", name, strerror(errno));
+        return;
+    }
+    for(int i = 0; i < count; i++) {
+        if(status[i] >= 0 && status[i] < HUGEMEM_MAX_NODES) {
+            per_node[status[i]]++;
+        } else {
+            absent++;
+        }
+    }
+    char placement[256];
+    int len = 0;
+    for(int node = 0; node < g_node_count && len < (int)sizeof(placement) - 32; node++) {
+        len += snprintf(placement + len, sizeof(placement) - len, " node%d %d%%", node, per_node[node] * 100 / count);
+    }
+    LOG_INFO("hugemem %s: %zu KB, %s, huge %ld KB,%s (%d/%d sampled pages not present)",
+             name, size >> 10, mode_name(g_huge_mode), anon_huge_kb(addr), placement, absent, count);
+}
+
+// 每个对象之前的一个缓存行记录它所属的节点
+static const size_t OBJECT_HEADER = 64;
+
+node_pool::node_pool(size_t object_size) {
+    m_stride = (object_size + OBJECT_HEADER + 63) & ~(size_t)63;
+    for(int i = 0; i < HUGEMEM_MAX_NODES; i++) {
+        m_nodes[i].free = NULL;
+        m_nodes[i].next = NULL;
+        m_nodes[i].end = NULL;
+        m_nodes[i].chunks = 0;
+    }
+}
+
+void * node_pool::get() {
+    int node = hugemem_current_node();
+    node_list & list = m_nodes[node];
+    list.lock.lock();
+    char * object = (char *)list.free;
+    if(object) {
+        list.free = *(void **)object;
+    } else {
+        if(!list.next || list.next + m_stride > list.end) {
+            char * chunk = (char *)hugemem_alloc(HUGE_PAGE_SIZE, node);
+            if(!chunk) {
+                list.lock.unlock();
+                return NULL;
+            }
+            list.next = chunk;
+            list.end = chunk + HUGE_PAGE_SIZE;
+            list.chunks++;
+            LOG_DEBUG("hugemem pool: node %d chunk %d", node, list.chunks);
+        }
+        object = list.next + OBJECT_HEADER;
+        *(int *)list.next = node;
+        list.next += m_stride;
+    }
+    list.lock.unlock();
+    return object;
+}
+
+void node_pool::put(void * object) {
+    if(!object) {
+        return;
+    }
+    node_list & list = m_nodes[*(int *)((char *)object - OBJECT_HEADER)];
+    list.lock.lock();
+    *(void **)object = list.free;
+    list.free = object;
+    list.lock.unlock();
+}
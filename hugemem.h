@@ -0,0 +1,56 @@
+#ifndef HUGEMEM_H
+#define HUGEMEM_H
+
+#include <stddef.h>
+#include "config.h"
+#include "locker.h"
+
+/*
+    大页与NUMA感知的内存分配(-G)
+    连接表(65535个槽位，4MB)和每个连接的缓冲区原本由最先运行的线程分配和首次访问，
+    在多路服务器上落在同一个节点，其他节点的核每个请求都在访问远端内存；4KB的页也让大表频繁TLB缺失。
+        HUGE_TLB    :   MAP_HUGETLB使用预留的2MB大页(/proc/sys/vm/nr_hugepages)，预留不足时退回THP
+        HUGE_THP    :   按2MB对齐映射并madvise(MADV_HUGEPAGE)，由内核的透明大页合并(默认)
+        HUGE_OFF    :   普通的4KB页
+    节点策略在首次访问之前用mbind设置：进程可用的CPU都在一个节点上(多进程模式下worker已绑定CPU)时
+    优先从该节点分配，否则连接表在所有节点间交错；连接的缓冲区从当前线程所在节点的对象池中分配。
+    分配之后按页查询实际所在的节点(move_pages)，连同透明大页的数量写入日志。
+    不依赖libnuma，直接读取/sys/devices/system/node并使用系统调用。
+*/
+
+static const size_t HUGE_PAGE_SIZE = 2 << 20;
+static const int HUGEMEM_INTERLEAVE = -1;  // 在所有节点间交错分配
+static const int HUGEMEM_MAX_NODES = 64;
+
+bool hugemem_init(HUGE_PAGE_MODE mode);    // 读取NUMA拓扑并记录大页的使用方式
+int hugemem_nodes();                        // 节点数 没有NUMA信息时为1
+int hugemem_node_of_cpu(int cpu);
+int hugemem_current_node();                 // 当前线程所在CPU的节点
+int hugemem_home_node();                    // 进程可用的CPU都在同一个节点时返回该节点 否则HUGEMEM_INTERLEAVE
+
+// 按2MB向上取整映射 node为节点编号或HUGEMEM_INTERLEAVE，失败返回NULL
+void * hugemem_alloc(size_t size, int node);
+void hugemem_free(void * addr, size_t size);
+// 查询已经访问过的区域实际所在的节点和透明大页的大小 写入日志
+void hugemem_report(const char * name, const void * addr, size_t size);
+
+// 按节点划分的定长对象池 对象从当前线程所在节点的2MB块中切分，释放时回到分配它的节点
+class node_pool {
+public:
+    explicit node_pool(size_t object_size);
+    void * get();               // 失败返回NULL
+    void put(void * object);
+
+private:
+    struct node_list {
+        locker lock;
+        void * free;            // 已释放对象组成的链表
+        char * next;            // 当前块中未切分部分的起始
+        char * end;
+        int chunks;             // 已映射的块数
+    };
+    size_t m_stride;            // 对象大小加上记录节点编号的头部 按缓存行取整
+    node_list m_nodes[HUGEMEM_MAX_NODES];
+};
+
+#endif
@@ -0,0 +1,116 @@
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include "listener.h"
+#include "log.h"
+#include "affinity.h"
+
+int listen_tcp(int port, bool reuseport, int backlog) {
+    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    if(listenfd < 0) {
+        LOG_ERROR("socket failure: %s", strerror(errno));
+        return -1;
+    }
+    struct sockaddr_in address;
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+
+    // 设置端口复用
+    int reuse = 1;  // 1 表示复用 0 表示不复用
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if(reuseport) {
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+    }
+    // 绑定
+    if(bind(listenfd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        LOG_ERROR("bind port %d failure: %s", port, strerror(errno));
+        close(listenfd);
+        return -1;
+    }
+    // 设置监听 队列太短时突发的连接在SYN之后被丢弃，客户端要等待重传
+    if(listen(listenfd, backlog) < 0) {
+        LOG_ERROR("listen failure: %s", strerror(errno));
+        close(listenfd);
+        return -1;
+    }
+    return listenfd;
+}
+
+int listen_unix(const char * path, int backlog) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(address.sun_path)) {
+        LOG_ERROR("unix socket path too long: %s", path);
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    // 进程退出时不删除路径(升级时新进程仍在使用) 下一次启动时在这里删除
+    struct stat st;
+    if(lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+    int listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listenfd < 0) {
+        LOG_ERROR("socket failure: %s", strerror(errno));
+        return -1;
+    }
+    if(bind(listenfd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        LOG_ERROR("bind %s failure: %s", path, strerror(errno));
+        close(listenfd);
+        return -1;
+    }
+    if(listen(listenfd, backlog) < 0) {
+        LOG_ERROR("listen failure: %s", strerror(errno));
+        close(listenfd);
+        return -1;
+    }
+    return listenfd;
+}
+
+int listen_accept(int listenfd, sockaddr_in & address, int flags) {
+    struct sockaddr_storage client;
+    socklen_t len = sizeof(client);
+    int connfd = accept4(listenfd, (struct sockaddr*)&client, &len, flags);
+    if(connfd < 0) {
+        return -1;
+    }
+    if(client.ss_family == AF_INET) {
+        memcpy(&address, &client, sizeof(address));
+        affinity_record(connfd);
+    } else {
+        // 本机的Unix域连接 客户端通常没有绑定路径
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_UNIX;
+    }
+    return connfd;
+}
+
+int listen_address(int fd, char * path, size_t len) {
+    struct sockaddr_storage address;
+    socklen_t address_len = sizeof(address);
+    if(getsockname(fd, (struct sockaddr*)&address, &address_len) != 0) {
+        return -1;
+    }
+    if(address.ss_family == AF_INET) {
+        return ntohs(((struct sockaddr_in*)&address)->sin_port);
+    }
+    if(address.ss_family == AF_UNIX && len > 0) {
+        const struct sockaddr_un * un = (struct sockaddr_un*)&address;
+        size_t path_len = address_len > offsetof(struct sockaddr_un, sun_path)
+                        ? strnlen(un->sun_path, address_len - offsetof(struct sockaddr_un, sun_path)) : 0;
+        if(path_len >= len) {
+            return -1;
+        }
+        memcpy(path, un->sun_path, path_len);
+        path[path_len] = '\0';
+        return 0;
+    }
+    return -1;
+}
@@ -0,0 +1,26 @@
+#ifndef LISTENER_H
+#define LISTENER_H
+
+#include <stddef.h>
+#include <netinet/in.h>
+
+/*
+    监听socket
+    TCP端口绑定在INADDR_ANY上；Unix域socket(SOCK_STREAM)供同一台机器上的sidecar和本地客户端使用，
+    数据直接在两端的socket缓冲区之间复制，省去回环TCP/IP协议栈的分段、校验和、ACK和拥塞控制。
+    两种连接accept之后没有区别，都交给同一个http_conn处理，应答内容同样直接从文件缓存或mmap的区域writev出去。
+    Unix域连接的客户端地址记为AF_UNIX、IP为0，不参与按IP的限流。
+*/
+
+// reuseport为true时设置SO_REUSEPORT，多个进程各自绑定同一端口，由内核在它们之间分发连接
+int listen_tcp(int port, bool reuseport, int backlog);
+// path上遗留的socket文件(上一个进程未删除)先删除 其他类型的文件不覆盖
+int listen_unix(const char * path, int backlog);
+
+// accept并把客户端地址统一为sockaddr_in 失败时返回-1并保留errno
+int listen_accept(int listenfd, sockaddr_in & address, int flags);
+
+// 监听socket绑定的地址：TCP时返回端口，Unix域时返回0并把路径写入path，失败返回-1
+int listen_address(int fd, char * path, size_t len);
+
+#endif
@@ -100,6 +100,11 @@ public:
     bool post() {
         return sem_post(&m_sem) == 0;
     }
+
+    // 不阻塞 信号量为0时返回false
+    bool trywait() {
+        return sem_trywait(&m_sem) == 0;
+    }
     
 private:
     sem_t m_sem;
@@ -0,0 +1,456 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <atomic>
+#include <unordered_set>
+#include "log.h"
+#include "locker.h"
+
+int g_log_level = LOG_LEVEL_INFO;
+
+static const char * level_names[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+
+// 环形缓冲区中每条记录的头部 之后紧跟length字节的内容
+struct ring_record {
+    uint16_t length;    // 记录内容的长度
+    uint8_t kind;       // RECORD_TEXT / RECORD_ACCESS / RECORD_CAPTURE
+    uint8_t level;      // 文本日志的级别
+    uint64_t time_ns;   // 写日志的时刻(CLOCK_REALTIME)
+};
+enum { RECORD_TEXT = 0, RECORD_ACCESS, RECORD_CAPTURE };
+
+/*
+    单生产者单消费者的无锁环形缓冲区
+    生产者为拥有它的线程，消费者为后台刷新线程；m_head和m_tail只增不减，取模后得到下标
+*/
+class log_ring {
+public:
+    static const size_t SIZE = 1 << 18;     // 每个线程256KB
+
+    log_ring() : m_head(0), m_tail(0), m_dropped(0) {}
+
+    bool push(const ring_record & head, const char * data) {
+        size_t need = sizeof(head) + head.length;
+        size_t h = m_head.load(std::memory_order_relaxed);
+        size_t t = m_tail.load(std::memory_order_acquire);
+        if(SIZE - (h - t) < need) {
+            // 缓冲区已满 丢弃而不是阻塞
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        copy_in(h, &head, sizeof(head));
+        copy_in(h + sizeof(head), data, head.length);
+        m_head.store(h + need, std::memory_order_release);
+        return true;
+    }
+
+    // 取出所有记录交给handler处理 返回处理的记录数
+    template<typename Handler>
+    int drain(Handler & handler) {
+        size_t t = m_tail.load(std::memory_order_relaxed);
+        size_t h = m_head.load(std::memory_order_acquire);
+        int count = 0;
+        char data[65536];
+        while(t < h) {
+            ring_record head;
+            copy_out(t, &head, sizeof(head));
+            copy_out(t + sizeof(head), data, head.length);
+            handler(head, data);
+            t += sizeof(head) + head.length;
+            count++;
+        }
+        m_tail.store(t, std::memory_order_release);
+        return count;
+    }
+
+    long long dropped() const { return m_dropped.load(std::memory_order_relaxed); }
+
+    // 丢弃尚未取出的记录
+    void discard() { m_tail.store(m_head.load(std::memory_order_acquire), std::memory_order_release); }
+
+private:
+    void copy_in(size_t pos, const void * src, size_t len) {
+        size_t index = pos & (SIZE - 1);
+        size_t first = len < SIZE - index ? len : SIZE - index;
+        memcpy(m_buffer + index, src, first);
+        memcpy(m_buffer, (const char *)src + first, len - first);
+    }
+
+    void copy_out(size_t pos, void * dst, size_t len) const {
+        size_t index = pos & (SIZE - 1);
+        size_t first = len < SIZE - index ? len : SIZE - index;
+        memcpy(dst, m_buffer + index, first);
+        memcpy((char *)dst + first, m_buffer, len - first);
+    }
+
+    alignas(64) std::atomic<size_t> m_head;     // 生产者写入的位置
+    alignas(64) std::atomic<size_t> m_tail;     // 消费者读取的位置
+    std::atomic<long long> m_dropped;           // 因缓冲区满被丢弃的记录数
+    char m_buffer[SIZE];
+};
+
+static const int MAX_RINGS = 1024;
+static log_ring * g_rings[MAX_RINGS];
+static std::atomic<int> g_ring_count(0);
+static log_ring * g_free_rings[MAX_RINGS];      // 已退出的线程交还的缓冲区
+static int g_free_count = 0;
+static locker g_rings_locker;
+static thread_local log_ring * t_ring = NULL;
+
+static int g_log_fd = STDOUT_FILENO;
+static int g_access_fd = -1;
+static int g_capture_fd = -1;
+static std::atomic<bool> g_running(false);
+static pthread_t g_flusher;
+
+// 获取当前线程的环形缓冲区 第一次调用时优先取已退出线程交还的，否则创建并登记
+static log_ring * get_ring() {
+    if(t_ring) {
+        return t_ring;
+    }
+    g_rings_locker.lock();
+    int n = g_ring_count.load(std::memory_order_relaxed);
+    if(g_free_count > 0) {
+        t_ring = g_free_rings[--g_free_count];
+    } else if(n < MAX_RINGS) {
+        t_ring = new log_ring;
+        g_rings[n] = t_ring;
+        g_ring_count.store(n + 1, std::memory_order_release);
+    }
+    g_rings_locker.unlock();
+    return t_ring;
+}
+
+// 缓冲区仍登记在刷新线程中 其中未写出的记录照常写出；加锁保证下一个生产者看到本线程的写入位置
+void log_thread_exit() {
+    if(!t_ring) {
+        return;
+    }
+    g_rings_locker.lock();
+    g_free_rings[g_free_count++] = t_ring;
+    g_rings_locker.unlock();
+    t_ring = NULL;
+}
+
+static uint64_t realtime_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// 加上时间和级别前缀 格式化一行文本日志 返回长度
+static int format_line(char * out, int size, uint64_t time_ns, int level, const char * msg, int len) {
+    time_t sec = time_ns / 1000000000ULL;
+    struct tm tm;
+    localtime_r(&sec, &tm);
+    int n = strftime(out, size, "%Y-%m-%d %H:%M:%S", &tm);
+    n += snprintf(out + n, size - n, ".%06d [%s] ", (int)(time_ns % 1000000000ULL / 1000), level_names[level]);
+    if(len > size - n - 1) {
+        len = size - n - 1;
+    }
+    memcpy(out + n, msg, len);
+    n += len;
+    if(n == 0 || out[n - 1] != '\n') {
+        out[n++] = '\n';
+    }
+    return n;
+}
+
+static void write_all(int fd, const char * data, size_t len) {
+    while(len > 0) {
+        ssize_t n = ::write(fd, data, len);
+        if(n < 0) {
+            return;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+// 刷新线程把记录攒成批再写出
+class batch_writer {
+public:
+    batch_writer() : m_text_len(0), m_access_len(0), m_capture_len(0) {}
+
+    void operator()(const ring_record & head, const char * data) {
+        if(head.kind == RECORD_TEXT) {
+            if(m_text_len + head.length + 64 > sizeof(m_text)) {
+                flush();
+            }
+            m_text_len += format_line(m_text + m_text_len, sizeof(m_text) - m_text_len, head.time_ns, head.level, data, head.length);
+        } else if(head.kind == RECORD_ACCESS && g_access_fd >= 0) {
+            if(m_access_len + head.length > sizeof(m_access)) {
+                flush();
+            }
+            memcpy(m_access + m_access_len, data, head.length);
+            m_access_len += head.length;
+        } else if(head.kind == RECORD_CAPTURE && g_capture_fd >= 0) {
+            if(m_capture_len + head.length > sizeof(m_capture)) {
+                flush();
+            }
+            memcpy(m_capture + m_capture_len, data, head.length);
+            m_capture_len += head.length;
+        }
+    }
+
+    void flush() {
+        if(m_text_len > 0) {
+            write_all(g_log_fd, m_text, m_text_len);
+            m_text_len = 0;
+        }
+        if(m_access_len > 0) {
+            write_all(g_access_fd, m_access, m_access_len);
+            m_access_len = 0;
+        }
+        if(m_capture_len > 0) {
+            // O_APPEND 多个worker进程各自整批追加 记录不会交错
+            write_all(g_capture_fd, m_capture, m_capture_len);
+            m_capture_len = 0;
+        }
+    }
+
+private:
+    char m_text[1 << 17];
+    size_t m_text_len;
+    char m_access[1 << 17];
+    size_t m_access_len;
+    char m_capture[1 << 18];
+    size_t m_capture_len;
+};
+
+static int drain_all(batch_writer & writer) {
+    int count = 0;
+    int n = g_ring_count.load(std::memory_order_acquire);
+    for(int i = 0; i < n; i++) {
+        count += g_rings[i]->drain(writer);
+    }
+    writer.flush();
+    return count;
+}
+
+static void * flusher(void * arg) {
+    batch_writer * writer = new batch_writer;
+    long long reported = 0;
+    while(g_running.load(std::memory_order_acquire)) {
+        if(drain_all(*writer) == 0) {
+            // 没有日志时休眠1ms 避免空转
+            struct timespec ts = { 0, 1000000 };
+            nanosleep(&ts, NULL);
+        }
+        long long dropped = 0;
+        int n = g_ring_count.load(std::memory_order_acquire);
+        for(int i = 0; i < n; i++) {
+            dropped += g_rings[i]->dropped();
+        }
+        if(dropped > reported) {
+            char msg[128];
+            int len = snprintf(msg, sizeof(msg), "log: %lld records dropped", dropped - reported);
+            char line[256];
+            write_all(g_log_fd, line, format_line(line, sizeof(line), realtime_ns(), LOG_LEVEL_WARN, msg, len));
+            reported = dropped;
+        }
+    }
+    drain_all(*writer);
+    delete writer;
+    return NULL;
+}
+
+// 以追加方式打开二进制日志 新文件先写入文件头
+static int open_binary_log(const char * file, const char * magic, uint32_t version) {
+    int fd = open(file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if(fd < 0) {
+        return -1;
+    }
+    if(lseek(fd, 0, SEEK_END) == 0) {
+        access_log_header header;
+        memcpy(header.magic, magic, 4);
+        header.version = version;
+        write_all(fd, (const char *)&header, sizeof(header));
+    }
+    return fd;
+}
+
+bool log_init(int level, const char * log_file, const char * access_log_file, const char * capture_file) {
+    g_log_level = level;
+    if(log_file) {
+        g_log_fd = open(log_file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if(g_log_fd < 0) {
+            g_log_fd = STDOUT_FILENO;
+            return false;
+        }
+    }
+    if(access_log_file) {
+        g_access_fd = open_binary_log(access_log_file, ACCESS_LOG_MAGIC, ACCESS_LOG_VERSION);
+        if(g_access_fd < 0) {
+            return false;
+        }
+    }
+    if(capture_file) {
+        g_capture_fd = open_binary_log(capture_file, CAPTURE_MAGIC, CAPTURE_VERSION);
+        if(g_capture_fd < 0) {
+            return false;
+        }
+    }
+    g_running.store(true, std::memory_order_release);
+    if(pthread_create(&g_flusher, NULL, flusher, NULL) != 0) {
+        g_running.store(false, std::memory_order_release);
+        return false;
+    }
+    return true;
+}
+
+void log_shutdown() {
+    if(!g_running.exchange(false)) {
+        return;
+    }
+    pthread_join(g_flusher, NULL);
+    if(g_access_fd >= 0) {
+        close(g_access_fd);
+        g_access_fd = -1;
+    }
+    if(g_capture_fd >= 0) {
+        close(g_capture_fd);
+        g_capture_fd = -1;
+    }
+}
+
+// fork只复制调用线程，子进程中没有刷新线程；继承来的未刷新记录由父进程负责写出，子进程中丢弃
+void log_after_fork() {
+    if(!g_running.load(std::memory_order_acquire)) {
+        return;
+    }
+    int n = g_ring_count.load(std::memory_order_acquire);
+    for(int i = 0; i < n; i++) {
+        g_rings[i]->discard();
+    }
+    if(pthread_create(&g_flusher, NULL, flusher, NULL) != 0) {
+        g_running.store(false, std::memory_order_release);
+    }
+}
+
+void log_write(int level, const char * format, ...) {
+    char msg[1024];
+    va_list arg_list;
+    va_start(arg_list, format);
+    int len = vsnprintf(msg, sizeof(msg), format, arg_list);
+    va_end(arg_list);
+    if(len < 0) {
+        return;
+    }
+    if(len >= (int)sizeof(msg)) {
+        len = sizeof(msg) - 1;
+    }
+
+    ring_record head = { (uint16_t)len, RECORD_TEXT, (uint8_t)level, realtime_ns() };
+    log_ring * ring = g_running.load(std::memory_order_acquire) ? get_ring() : NULL;
+    if(!ring) {
+        // 刷新线程没有启动(如工具程序中)时直接同步写出
+        char line[1200];
+        write_all(g_log_fd, line, format_line(line, sizeof(line), head.time_ns, level, msg, len));
+        return;
+    }
+    ring->push(head, msg);
+}
+
+bool access_log_enabled() {
+    return g_access_fd >= 0;
+}
+
+uint32_t log_path_id(const char * path) {
+    uint32_t hash = 2166136261u;
+    for(; *path; path++) {
+        hash ^= (unsigned char)*path;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+void log_access(access_record & record, const char * path) {
+    if(g_access_fd < 0) {
+        return;
+    }
+    log_ring * ring = get_ring();
+    if(!ring) {
+        return;
+    }
+    if(!path) {
+        path = "-";
+    }
+    record.path_id = log_path_id(path);
+
+    // 每个线程第一次遇到一个路径时先写出路径定义 多个线程重复定义是无害的
+    static thread_local std::unordered_set<uint32_t> * t_paths = NULL;
+    if(!t_paths) {
+        t_paths = new std::unordered_set<uint32_t>;
+    }
+    char data[1 + sizeof(access_path) + 1024];
+    if(t_paths->insert(record.path_id).second) {
+        access_path def;
+        def.path_id = record.path_id;
+        def.length = strnlen(path, 1024);
+        data[0] = ACCESS_RECORD_PATH;
+        memcpy(data + 1, &def, sizeof(def));
+        memcpy(data + 1 + sizeof(def), path, def.length);
+        ring_record head = { (uint16_t)(1 + sizeof(def) + def.length), RECORD_ACCESS, 0, 0 };
+        ring->push(head, data);
+    }
+
+    data[0] = ACCESS_RECORD_REQUEST;
+    memcpy(data + 1, &record, sizeof(record));
+    ring_record head = { (uint16_t)(1 + sizeof(record)), RECORD_ACCESS, 0, 0 };
+    ring->push(head, data);
+}
+
+int log_parse_level(const char * text) {
+    for(int i = LOG_LEVEL_DEBUG; i <= LOG_LEVEL_ERROR; i++) {
+        if(strcasecmp(text, level_names[i]) == 0) {
+            return i;
+        }
+    }
+    if(strcasecmp(text, "off") == 0) {
+        return LOG_LEVEL_OFF;
+    }
+    return -1;
+}
+
+
+bool capture_enabled() {
+    return g_capture_fd >= 0;
+}
+
+void log_capture(int type, uint64_t conn, const char * data, int len) {
+    if(g_capture_fd < 0) {
+        return;
+    }
+    log_ring * ring = get_ring();
+    if(!ring) {
+        return;
+    }
+    static const int MAX_CHUNK = 16384;
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    char buf[sizeof(capture_record) + MAX_CHUNK];
+    capture_record * record = (capture_record *)buf;
+    record->type = type;
+    record->reserved = 0;
+    record->pid = getpid();    // 多进程模式下fork之后各不相同 不能缓存
+    record->conn = conn;
+    record->timestamp_us = tv.tv_sec * 1000000ULL + tv.tv_usec;
+    do {
+        int chunk = len < MAX_CHUNK ? len : MAX_CHUNK;
+        record->length = chunk;
+        if(chunk > 0) {
+            memcpy(buf + sizeof(capture_record), data, chunk);
+        }
+        ring_record head = { (uint16_t)(sizeof(capture_record) + chunk), RECORD_CAPTURE, 0, 0 };
+        ring->push(head, buf);
+        data += chunk;
+        len -= chunk;
+    } while(len > 0);
+}
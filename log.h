@@ -0,0 +1,127 @@
+#ifndef LOG_H
+#define LOG_H
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+    异步日志
+    每个线程第一次写日志时创建一个单生产者单消费者的无锁环形缓冲区，写日志只是格式化后拷贝进缓冲区，
+    不经过stdio的全局锁，也不做终端IO；后台刷新线程定期把所有缓冲区中的记录写到日志文件(默认标准输出)。
+    缓冲区满时丢弃记录并计数，而不是阻塞工作线程。
+
+    日志级别在运行时由g_log_level控制；低于LOG_COMPILE_LEVEL的级别在编译期被去掉，
+    例如编译时定义 -DLOG_COMPILE_LEVEL=1 则所有LOG_DEBUG不产生任何代码。
+
+    访问日志为紧凑的二进制格式，每个请求一条定长记录，由 tools/accesslog_decode 离线解码。
+    流量捕获(-W)同样经过每个线程的环形缓冲区写出，记录每个连接收到的原始字节、时刻和连接的边界，
+    由 test_presure/replay 按原来的节奏、N倍速或全速回放。
+*/
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO  1
+#define LOG_LEVEL_WARN  2
+#define LOG_LEVEL_ERROR 3
+#define LOG_LEVEL_OFF   4
+
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+extern int g_log_level;     // 运行时的日志级别
+
+#define LOG_AT(level, fmt, ...) \
+    do { if((level) >= g_log_level) log_write(level, fmt, ##__VA_ARGS__); } while(0)
+
+#if LOG_COMPILE_LEVEL <= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(fmt, ...) LOG_AT(LOG_LEVEL_DEBUG, fmt, ##__VA_ARGS__)
+#else
+#define LOG_DEBUG(fmt, ...) do {} while(0)
+#endif
+
+#if LOG_COMPILE_LEVEL <= LOG_LEVEL_INFO
+#define LOG_INFO(fmt, ...) LOG_AT(LOG_LEVEL_INFO, fmt, ##__VA_ARGS__)
+#else
+#define LOG_INFO(fmt, ...) do {} while(0)
+#endif
+
+#if LOG_COMPILE_LEVEL <= LOG_LEVEL_WARN
+#define LOG_WARN(fmt, ...) LOG_AT(LOG_LEVEL_WARN, fmt, ##__VA_ARGS__)
+#else
+#define LOG_WARN(fmt, ...) do {} while(0)
+#endif
+
+#if LOG_COMPILE_LEVEL <= LOG_LEVEL_ERROR
+#define LOG_ERROR(fmt, ...) LOG_AT(LOG_LEVEL_ERROR, fmt, ##__VA_ARGS__)
+#else
+#define LOG_ERROR(fmt, ...) do {} while(0)
+#endif
+
+// 二进制访问日志的文件格式：文件头之后是一系列记录，每条记录以1字节的类型开始
+#define ACCESS_LOG_MAGIC "WSAL"
+#define ACCESS_LOG_VERSION 1
+#define ACCESS_RECORD_REQUEST 'A'   // 后跟 access_record
+#define ACCESS_RECORD_PATH 'P'      // 后跟 access_path，定义path_id对应的路径
+
+#pragma pack(push, 1)
+struct access_log_header {
+    char magic[4];
+    uint32_t version;
+};
+
+struct access_record {
+    uint64_t timestamp_us;  // 响应写完的时刻(UNIX时间，微秒)
+    uint32_t latency_us;    // 从读到请求的第一个字节到响应写完的时间
+    int32_t fd;             // 连接的文件描述符
+    uint32_t path_id;       // 请求路径的编号(路径的FNV-1a哈希)
+    uint32_t bytes;         // 发送的字节数
+    uint16_t status;        // HTTP状态码
+    uint8_t method;         // 请求方法 http_conn::METHOD
+    uint8_t reserved;
+};
+
+struct access_path {
+    uint32_t path_id;
+    uint16_t length;        // 之后紧跟length字节的路径 不含结束符
+};
+#pragma pack(pop)
+
+/*
+    流量捕获文件的格式：文件头(与访问日志相同的结构)之后是一系列记录，每条以capture_record开始
+    CAPTURE_OPEN        :   连接建立
+    CAPTURE_DATA        :   收到的数据(TLS连接为解密后的明文)，之后紧跟length字节
+    CAPTURE_RESPONSE    :   一个应答写完；回放时这之后的数据要等收到同样多的应答才发送，保持keep-alive和流水线的结构
+    CAPTURE_CLOSE       :   连接关闭
+    缓冲区满时与其他日志一样丢弃记录(计入"records dropped")，对应连接的回放可能不完整。
+*/
+#define CAPTURE_MAGIC "WSCP"
+#define CAPTURE_VERSION 1
+#define CAPTURE_OPEN 'O'
+#define CAPTURE_DATA 'D'
+#define CAPTURE_RESPONSE 'R'
+#define CAPTURE_CLOSE 'C'
+
+#pragma pack(push, 1)
+struct capture_record {
+    uint8_t type;
+    uint8_t reserved;
+    uint16_t length;        // CAPTURE_DATA的字节数 其他为0
+    uint32_t pid;           // 多进程模式下各worker写同一个文件
+    uint64_t conn;          // 连接句柄(代数 << 32 | fd) 与pid一起唯一标识一个连接
+    uint64_t timestamp_us;  // 事件的时刻(UNIX时间，微秒)
+};
+#pragma pack(pop)
+
+// 启动后台刷新线程 访问日志和流量捕获文件为NULL时不记录
+bool log_init(int level, const char * log_file, const char * access_log_file, const char * capture_file = NULL);
+void log_shutdown();        // 写出剩余的日志并停止刷新线程
+void log_after_fork();      // 在fork出的子进程中重新启动刷新线程
+void log_thread_exit();     // 线程退出前交还环形缓冲区 供之后创建的线程使用
+void log_write(int level, const char * format, ...) __attribute__((format(printf, 2, 3)));
+bool access_log_enabled();
+void log_access(access_record & record, const char * path);   // 记录一次请求，path_id由path计算
+uint32_t log_path_id(const char * path);
+bool capture_enabled();
+void log_capture(int type, uint64_t conn, const char * data, int len);  // 记录一个连接事件 数据较长时拆成多条
+int log_parse_level(const char * text);  // 解析级别名称 失败返回-1
+
+#endif
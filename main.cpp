@@ -8,9 +8,27 @@
 #include <fcntl.h>
 #include <sys/epoll.h>
 #include <signal.h>
+#include <libgen.h>
+#include <sys/prctl.h>
+#include <new>
 #include "locker.h"
 #include "pthreadpool.h"
 #include "http_conn.h"
+#include "config.h"
+#include "coro_server.h"
+#include "owner_server.h"
+#include "filecache.h"
+#include "log.h"
+#include "metrics.h"
+#include "trace.h"
+#include "master.h"
+#include "upgrade.h"
+#include "tls.h"
+#include "listener.h"
+#include "affinity.h"
+#include "hugemem.h"
+#include "busypoll.h"
+#include "warmup.h"
 
 /*
     代码整体逻辑
@@ -51,10 +69,33 @@
 #define MAX_FD 65535            // 最大文件描述符个数
 #define MAX_EVENT_NUMBER 10000  // 监听的最大事件数量
 
-extern void addfd(int epollfd, int fd, bool one_shot);
+extern void addfd(int epollfd, int fd, bool one_shot, uint64_t handle);
 extern void removefd(int epollfd, int fd);
 
 
+// 收到SIGUSR1时打印线程池的运行统计
+static volatile sig_atomic_t dump_stats = 0;
+void on_sigusr1(int sig) {
+    dump_stats = 1;
+}
+
+// 收到SIGQUIT时平滑停止：不再接受新连接，排空已有连接后退出
+void on_sigquit(int sig) {
+    drain_start();
+}
+// PGO插桩版本：各模式的事件循环都不会退出，收到SIGTERM时直接写出剖析数据
+// 其他版本保持默认行为；两种版本中main的控制流必须完全相同，否则剖析数据对不上
+#ifdef WEBSERVER_PGO_GENERATE
+extern "C" void __gcov_dump(void);
+void on_sigterm(int sig) {
+    __gcov_dump();
+    _exit(0);
+}
+#define SIGTERM_HANDLER on_sigterm
+#else
+#define SIGTERM_HANDLER SIG_DFL
+#endif
+
 // 添加信号捕捉
 void addsignal(int sig, void(handler)(int)) {
     struct sigaction sa;
@@ -65,93 +106,190 @@ void addsignal(int sig, void(handler)(int)) {
 }
 
 
-int main(int argc, char* argv[]) {
-    // argc为是命令行总的参数个数  
-    // argv[]是argc个参数，第0个参数是程序的全名，之后是用户输入的参数
+static void close_all(const int * fds, int count) {
+    for(int i = 0; i < count; i++) {
+        close(fds[i]);
+    }
+}
 
-    if(argc <= 1) {
-        printf("按照如下格式运行： %s port_number\n", basename(argv[0]));
-        exit(-1);
+static bool is_listen_socket(int fd, const int * listenfds, int listen_count) {
+    for(int i = 0; i < listen_count; i++) {
+        if(listenfds[i] == fd) {
+            return true;
+        }
     }
+    return false;
+}
 
-    // 获取端口号
-    int port = atoi(argv[1]);
-    addsignal(SIGPIPE, SIG_IGN);
+// 连接表 MAX_FD个槽位连续存放在大页中，进程的CPU都在一个NUMA节点上时放在该节点，否则在节点间交错
+static http_conn * alloc_users() {
+    void * addr = hugemem_alloc(sizeof(http_conn) * MAX_FD, hugemem_home_node());
+    if(!addr) {
+        return NULL;
+    }
+    http_conn * users = (http_conn *)addr;
+    for(int i = 0; i < MAX_FD; i++) {
+        new(users + i) http_conn();
+    }
+    hugemem_report("users", users, sizeof(http_conn) * MAX_FD);
+    return users;
+}
+
+static void free_users(http_conn * users) {
+    for(int i = 0; i < MAX_FD; i++) {
+        users[i].~http_conn();
+    }
+    hugemem_free(users, sizeof(http_conn) * MAX_FD);
+}
+
+// 在监听socket(每个监听地址一个)上运行所选模式的事件循环 直到出错
+static int serve(const int * listenfds, int listen_count) {
+    http_conn* users = alloc_users();
+    if(!users) {
+        return 1;
+    }
+    int ret = 0;
+    // 没有指定线程数时按可用的CPU数：事件循环每个核一个，线程池从每核一个开始、最多每核4个
+    int cpus = affinity_cpus();
+    int threads = g_config.thread_number > 0 ? g_config.thread_number : cpus;
+    int max_threads = g_config.max_threads > 0 ? g_config.max_threads : (cpus * 4 > 8 ? cpus * 4 : 8);
+
+    if(g_config.mode == MODE_CORO) {
+        // 协程模式 每个线程独立调度自己的连接 不使用线程池
+        ret = run_coro_server(listenfds, listen_count, users, MAX_FD, threads);
+        close_all(listenfds, listen_count);
+        free_users(users);
+        return ret == 0 ? 0 : 1;
+    }
+
+    if(g_config.mode == MODE_OWNER) {
+        // 连接归属模式 每个线程独立处理自己的连接 不使用线程池
+        ret = run_owner_server(listenfds, listen_count, users, MAX_FD, threads);
+        close_all(listenfds, listen_count);
+        free_users(users);
+        return ret == 0 ? 0 : 1;
+    }
 
     threadpool<http_conn> * pool = NULL;
     try{
-        pool = new threadpool<http_conn>;
+        pool = new threadpool<http_conn>(threads);
     } catch(...) {
+        free_users(users);
         return 1;
     }
-
-    http_conn* users = new http_conn[MAX_FD];
-    // 设置监听套接字
-    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
-    int ret = 0;
-    struct sockaddr_in address;
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(port);
-
-    // 设置端口复用
-    int reuse = 1;  // 1 表示复用 0 表示不复用
-    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
-    // 绑定
-    ret = bind(listenfd, (struct sockaddr*)&address, sizeof(address));
-    // 设置监听
-    ret = listen(listenfd, 5); 
+    // 固定线程数时只按目标排队时间调整队列上限
+    pool->autotune(threads, max_threads, g_config.queue_target_ms * 1000L);
+    pool->set_weight(LANE_CHEAP, g_config.lane_weights[0]);
+    pool->set_weight(LANE_EXPENSIVE, g_config.lane_weights[1]);
+    // 工作线程已经创建 只有Reactor线程绑定到一个核上
+    affinity_pin_thread(pthread_self(), 0);
     
     // 创建epoll对象和事件数组 
     epoll_event events[MAX_EVENT_NUMBER];
     int epollfd = epoll_create(5);
-    // 将监听套接字添加到epoll对象中
-    addfd(epollfd, listenfd, false);
+    busy_poll_epoll(epollfd);
+    spin_policy spin;
+    // 将监听套接字添加到epoll对象中 TCP和Unix域的连接在同一个循环中处理
+    for(int i = 0; i < listen_count; i++) {
+        addfd(epollfd, listenfds[i], false, listenfds[i]);
+    }
+    bool listening = true;
     http_conn::m_epollfd = epollfd; // 所有的socket上的事件都被注册到同一个epollfd中
 
     while(true) {
-        // 返回发生变化的文件描述符个数 并设置为阻塞模式
-        int number = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, -1);
+        // 返回发生变化的文件描述符个数 定时返回以检查是否需要排空
+        int number = busy_epoll_wait(spin, epollfd, events, MAX_EVENT_NUMBER, DRAIN_CHECK_MS);
         // 当捕捉到信号后，进行处理，产生中断。当中断返回时，则产生EINTR错误
         if((number < 0) && (errno != EINTR)) {
-            printf("epoll failure\n");
+            LOG_ERROR("epoll failure");
             break;
         }
+        uint64_t wake = g_trace_enabled ? trace_now() : 0;
+        if(draining()) {
+            // 不再accept 监听socket已由新进程持有或不再需要
+            if(listening) {
+                for(int i = 0; i < listen_count; i++) {
+                    removefd(epollfd, listenfds[i]);
+                }
+                listening = false;
+            }
+            if(drain_finished()) {
+                break;
+            }
+        }
+
+        if(dump_stats) {
+            dump_stats = 0;
+            for(int lane = 0; lane < LANE_NUMBER; lane++) {
+                threadpool_stats st;
+                pool->stats(&st, lane);
+                LOG_INFO("threadpool lane %d: weight %d depth %d enqueued %lld rejected %lld served %lld shed %lld lifo %d "
+                       "sojourn(us) p50 %ld p90 %ld p99 %ld max %ld threads %d queue limit %d",
+                       lane, st.weight, st.depth, st.enqueued, st.rejected, st.served, st.shed, st.lifo,
+                       st.sojourn_p50, st.sojourn_p90, st.sojourn_p99, st.sojourn_max, st.threads, st.max_requests);
+            }
+        }
 
         for(int i = 0; i < number; i++) {
             // printf("i: %d, number: %d\n", i, number);
             // 依次处理发生变化的文件描述符
-            int sockfd = events[i].data.fd;
-            if(sockfd == listenfd) {  
+            uint64_t handle = events[i].data.u64;
+            int sockfd = http_conn::handle_fd(handle);
+            if(listening && is_listen_socket(sockfd, listenfds, listen_count)) {
                 // 如果为监听文件描述符，则表示有新的客户端连接进来
                 struct sockaddr_in client_address;
-                socklen_t client_addrlength = sizeof(client_address);
                 // 获取客户端的文件描述符及信息
-                int connfd = accept(listenfd, (struct sockaddr*)&client_address, &client_addrlength);
+                int connfd = listen_accept(sockfd, client_address, 0);
 
                 if(connfd < 0) {
-                    printf("errno is %d \n", errno);
+                    // 多个进程共享监听socket时 连接可能已被其他进程取走
+                    if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                        LOG_ERROR("accept errno is %d", errno);
+                    }
                     continue;
                 }
 
-                if(http_conn::m_user_count >= MAX_FD) {
+                if(connfd >= MAX_FD || http_conn::m_user_count >= MAX_FD) {
                     // 目前连接数满了
                     close(connfd);
                     continue;
                 }
 
+                if(!rate_limit_allow(client_address.sin_addr.s_addr, RL_CONNECTION)) {
+                    // 该IP或网段新建连接过快
+                    close(connfd);
+                    continue;
+                }
+
                 // 将新的客户的数据初始化，放至到数组中 
                 // 初始化函数中 设置了端口复用以及客户端文件描述符监听
                 users[connfd].init(connfd, client_address); 
 
+            } else if(!users[sockfd].current(handle)) {
+                // 连接已被工作线程关闭、文件描述符可能已属于新连接 丢弃旧连接遗留的事件
+                metrics_add(M_STALE_EVENTS);
+
             } else if(events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
                 // 对方异常断开或者发生错误时间
                 users[sockfd].close_conn();
 
             } else if(events[i].events & EPOLLIN) {
                 // 有数据写入 则将其一次性全部读出
+                users[sockfd].trace_dispatch(wake);
                 if(users[sockfd].read()) {
-                    pool->append(users + sockfd);   // 将其加入到线程池中
+                    // 请求速率限制在解析出完整请求后检查(process/process_inline) 不完整的请求头和TLS握手不计数
+                    if(g_config.mode == MODE_HYBRID && users[sockfd].cheap_request(users[sockfd].header_end())) {
+                        // 代价很小的请求直接在Reactor线程中应答 避免两次跨线程切换
+                        if(!users[sockfd].process_inline()) {
+                            users[sockfd].close_conn();
+                        }
+                    } else {
+                        users[sockfd].trace_point(TP_ENQUEUE);
+                        if(!pool->append(users + sockfd)) {   // 将其加入到线程池中
+                            metrics_add(M_QUEUE_REJECTS);
+                            users[sockfd].shed();   // 队列已满 直接返回503
+                        }
+                    }
                 } else {
                     users[sockfd].close_conn();
                 }
@@ -167,11 +305,262 @@ int main(int argc, char* argv[]) {
     }
     
 
-    close(epollfd);
-    close(listenfd);
-    delete [] users;
+    // 先等线程池处理完队列中的请求、工作线程全部退出 再释放连接
     delete pool;
-
+    close(epollfd);
+    if(listening) {
+        close_all(listenfds, listen_count);
+    }
+    free_users(users);
     return 0;
 }
 
+// 监听socket 由本进程创建或从旧进程接管，按g_config.listens的顺序分组连续存放：
+// 多进程SO_REUSEPORT模式下每个TCP端口每个worker一个，Unix域socket和其他情况下每个监听地址一个
+static int g_listenfds[HANDOFF_MAX_FDS];
+static int g_listen_count = 0;
+static int g_group_start[MAX_LISTEN + 1];   // 第i个监听地址的socket为g_listenfds[g_group_start[i], g_group_start[i+1])
+
+// 取出第index个worker使用的监听socket 每个监听地址一个(SO_REUSEPORT模式下为该地址的第index个)
+static int select_listen_sockets(int index, int * fds) {
+    for(int i = 0; i < g_config.listen_count; i++) {
+        int size = g_group_start[i + 1] - g_group_start[i];
+        fds[i] = g_listenfds[g_group_start[i] + (size > 1 ? index : 0)];
+    }
+    return g_config.listen_count;
+}
+
+// 按清单在后台预热文件缓存 与accept同时进行
+static bool start_warmup(bool persist) {
+    if(!g_config.warmup_manifest) {
+        return true;
+    }
+    size_t budget = (size_t)(g_config.warmup_budget_mb >= 0 ? g_config.warmup_budget_mb : g_config.cache_mb) << 20;
+    return warmup_start(g_config.warmup_manifest, g_config.doc_root, g_config.warmup_top, budget, persist);
+}
+
+// 多进程模式下worker进程的入口 使用master持有的监听socket
+static int worker_process(int index) {
+    int listenfds[MAX_LISTEN];
+    int listen_count = select_listen_sockets(index, listenfds);
+    for(int i = 0; i < g_listen_count; i++) {
+        if(!is_listen_socket(g_listenfds[i], listenfds, listen_count)) {
+            close(g_listenfds[i]);
+        }
+    }
+    // 每个worker写自己的追踪文件
+    if(g_config.trace_file) {
+        char trace_file[256];
+        snprintf(trace_file, sizeof(trace_file), "%s.%d", g_config.trace_file, index);
+        if(!trace_init(trace_file, g_config.trace_rate)) {
+            LOG_ERROR("trace init failure: %s", trace_file);
+            return 1;
+        }
+    }
+    // 每个worker有自己的文件缓存 都要预热，清单只由第0个保存
+    if(!start_warmup(index == 0)) {
+        return 1;
+    }
+    int ret = serve(listenfds, listen_count);
+    warmup_stop();
+    trace_shutdown();
+    return ret;
+}
+
+// 多进程模式下监听socket已交接给新进程 master通知worker排空
+static void master_handoff() {
+    kill(getpid(), SIGQUIT);
+}
+
+// 共享内存和交接socket默认名称中的监听地址：第一个TCP端口，只监听Unix域socket时为第一个socket的路径('/'换成'_')
+static void listener_name(char * buf, int size) {
+    if(g_config.port > 0) {
+        snprintf(buf, size, "%d", g_config.port);
+        return;
+    }
+    const char * path = g_config.listens[0].path;
+    snprintf(buf, size, "%s", path[0] == '/' ? path + 1 : path);
+    for(char * p = buf; *p; p++) {
+        if(*p == '/') {
+            *p = '_';
+        }
+    }
+}
+
+// 交接来的socket是否绑定在spec上
+static bool listen_matches(int fd, const listen_spec & spec) {
+    char path[108];
+    int port = listen_address(fd, path, sizeof(path));
+    if(spec.path) {
+        return port == 0 && strcmp(path, spec.path) == 0;
+    }
+    return port == spec.port;
+}
+
+// 为每个监听地址准备socket -I时先按地址接管旧进程的socket 不足的部分自己创建
+static bool open_listen_sockets(const char * handoff_path) {
+    int inherited[HANDOFF_MAX_FDS];
+    int count = 0;
+    if(g_config.inherit) {
+        count = handoff_receive(handoff_path, inherited, HANDOFF_MAX_FDS);
+        count = count > 0 ? count : 0;
+    }
+    for(int i = 0; i < g_config.listen_count; i++) {
+        const listen_spec & spec = g_config.listens[i];
+        int needed = !spec.path && g_config.workers > 0 && g_config.reuseport ? g_config.workers : 1;
+        g_group_start[i] = g_listen_count;
+        for(int j = 0; j < count && needed > 0; j++) {
+            if(inherited[j] >= 0 && listen_matches(inherited[j], spec)) {
+                g_listenfds[g_listen_count++] = inherited[j];
+                inherited[j] = -1;
+                needed--;
+            }
+        }
+        for(; needed > 0; needed--) {
+            int listenfd = spec.path ? listen_unix(spec.path, g_config.backlog)
+                                     : listen_tcp(spec.port, g_config.reuseport, g_config.backlog);
+            if(listenfd < 0) {
+                return false;
+            }
+            g_listenfds[g_listen_count++] = listenfd;
+        }
+    }
+    g_group_start[g_config.listen_count] = g_listen_count;
+
+    // 地址已从命令行去掉或worker数减少 多余socket上排队的连接会被重置
+    int surplus = 0;
+    for(int j = 0; j < count; j++) {
+        if(inherited[j] >= 0) {
+            close(inherited[j]);
+            surplus++;
+        }
+    }
+    if(surplus > 0) {
+        LOG_WARN("handoff: closing %d surplus listening sockets", surplus);
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    // argc为是命令行总的参数个数  
+    // argv[]是argc个参数，第0个参数是程序的全名，之后是用户输入的参数
+
+    if(!parse_config(argc, argv)) {
+        usage(argv[0]);
+        exit(-1);
+    }
+
+    if(g_config.inherit) {
+        // SIGHUP重新加载时exec的是/proc/self/exe 进程名会变成"exe"
+        prctl(PR_SET_NAME, basename(argv[0]));
+    }
+    // 在创建任何线程(包括日志线程)之前屏蔽由专门线程同步处理的信号
+    upgrade_block_signals();
+    if(g_config.workers > 0) {
+        master_block_signals();
+    }
+
+    if(!log_init(g_config.log_level, NULL, g_config.access_log, g_config.capture_file)) {
+        printf("log init failure\n");
+        exit(-1);
+    }
+
+    // 指标放在共享内存中 外部工具可以直接读取
+    char listener[108];
+    listener_name(listener, sizeof(listener));
+    char shm_name[128];
+    if(!g_config.metrics_shm) {
+        snprintf(shm_name, sizeof(shm_name), "/webserver.%s", listener);
+        g_config.metrics_shm = shm_name;
+    }
+    if(!metrics_init(strcmp(g_config.metrics_shm, "off") == 0 ? NULL : g_config.metrics_shm)) {
+        LOG_ERROR("metrics init failure");
+        exit(-1);
+    }
+
+    if(!affinity_init(g_config.affinity)) {
+        exit(-1);
+    }
+
+    if(!hugemem_init(g_config.huge_pages)) {
+        exit(-1);
+    }
+
+    if(!busy_poll_init(g_config.spin_us, g_config.spin_budget)) {
+        exit(-1);
+    }
+
+    // 限流表同样在fork之前映射 所有worker共用
+    if(!rate_limit_init(g_config.ip_limits, g_config.net_limits)) {
+        exit(-1);
+    }
+
+    // SSL_CTX在fork之前创建 所有worker共用会话缓存的配置和ticket密钥
+    if(g_config.tls_cert && !tls_init(g_config.tls_cert, g_config.tls_key)) {
+        exit(-1);
+    }
+
+    doc_root = g_config.doc_root;
+    g_file_cache.set_capacity((size_t)g_config.cache_mb << 20);
+    addsignal(SIGPIPE, SIG_IGN);
+    addsignal(SIGUSR1, on_sigusr1);
+    addsignal(SIGTERM, SIGTERM_HANDLER);
+    addsignal(SIGQUIT, on_sigquit);
+
+    char handoff_path[108];
+    if(!g_config.handoff_path) {
+        snprintf(handoff_path, sizeof(handoff_path), "/tmp/webserver.%.80s.sock", listener);
+        g_config.handoff_path = handoff_path;
+    }
+    // 全部监听socket要在一条消息中交接
+    int unix_count = 0;
+    for(int i = 0; i < g_config.listen_count; i++) {
+        unix_count += g_config.listens[i].path ? 1 : 0;
+    }
+    int tcp_count = g_config.listen_count - unix_count;
+    if(g_config.reuseport && g_config.workers * tcp_count + unix_count > HANDOFF_MAX_FDS) {
+        g_config.workers = (HANDOFF_MAX_FDS - unix_count) / tcp_count;
+        LOG_WARN("at most %d workers with -U and %d ports", g_config.workers, tcp_count);
+    }
+    // 多进程模式下监听socket也由master创建 worker退出或整体升级时socket不会关闭
+    if(!open_listen_sockets(g_config.handoff_path)) {
+        exit(-1);
+    }
+    for(int i = 0; i < g_listen_count; i++) {
+        busy_poll_socket(g_listenfds[i]);
+    }
+    if(affinity_enabled() && g_config.workers > 0 && g_config.reuseport) {
+        // 每个TCP端口一组 组中第i个socket属于第i个worker
+        for(int i = 0; i < g_config.listen_count; i++) {
+            int size = g_group_start[i + 1] - g_group_start[i];
+            if(!g_config.listens[i].path && !affinity_steer(g_listenfds[g_group_start[i]], size)) {
+                exit(-1);
+            }
+        }
+    }
+
+    int ret = 0;
+    if(g_config.workers > 0) {
+        // 多进程模式 master只负责管理worker
+        handoff_ready();
+        upgrade_start(g_config.handoff_path, g_listenfds, g_listen_count, argv, master_handoff);
+        ret = run_master(g_config.workers, worker_process, g_config.drain_seconds);
+    } else {
+        if(g_config.trace_file && !trace_init(g_config.trace_file, g_config.trace_rate)) {
+            LOG_ERROR("trace init failure: %s", g_config.trace_file);
+            exit(-1);
+        }
+        handoff_ready();
+        upgrade_start(g_config.handoff_path, g_listenfds, g_listen_count, argv, drain_start);
+        int listenfds[MAX_LISTEN];
+        int listen_count = select_listen_sockets(0, listenfds);
+        if(!start_warmup(true)) {
+            exit(-1);
+        }
+        ret = serve(listenfds, listen_count);
+        warmup_stop();
+        trace_shutdown();
+    }
+    log_shutdown();
+    return ret;
+}
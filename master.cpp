@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include "master.h"
+#include "log.h"
+#include "metrics.h"
+
+static const int MAX_WORKERS = 256;
+static const int STOP_TIMEOUT = 5;          // 通知worker退出后等待的秒数，超时后SIGKILL
+static const int MAX_RESPAWN_DELAY = 32;    // 连续快速退出时重启间隔的上限(秒)
+
+struct worker_slot {
+    pid_t pid;          // 0表示当前没有运行
+    time_t started;     // 最近一次启动的时刻
+    time_t respawn_at;  // pid为0时 计划重启的时刻
+    int failures;       // 连续快速退出的次数
+};
+
+// 第index个worker绑定到第index个(取模)可用的CPU上
+static void pin_cpu(int index) {
+    cpu_set_t allowed;
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return;
+    }
+    int count = CPU_COUNT(&allowed);
+    int target = index % count;
+    for(int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if(CPU_ISSET(cpu, &allowed) && target-- == 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            sched_setaffinity(0, sizeof(set), &set);
+            LOG_INFO("worker %d pid %d pinned to cpu %d", index, getpid(), cpu);
+            return;
+        }
+    }
+}
+
+static pid_t spawn(int index, worker_main worker, const sigset_t * old_mask) {
+    pid_t master = getpid();
+    pid_t pid = fork();
+    if(pid != 0) {
+        return pid;
+    }
+    // 子进程：恢复信号屏蔽，master退出时自动收到SIGTERM
+    sigprocmask(SIG_SETMASK, old_mask, NULL);
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if(getppid() != master) {
+        _exit(0);   // master在prctl之前已经退出
+    }
+    log_after_fork();
+    t_metrics_shard = NULL;     // 继承来的是master的分片 worker的线程需要各自领取
+    pin_cpu(index);
+    int ret = worker(index);
+    log_shutdown();
+    exit(ret);
+}
+
+static void report(worker_slot * slots, int worker_number) {
+    const metrics_region * region = metrics_get_region();
+    if(!region) {
+        return;
+    }
+    metrics_snapshot * snapshot = new metrics_snapshot;
+    for(int i = 0; i < worker_number; i++) {
+        if(slots[i].pid == 0) {
+            LOG_INFO("worker %d: not running, respawn in %lds", i, (long)(slots[i].respawn_at - time(NULL)));
+            continue;
+        }
+        metrics_collect(region, snapshot, slots[i].pid);
+        LOG_INFO("worker %d pid %d: up %lds accepts %llu requests %llu bytes %llu p99 %lluus",
+                 i, slots[i].pid, (long)(time(NULL) - slots[i].started),
+                 (unsigned long long)snapshot->counters[M_ACCEPTS], (unsigned long long)snapshot->counters[M_REQUESTS],
+                 (unsigned long long)snapshot->counters[M_BYTES_OUT],
+                 (unsigned long long)(metrics_percentile(*snapshot, H_LATENCY, 0.99) / 1000));
+    }
+    metrics_collect(region, snapshot);
+    LOG_INFO("all workers: accepts %llu requests %llu bytes %llu p99 %lluus",
+             (unsigned long long)snapshot->counters[M_ACCEPTS], (unsigned long long)snapshot->counters[M_REQUESTS],
+             (unsigned long long)snapshot->counters[M_BYTES_OUT],
+             (unsigned long long)(metrics_percentile(*snapshot, H_LATENCY, 0.99) / 1000));
+    delete snapshot;
+}
+
+// 回收所有已退出的worker 安排重启
+static void reap(worker_slot * slots, int worker_number, bool stopping) {
+    int status;
+    pid_t pid;
+    while((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        metrics_retire(pid);
+        for(int i = 0; i < worker_number; i++) {
+            if(slots[i].pid != pid) {
+                continue;
+            }
+            slots[i].pid = 0;
+            if(stopping) {
+                break;
+            }
+            time_t now = time(NULL);
+            if(now - slots[i].started < 1) {
+                slots[i].failures++;
+            } else {
+                slots[i].failures = 0;
+            }
+            int delay = slots[i].failures == 0 ? 0 : 1 << (slots[i].failures < 5 ? slots[i].failures : 5);
+            if(delay > MAX_RESPAWN_DELAY) {
+                delay = MAX_RESPAWN_DELAY;
+            }
+            slots[i].respawn_at = now + delay;
+            if(WIFSIGNALED(status)) {
+                LOG_WARN("worker %d pid %d killed by signal %d, respawn in %ds", i, pid, WTERMSIG(status), delay);
+            } else {
+                LOG_WARN("worker %d pid %d exited with status %d, respawn in %ds", i, pid, WEXITSTATUS(status), delay);
+            }
+            break;
+        }
+    }
+}
+
+// 向所有worker发送sig并等待它们退出 超过timeout秒仍未退出的SIGKILL
+static void stop_workers(worker_slot * slots, int worker_number, int sig, int timeout) {
+    for(int i = 0; i < worker_number; i++) {
+        if(slots[i].pid > 0) {
+            kill(slots[i].pid, sig);
+        }
+    }
+    time_t deadline = time(NULL) + timeout;
+    while(true) {
+        reap(slots, worker_number, true);
+        int running = 0;
+        for(int i = 0; i < worker_number; i++) {
+            running += slots[i].pid > 0;
+        }
+        if(running == 0) {
+            return;
+        }
+        if(time(NULL) >= deadline) {
+            for(int i = 0; i < worker_number; i++) {
+                if(slots[i].pid > 0) {
+                    LOG_WARN("worker %d pid %d did not exit, killing", i, slots[i].pid);
+                    kill(slots[i].pid, SIGKILL);
+                }
+            }
+            deadline = time(NULL) + STOP_TIMEOUT;
+        }
+        struct timespec ts = { 0, 10 * 1000000 };
+        nanosleep(&ts, NULL);
+    }
+}
+
+static void master_signals(sigset_t * set) {
+    sigemptyset(set);
+    sigaddset(set, SIGCHLD);
+    sigaddset(set, SIGTERM);
+    sigaddset(set, SIGINT);
+    sigaddset(set, SIGUSR1);
+    sigaddset(set, SIGQUIT);
+}
+
+void master_block_signals() {
+    sigset_t set;
+    master_signals(&set);
+    sigprocmask(SIG_BLOCK, &set, NULL);
+}
+
+int run_master(int worker_number, worker_main worker, int drain_timeout) {
+    if(worker_number > MAX_WORKERS) {
+        worker_number = MAX_WORKERS;
+    }
+    worker_slot slots[MAX_WORKERS];
+    memset(slots, 0, sizeof(slots));
+
+    // master用sigtimedwait同步处理信号 fork出的worker解除这些信号的屏蔽
+    sigset_t set, old_mask;
+    master_signals(&set);
+    sigprocmask(SIG_BLOCK, &set, &old_mask);
+    for(int sig = 1; sig < NSIG; sig++) {
+        if(sigismember(&set, sig) == 1) {
+            sigdelset(&old_mask, sig);
+        }
+    }
+
+    // master自己领取一个分片 用于累加已退出worker的指标
+    metrics_shard_local();
+    LOG_INFO("master pid %d starting %d workers", getpid(), worker_number);
+
+    while(true) {
+        time_t now = time(NULL);
+        for(int i = 0; i < worker_number; i++) {
+            if(slots[i].pid != 0 || slots[i].respawn_at > now) {
+                continue;
+            }
+            pid_t pid = spawn(i, worker, &old_mask);
+            if(pid < 0) {
+                LOG_ERROR("fork worker %d failure: %s", i, strerror(errno));
+                slots[i].respawn_at = now + 1;
+                continue;
+            }
+            slots[i].pid = pid;
+            slots[i].started = now;
+        }
+
+        struct timespec timeout = { 1, 0 };
+        siginfo_t info;
+        int sig = sigtimedwait(&set, &info, &timeout);
+        if(sig == SIGTERM || sig == SIGINT) {
+            LOG_INFO("master received signal %d, stopping workers", sig);
+            stop_workers(slots, worker_number, SIGTERM, STOP_TIMEOUT);
+            break;
+        } else if(sig == SIGQUIT) {
+            // 平滑停止或已交接给新进程 worker排空后退出 不再重启
+            LOG_INFO("master draining workers");
+            stop_workers(slots, worker_number, SIGQUIT, drain_timeout + STOP_TIMEOUT);
+            break;
+        } else if(sig == SIGUSR1) {
+            report(slots, worker_number);
+            for(int i = 0; i < worker_number; i++) {
+                if(slots[i].pid > 0) {
+                    kill(slots[i].pid, SIGUSR1);    // 各worker输出自己的线程池统计
+                }
+            }
+        }
+        // SIGCHLD或超时 都检查一次是否有worker退出
+        reap(slots, worker_number, false);
+    }
+
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    return 0;
+}
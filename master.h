@@ -0,0 +1,20 @@
+#ifndef MASTER_H
+#define MASTER_H
+
+/*
+    多进程模式(master/worker)
+    master不处理连接，只负责fork出worker_number个worker进程，并把第i个worker绑定到第i个可用的CPU上；
+    每个worker运行原有的事件循环和线程池，某个worker崩溃或卡死被杀掉不会影响其他worker上的连接。
+    master监视worker，异常退出的worker会被重新fork(连续快速退出时逐渐推迟重启)；
+    所有进程共享同一块指标内存，worker退出后master回收它的分片，SIGUSR1时master输出每个worker的统计。
+    master收到SIGTERM/SIGINT时通知所有worker退出并等待它们结束；
+    收到SIGQUIT(或监听socket交接给新进程)时向worker发送SIGQUIT让它们排空，最多等待drain_timeout秒。
+*/
+
+typedef int (*worker_main)(int index);  // worker进程的入口，参数为worker的编号，返回值作为进程的退出码
+
+// 在创建任何线程之前调用 屏蔽master同步处理的信号 避免它们被投递到其他线程
+void master_block_signals();
+int run_master(int worker_number, worker_main worker, int drain_timeout);
+
+#endif
@@ -0,0 +1,302 @@
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <vector>
+#include "metrics.h"
+#include "locker.h"
+
+thread_local metrics_shard * t_metrics_shard = NULL;
+
+static std::atomic<metrics_region *> g_region(NULL);
+static locker g_region_locker;
+static std::vector<metrics_shard *> g_parked;   // 已退出的线程交还的分片
+static thread_local bool t_metrics_owned = false;   // 当前线程是否独占自己的分片
+
+size_t metrics_region_size(uint32_t max_shards) {
+    return offsetof(metrics_region, shards) + max_shards * sizeof(metrics_shard);
+}
+
+// 创建指标区域 调用者需持有g_region_locker
+static bool create_region(const char * shm_name) {
+    size_t size = metrics_region_size(METRICS_MAX_SHARDS);
+    void * address;
+    if(shm_name) {
+        // 先删除再创建：升级时旧进程仍在使用原来的共享内存，截断它会使旧进程访问时收到SIGBUS
+        shm_unlink(shm_name);
+        int fd = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL, 0644);
+        if(fd < 0) {
+            return false;
+        }
+        if(ftruncate(fd, size) < 0) {
+            close(fd);
+            return false;
+        }
+        address = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+    } else {
+        address = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    }
+    if(address == MAP_FAILED) {
+        return false;
+    }
+
+    // 新映射的内存全为0 原子变量无需额外初始化
+    metrics_region * region = (metrics_region *)address;
+    region->version = METRICS_VERSION;
+    region->max_shards = METRICS_MAX_SHARDS;
+    region->start_time = time(NULL);
+    memcpy(region->magic, METRICS_MAGIC, 8);
+    g_region.store(region, std::memory_order_release);
+    return true;
+}
+
+bool metrics_init(const char * shm_name) {
+    g_region_locker.lock();
+    bool ret = g_region.load(std::memory_order_relaxed) ? true : create_region(shm_name);
+    g_region_locker.unlock();
+    return ret;
+}
+
+const metrics_region * metrics_get_region() {
+    return g_region.load(std::memory_order_acquire);
+}
+
+metrics_shard * metrics_local() {
+    metrics_region * region = g_region.load(std::memory_order_acquire);
+    if(!region) {
+        // 没有调用metrics_init时(如工具程序中)使用匿名内存
+        metrics_init(NULL);
+        region = g_region.load(std::memory_order_acquire);
+    }
+    int pid = getpid();
+
+    // 优先接着使用本进程已退出的线程交还的分片(fork之前父进程交还的分片不属于本进程)
+    g_region_locker.lock();
+    while(!g_parked.empty()) {
+        metrics_shard * shard = g_parked.back();
+        g_parked.pop_back();
+        if(shard->owner.load(std::memory_order_relaxed) == pid) {
+            g_region_locker.unlock();
+            t_metrics_shard = shard;
+            t_metrics_owned = true;
+            return t_metrics_shard;
+        }
+    }
+    g_region_locker.unlock();
+
+    int32_t free_owner = 0;
+    uint32_t index = region->shard_count.fetch_add(1, std::memory_order_relaxed);
+    if(index < region->max_shards && region->shards[index].owner.compare_exchange_strong(free_owner, pid)) {
+        t_metrics_shard = &region->shards[index];
+        t_metrics_owned = true;
+        return t_metrics_shard;
+    }
+    if(index >= region->max_shards) {
+        region->shard_count.store(region->max_shards, std::memory_order_relaxed);
+    }
+
+    // 没有新的分片时 领取已退出进程被回收的分片
+    for(uint32_t i = 0; i < region->max_shards; i++) {
+        free_owner = 0;
+        if(region->shards[i].owner.compare_exchange_strong(free_owner, pid, std::memory_order_acquire)) {
+            t_metrics_shard = &region->shards[i];
+            t_metrics_owned = true;
+            return t_metrics_shard;
+        }
+    }
+    // 分片用完后共用最后一个分片 此时计数只是近似值
+    t_metrics_shard = &region->shards[region->max_shards - 1];
+    return t_metrics_shard;
+}
+
+// 分片保留原有的计数 加锁保证下一个线程看到本线程全部的写入
+void metrics_thread_exit() {
+    if(!t_metrics_shard) {
+        return;
+    }
+    if(t_metrics_owned) {
+        g_region_locker.lock();
+        g_parked.push_back(t_metrics_shard);
+        g_region_locker.unlock();
+    }
+    t_metrics_shard = NULL;
+    t_metrics_owned = false;
+}
+
+// 读取并清零一个计数 累加到目标计数上(目标只有当前线程写入)
+static void fold(std::atomic<uint64_t> & dst, std::atomic<uint64_t> & src) {
+    uint64_t v = src.exchange(0, std::memory_order_relaxed);
+    dst.store(dst.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+}
+
+void metrics_retire(int owner) {
+    metrics_region * region = g_region.load(std::memory_order_acquire);
+    if(!region || owner == 0) {
+        return;
+    }
+    metrics_shard * mine = metrics_shard_local();
+    uint32_t n = region->shard_count.load(std::memory_order_acquire);
+    if(n > region->max_shards) {
+        n = region->max_shards;
+    }
+    for(uint32_t i = 0; i < n; i++) {
+        metrics_shard & shard = region->shards[i];
+        if(&shard == mine || shard.owner.load(std::memory_order_acquire) != owner) {
+            continue;
+        }
+        for(int c = 0; c < METRIC_COUNTER_NUMBER; c++) {
+            fold(mine->counters[c], shard.counters[c]);
+        }
+        for(int h = 0; h < METRIC_HISTOGRAM_NUMBER; h++) {
+            fold(mine->histograms[h].count, shard.histograms[h].count);
+            fold(mine->histograms[h].sum, shard.histograms[h].sum);
+            for(int b = 0; b < HIST_BUCKETS; b++) {
+                fold(mine->histograms[h].buckets[b], shard.histograms[h].buckets[b]);
+            }
+        }
+        shard.owner.store(0, std::memory_order_release);
+    }
+}
+
+void metrics_collect(const metrics_region * region, metrics_snapshot * out, int owner) {
+    memset(out, 0, sizeof(*out));
+    uint32_t n = region->shard_count.load(std::memory_order_acquire);
+    if(n > region->max_shards) {
+        n = region->max_shards;
+    }
+    for(uint32_t i = 0; i < n; i++) {
+        const metrics_shard & shard = region->shards[i];
+        if(owner != 0 && shard.owner.load(std::memory_order_relaxed) != owner) {
+            continue;
+        }
+        for(int c = 0; c < METRIC_COUNTER_NUMBER; c++) {
+            out->counters[c] += shard.counters[c].load(std::memory_order_relaxed);
+        }
+        for(int h = 0; h < METRIC_HISTOGRAM_NUMBER; h++) {
+            const metrics_histogram & hist = shard.histograms[h];
+            out->hist_count[h] += hist.count.load(std::memory_order_relaxed);
+            out->hist_sum[h] += hist.sum.load(std::memory_order_relaxed);
+            for(int b = 0; b < HIST_BUCKETS; b++) {
+                out->buckets[h][b] += hist.buckets[b].load(std::memory_order_relaxed);
+            }
+        }
+    }
+}
+
+uint64_t metrics_bucket_upper(int bucket) {
+    if(bucket < HIST_SUB) {
+        return bucket + 1;
+    }
+    int msb = bucket / HIST_SUB - 1 + HIST_SUB_BITS;
+    int sub = bucket % HIST_SUB;
+    uint64_t width = 1ULL << (msb - HIST_SUB_BITS);
+    return (HIST_SUB + sub) * width + width;
+}
+
+uint64_t metrics_percentile(const metrics_snapshot & s, int hist, double p) {
+    uint64_t total = 0;
+    for(int b = 0; b < HIST_BUCKETS; b++) {
+        total += s.buckets[hist][b];
+    }
+    if(total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(total * p);
+    uint64_t seen = 0;
+    for(int b = 0; b < HIST_BUCKETS; b++) {
+        seen += s.buckets[hist][b];
+        if(seen > rank) {
+            return metrics_bucket_upper(b);
+        }
+    }
+    return metrics_bucket_upper(HIST_BUCKETS - 1);
+}
+
+static const char * phase_names[METRIC_HISTOGRAM_NUMBER] = { "total", "queue", "parse", "handle", "write" };
+static const double le_seconds[] = { 0.000001, 0.000005, 0.00001, 0.000025, 0.00005, 0.0001, 0.00025, 0.0005,
+                                     0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10 };
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+// 向buf中追加格式化内容 超出容量时截断
+#define APPEND(...) do { if(len < size) { len += snprintf(buf + len, size - len, __VA_ARGS__); } } while(0)
+
+int metrics_render(const metrics_region * region, char * buf, int size) {
+    metrics_snapshot * s = new metrics_snapshot;
+    metrics_collect(region, s);
+    const uint64_t * c = s->counters;
+    int len = 0;
+
+    APPEND("# TYPE webserver_connections_accepted_total counter\nwebserver_connections_accepted_total %llu\n", (unsigned long long)c[M_ACCEPTS]);
+    APPEND("# TYPE webserver_connections_closed_total counter\nwebserver_connections_closed_total %llu\n", (unsigned long long)c[M_CLOSES]);
+    APPEND("# TYPE webserver_connections_open gauge\nwebserver_connections_open %lld\n", (long long)(c[M_ACCEPTS] - c[M_CLOSES]));
+
+    static const struct { int counter; const char * status; } statuses[] = {
+        { M_STATUS_200, "200" }, { M_STATUS_400, "400" }, { M_STATUS_403, "403" }, { M_STATUS_404, "404" }, { M_STATUS_429, "429" },
+        { M_STATUS_500, "500" }, { M_STATUS_503, "503" }, { M_STATUS_OTHER, "other" },
+    };
+    APPEND("# TYPE webserver_requests_total counter\n");
+    for(size_t i = 0; i < sizeof(statuses) / sizeof(statuses[0]); i++) {
+        APPEND("webserver_requests_total{status=\"%s\"} %llu\n", statuses[i].status, (unsigned long long)c[statuses[i].counter]);
+    }
+    APPEND("# TYPE webserver_bytes_sent_total counter\nwebserver_bytes_sent_total %llu\n", (unsigned long long)c[M_BYTES_OUT]);
+    APPEND("# TYPE webserver_queue_depth gauge\nwebserver_queue_depth %lld\n", (long long)(c[M_QUEUE_IN] - c[M_QUEUE_OUT]));
+    APPEND("# TYPE webserver_threadpool_threads gauge\nwebserver_threadpool_threads %lld\n",
+           (long long)(c[M_POOL_THREADS_STARTED] - c[M_POOL_THREADS_EXITED]));
+    APPEND("# TYPE webserver_queue_rejected_total counter\nwebserver_queue_rejected_total %llu\n", (unsigned long long)c[M_QUEUE_REJECTS]);
+    APPEND("# TYPE webserver_requests_shed_total counter\nwebserver_requests_shed_total %llu\n", (unsigned long long)c[M_SHED]);
+    APPEND("# TYPE webserver_requests_inline_total counter\nwebserver_requests_inline_total %llu\n", (unsigned long long)c[M_INLINE]);
+    APPEND("# TYPE webserver_file_cache_hits_total counter\nwebserver_file_cache_hits_total %llu\n", (unsigned long long)c[M_CACHE_HITS]);
+    APPEND("# TYPE webserver_file_cache_misses_total counter\nwebserver_file_cache_misses_total %llu\n", (unsigned long long)c[M_CACHE_MISSES]);
+    APPEND("# TYPE webserver_tls_handshakes_total counter\n");
+    APPEND("webserver_tls_handshakes_total{result=\"full\"} %llu\n", (unsigned long long)(c[M_TLS_HANDSHAKES] - c[M_TLS_RESUMED]));
+    APPEND("webserver_tls_handshakes_total{result=\"resumed\"} %llu\n", (unsigned long long)c[M_TLS_RESUMED]);
+    APPEND("webserver_tls_handshakes_total{result=\"failed\"} %llu\n", (unsigned long long)c[M_TLS_FAILURES]);
+    APPEND("# TYPE webserver_tls_ktls_connections_total counter\nwebserver_tls_ktls_connections_total %llu\n", (unsigned long long)c[M_TLS_KTLS]);
+    APPEND("# TYPE webserver_http2_connections_total counter\nwebserver_http2_connections_total %llu\n", (unsigned long long)c[M_H2_CONNECTIONS]);
+    APPEND("# TYPE webserver_http2_streams_total counter\nwebserver_http2_streams_total %llu\n", (unsigned long long)c[M_H2_STREAMS]);
+    APPEND("# TYPE webserver_rate_limited_total counter\n");
+    APPEND("webserver_rate_limited_total{kind=\"connection\"} %llu\n", (unsigned long long)c[M_LIMITED_CONNECTIONS]);
+    APPEND("webserver_rate_limited_total{kind=\"request\"} %llu\n", (unsigned long long)c[M_LIMITED_REQUESTS]);
+    APPEND("# TYPE webserver_connection_locality_total counter\n");
+    APPEND("webserver_connection_locality_total{result=\"local\"} %llu\n", (unsigned long long)c[M_LOCALITY_LOCAL]);
+    APPEND("webserver_connection_locality_total{result=\"remote\"} %llu\n", (unsigned long long)c[M_LOCALITY_REMOTE]);
+    APPEND("# TYPE webserver_stale_events_total counter\n");
+    APPEND("webserver_stale_events_total %llu\n", (unsigned long long)c[M_STALE_EVENTS]);
+    APPEND("# TYPE webserver_busy_poll_total counter\n");
+    APPEND("webserver_busy_poll_total{result=\"hit\"} %llu\n", (unsigned long long)c[M_SPIN_HITS]);
+    APPEND("webserver_busy_poll_total{result=\"miss\"} %llu\n", (unsigned long long)c[M_SPIN_MISSES]);
+    APPEND("# TYPE webserver_busy_poll_seconds_total counter\n");
+    APPEND("webserver_busy_poll_seconds_total %.6f\n", c[M_SPIN_NS] / 1e9);
+    APPEND("# TYPE webserver_warmup_files_total counter\nwebserver_warmup_files_total %llu\n", (unsigned long long)c[M_WARMUP_FILES]);
+    APPEND("# TYPE webserver_warmup_bytes_total counter\nwebserver_warmup_bytes_total %llu\n", (unsigned long long)c[M_WARMUP_BYTES]);
+
+    APPEND("# TYPE webserver_request_duration_seconds histogram\n");
+    for(int h = 0; h < METRIC_HISTOGRAM_NUMBER; h++) {
+        int b = 0;
+        uint64_t cumulative = 0;
+        for(size_t i = 0; i < sizeof(le_seconds) / sizeof(le_seconds[0]); i++) {
+            uint64_t le_ns = (uint64_t)(le_seconds[i] * 1e9);
+            while(b < HIST_BUCKETS && metrics_bucket_upper(b) <= le_ns) {
+                cumulative += s->buckets[h][b++];
+            }
+            APPEND("webserver_request_duration_seconds_bucket{phase=\"%s\",le=\"%g\"} %llu\n", phase_names[h], le_seconds[i], (unsigned long long)cumulative);
+        }
+        APPEND("webserver_request_duration_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %llu\n", phase_names[h], (unsigned long long)s->hist_count[h]);
+        APPEND("webserver_request_duration_seconds_sum{phase=\"%s\"} %.9f\n", phase_names[h], s->hist_sum[h] / 1e9);
+        APPEND("webserver_request_duration_seconds_count{phase=\"%s\"} %llu\n", phase_names[h], (unsigned long long)s->hist_count[h]);
+    }
+
+    APPEND("# TYPE webserver_request_duration_quantile_seconds gauge\n");
+    for(int h = 0; h < METRIC_HISTOGRAM_NUMBER; h++) {
+        for(size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+            APPEND("webserver_request_duration_quantile_seconds{phase=\"%s\",quantile=\"%g\"} %.9f\n",
+                   phase_names[h], quantiles[i], metrics_percentile(*s, h, quantiles[i]) / 1e9);
+        }
+    }
+
+    delete s;
+    return len < size ? len : size - 1;
+}
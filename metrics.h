@@ -0,0 +1,162 @@
+#ifndef METRICS_H
+#define METRICS_H
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+
+/*
+    内置指标
+    每个线程第一次记录指标时领取一个分片(metrics_shard)，之后只有该线程写入自己的分片，
+    写入只是一次relaxed的读和写，不需要原子的读-改-写，也没有伪共享；读取时把所有分片相加。
+
+    所有分片都位于一块共享内存(shm_open)中，外部工具(tools/metrics_dump)直接映射这块内存读取，
+    服务器一侧不需要任何系统调用；同时 GET /metrics 以Prometheus文本格式输出同样的数据。
+
+    延迟直方图为HDR风格的对数-线性分桶：每个2的幂区间再分为8个子桶，相对误差不超过12.5%。
+
+    多进程模式下所有worker共享同一块指标内存，每个分片记录领取它的进程(owner)；
+    worker退出后master把它的分片并入自己的分片(总数保持单调递增)，清零后供新的worker重新领取。
+    线程退出时调用metrics_thread_exit()交还分片，本进程之后创建的线程接着使用它(计数不清零)，
+    线程池反复增减线程也不会耗尽分片。
+*/
+
+// 计数器
+enum METRIC_COUNTER {
+    M_ACCEPTS = 0,      // 接收的连接数
+    M_CLOSES,           // 关闭的连接数
+    M_REQUESTS,         // 完成的请求数
+    M_STATUS_200,       // 按状态码统计的请求数
+    M_STATUS_400,
+    M_STATUS_403,
+    M_STATUS_404,
+    M_STATUS_429,
+    M_STATUS_500,
+    M_STATUS_503,
+    M_STATUS_OTHER,
+    M_BYTES_OUT,        // 发送的字节数
+    M_QUEUE_IN,         // 进入线程池队列的请求数
+    M_QUEUE_OUT,        // 离开线程池队列的请求数(包括被丢弃的)
+    M_QUEUE_REJECTS,    // 线程池队列已满被拒绝的请求数
+    M_SHED,             // 过载时直接应答503的请求数
+    M_INLINE,           // 在Reactor线程中直接处理的请求数
+    M_CACHE_HITS,       // 文件缓存命中
+    M_CACHE_MISSES,     // 文件缓存未命中
+    M_TLS_HANDSHAKES,   // 完成的TLS握手数
+    M_TLS_RESUMED,      // 其中会话复用(session ticket或session id)的握手数
+    M_TLS_FAILURES,     // 失败的TLS握手数
+    M_TLS_KTLS,         // 握手后启用了内核TLS发送的连接数
+    M_H2_CONNECTIONS,   // 使用HTTP/2的连接数
+    M_H2_STREAMS,       // HTTP/2的流(请求)数
+    M_LIMITED_CONNECTIONS,  // 超过限流被关闭的连接数
+    M_LIMITED_REQUESTS,     // 超过限流应答429的请求数
+    M_LOCALITY_LOCAL,   // accept时所在CPU与处理该连接数据包的CPU相同的TCP连接数
+    M_LOCALITY_REMOTE,  // 不同的TCP连接数
+    M_STALE_EVENTS,     // 句柄代数不符被丢弃的epoll事件数(连接已关闭或槽位已被新连接复用)
+    M_SPIN_HITS,        // 忙轮询自旋期间等到了事件的次数
+    M_SPIN_MISSES,      // 自旋窗口用完仍没有事件、转为阻塞的次数
+    M_SPIN_NS,          // 自旋的总时间(纳秒)
+    M_WARMUP_FILES,     // 启动时按清单预热的文件数
+    M_WARMUP_BYTES,     // 预热的字节数
+    M_POOL_THREADS_STARTED, // 线程池启动的工作线程数
+    M_POOL_THREADS_EXITED,  // 线程池退出的工作线程数
+    METRIC_COUNTER_NUMBER
+};
+
+// 延迟直方图(纳秒)
+enum METRIC_HISTOGRAM {
+    H_LATENCY = 0,      // 端到端：读到请求的第一个字节到响应写完
+    H_QUEUE,            // 在线程池队列中的排队时间
+    H_PARSE,            // process_read 解析请求
+    H_HANDLE,           // do_request 查找和映射文件
+    H_WRITE,            // 生成应答到响应写完
+    METRIC_HISTOGRAM_NUMBER
+};
+
+static const int HIST_SUB_BITS = 3;
+static const int HIST_SUB = 1 << HIST_SUB_BITS;                 // 每个2的幂区间的子桶数
+static const int HIST_BUCKETS = (40 - HIST_SUB_BITS + 1) * HIST_SUB;    // 最大约2^40纳秒(18分钟)
+
+struct metrics_histogram {
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> buckets[HIST_BUCKETS];
+};
+
+struct alignas(64) metrics_shard {
+    std::atomic<int32_t> owner;         // 领取该分片的进程ID，0表示空闲
+    std::atomic<uint64_t> counters[METRIC_COUNTER_NUMBER];
+    metrics_histogram histograms[METRIC_HISTOGRAM_NUMBER];
+};
+
+#define METRICS_MAGIC "WSMETRIC"
+#define METRICS_VERSION 10
+
+// 共享内存的布局：头部之后是max_shards个分片
+struct metrics_region {
+    char magic[8];
+    uint32_t version;
+    uint32_t max_shards;
+    std::atomic<uint32_t> shard_count;  // 曾经被领取过的分片数(之后可能被回收)
+    uint64_t start_time;                // 服务器启动时刻(UNIX时间，秒)
+    metrics_shard shards[1];
+};
+
+static const int METRICS_MAX_SHARDS = 256;
+
+// 汇总后的快照
+struct metrics_snapshot {
+    uint64_t counters[METRIC_COUNTER_NUMBER];
+    uint64_t hist_count[METRIC_HISTOGRAM_NUMBER];
+    uint64_t hist_sum[METRIC_HISTOGRAM_NUMBER];
+    uint64_t buckets[METRIC_HISTOGRAM_NUMBER][HIST_BUCKETS];
+};
+
+bool metrics_init(const char * shm_name);      // 创建指标区域，shm_name为NULL时使用匿名内存
+size_t metrics_region_size(uint32_t max_shards);
+metrics_shard * metrics_local();                // 当前线程的分片
+void metrics_thread_exit();                     // 线程退出前交还分片 供本进程的新线程继续使用
+void metrics_collect(const metrics_region * region, metrics_snapshot * out, int owner = 0);  // owner不为0时只汇总该进程的分片
+void metrics_retire(int owner);                 // 把已退出进程的分片并入当前线程的分片并回收
+int metrics_render(const metrics_region * region, char * buf, int size);   // 输出Prometheus文本 返回长度
+const metrics_region * metrics_get_region();
+uint64_t metrics_percentile(const metrics_snapshot & s, int hist, double p);
+uint64_t metrics_bucket_upper(int bucket);      // 桶的上界(不含)
+
+extern thread_local metrics_shard * t_metrics_shard;
+
+static inline uint64_t metrics_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline metrics_shard * metrics_shard_local() {
+    metrics_shard * shard = t_metrics_shard;
+    return shard ? shard : metrics_local();
+}
+
+// 只有本线程写自己的分片 不需要原子的读-改-写
+static inline void metrics_add(int counter, uint64_t n = 1) {
+    std::atomic<uint64_t> & c = metrics_shard_local()->counters[counter];
+    c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+static inline int metrics_bucket(uint64_t v) {
+    if(v < (uint64_t)HIST_SUB) {
+        return v;
+    }
+    int msb = 63 - __builtin_clzll(v);
+    int sub = (v >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1);
+    int bucket = (msb - HIST_SUB_BITS + 1) * HIST_SUB + sub;
+    return bucket < HIST_BUCKETS ? bucket : HIST_BUCKETS - 1;
+}
+
+static inline void metrics_record(int hist, uint64_t ns) {
+    metrics_histogram & h = metrics_shard_local()->histograms[hist];
+    std::atomic<uint64_t> & b = h.buckets[metrics_bucket(ns)];
+    b.store(b.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    h.count.store(h.count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    h.sum.store(h.sum.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+}
+
+#endif
@@ -0,0 +1,252 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include "owner_server.h"
+#include "log.h"
+#include "upgrade.h"
+#include "listener.h"
+#include "affinity.h"
+#include "busypoll.h"
+
+#define MAX_EVENT_NUMBER 1024   // 每次epoll_wait最多返回的事件数
+
+// 连接在事件循环中的状态 以文件描述符为下标
+struct owner_state {
+    bool writing;       // 响应尚未写完，正在等待EPOLLOUT
+    bool read_pending;  // 写响应期间收到了EPOLLIN边沿，写完后需要继续读取
+};
+
+// 每个事件循环线程的参数
+struct owner_thread_arg {
+    const int * listenfds;
+    int listen_count;
+    http_conn * users;
+    owner_state * states;
+    int max_fd;
+};
+
+static void on_readable(http_conn * conn, owner_state * state);
+
+// HTTP/2连接上的任何事件都读取新的帧并继续写出 连接注册时已包含EPOLLIN和EPOLLOUT
+static void on_h2(http_conn * conn) {
+    if(conn->h2_process() != http_conn::IO_OK) {
+        conn->close_conn();
+    }
+}
+
+// 继续写出响应 写完后根据keep-alive决定关闭连接或者准备处理下一个请求
+static void flush(http_conn * conn, owner_state * state) {
+    http_conn::IO_STATUS status = conn->write_some();
+    if(status == http_conn::IO_AGAIN) {
+        // 连接注册时已经包含EPOLLOUT，等待下一次可写边沿即可
+        return;
+    }
+    state->writing = false;
+    if(status != http_conn::IO_OK || !conn->keep_alive()) {
+        conn->close_conn();
+        return;
+    }
+    conn->unmap();
+    conn->reset();
+    if(state->read_pending) {
+        // 边沿触发不会再次通知 写响应期间到达的数据需要现在读取
+        state->read_pending = false;
+        on_readable(conn, state);
+    }
+}
+
+// 读取数据并解析 得到完整请求后立即生成应答并尝试写回
+static void on_readable(http_conn * conn, owner_state * state) {
+    http_conn::IO_STATUS status = conn->read_some();
+    if(status == http_conn::IO_CLOSED || status == http_conn::IO_ERROR) {
+        conn->close_conn();
+        return;
+    }
+
+    http_conn::HTTP_CODE read_ret = conn->process_read();
+    if(read_ret == http_conn::NO_REQUEST) {
+        // 请求不完整 等待下一次可读边沿
+        return;
+    }
+    if(read_ret == http_conn::H2_SESSION) {
+        on_h2(conn);
+        return;
+    }
+    if(!conn->admit()) {
+        read_ret = http_conn::TOO_MANY_REQUESTS;    // 超过请求速率限制 应答429后关闭
+    }
+    if(!conn->process_write(read_ret)) {
+        conn->close_conn();
+        return;
+    }
+    state->writing = true;
+    flush(conn, state);
+}
+
+// 接收新连接直到EAGAIN 每个连接整个生命周期只注册一次
+static void accept_all(int epollfd, owner_thread_arg * arg, int listenfd) {
+    while(true) {
+        struct sockaddr_in client_address;
+        int connfd = listen_accept(listenfd, client_address, SOCK_NONBLOCK);
+        if(connfd < 0) {
+            if(errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                LOG_ERROR("accept errno is %d", errno);
+            }
+            return;
+        }
+
+        if(connfd >= arg->max_fd || http_conn::m_user_count >= arg->max_fd) {
+            // 目前连接数满了
+            close(connfd);
+            continue;
+        }
+
+        if(!rate_limit_allow(client_address.sin_addr.s_addr, RL_CONNECTION)) {
+            // 该IP或网段新建连接过快
+            close(connfd);
+            continue;
+        }
+
+        arg->states[connfd].writing = false;
+        arg->states[connfd].read_pending = false;
+        arg->users[connfd].attach(connfd, client_address, epollfd);
+
+        epoll_event event;
+        event.data.u64 = arg->users[connfd].handle();
+        event.events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP;
+        if(epoll_ctl(epollfd, EPOLL_CTL_ADD, connfd, &event) != 0) {
+            arg->users[connfd].close_conn();
+        }
+    }
+}
+
+static bool is_listen_socket(owner_thread_arg * arg, int fd) {
+    for(int i = 0; i < arg->listen_count; i++) {
+        if(arg->listenfds[i] == fd) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void * owner_worker(void * arg) {
+    owner_thread_arg * targ = (owner_thread_arg *)arg;
+    int epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if(epollfd < 0) {
+        LOG_ERROR("epoll_create failure");
+        return NULL;
+    }
+    busy_poll_epoll(epollfd);
+
+    // 多个线程共享同一个监听socket EPOLLEXCLUSIVE避免新连接到来时惊醒所有线程
+    for(int i = 0; i < targ->listen_count; i++) {
+        epoll_event event;
+        event.data.u64 = targ->listenfds[i];
+        event.events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE;
+        if(epoll_ctl(epollfd, EPOLL_CTL_ADD, targ->listenfds[i], &event) != 0) {
+            LOG_ERROR("add listenfd failure");
+            close(epollfd);
+            return NULL;
+        }
+    }
+
+    epoll_event events[MAX_EVENT_NUMBER];
+    spin_policy spin;
+    bool listening = true;
+    while(true) {
+        int number = busy_epoll_wait(spin, epollfd, events, MAX_EVENT_NUMBER, DRAIN_CHECK_MS);
+        if((number < 0) && (errno != EINTR)) {
+            LOG_ERROR("epoll failure");
+            break;
+        }
+        uint64_t wake = g_trace_enabled ? trace_now() : 0;
+        if(draining()) {
+            // 不再accept 连接全部关闭或超过期限后退出
+            if(listening) {
+                for(int j = 0; j < targ->listen_count; j++) {
+                    epoll_ctl(epollfd, EPOLL_CTL_DEL, targ->listenfds[j], NULL);
+                }
+                listening = false;
+            }
+            if(drain_finished()) {
+                break;
+            }
+        }
+
+        for(int i = 0; i < number; i++) {
+            uint64_t handle = events[i].data.u64;
+            int sockfd = http_conn::handle_fd(handle);
+            unsigned int ev = events[i].events;
+            if(listening && is_listen_socket(targ, sockfd)) {
+                accept_all(epollfd, targ, sockfd);
+                continue;
+            }
+
+            http_conn * conn = targ->users + sockfd;
+            if(!conn->current(handle)) {
+                // 同一批事件中连接已被关闭 文件描述符可能已被其他线程accept复用
+                metrics_add(M_STALE_EVENTS);
+                continue;
+            }
+            owner_state * state = targ->states + sockfd;
+            if(ev & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                // 对方异常断开或者发生错误
+                conn->close_conn();
+                continue;
+            }
+            if(conn->is_h2()) {
+                on_h2(conn);
+                continue;
+            }
+            if((ev & EPOLLOUT) && state->writing) {
+                flush(conn, state);
+                if(!conn->current(handle)) {
+                    continue;   // 写出错或不保持连接时flush已关闭连接 不再处理同一事件中的EPOLLIN
+                }
+            }
+            if(ev & EPOLLIN) {
+                if(state->writing) {
+                    state->read_pending = true;
+                } else {
+                    conn->trace_dispatch(wake);
+                    on_readable(conn, state);
+                }
+            }
+        }
+    }
+
+    close(epollfd);
+    return NULL;
+}
+
+int run_owner_server(const int * listenfds, int listen_count, http_conn * users, int max_fd, int thread_number) {
+    // 监听socket需要为非阻塞 每次可读时循环accept直到EAGAIN
+    for(int i = 0; i < listen_count; i++) {
+        fcntl(listenfds[i], F_SETFL, fcntl(listenfds[i], F_GETFL) | O_NONBLOCK);
+    }
+
+    owner_state * states = new owner_state[max_fd];
+    owner_thread_arg arg = { listenfds, listen_count, users, states, max_fd };
+    pthread_t * threads = new pthread_t[thread_number];
+    int created = 0;
+    for(; created < thread_number; created++) {
+        LOG_INFO("create the %d th event loop", created);
+        if(pthread_create(threads + created, NULL, owner_worker, &arg) != 0) {
+            break;
+        }
+        affinity_pin_thread(threads[created], created);
+    }
+    for(int i = 0; i < created; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    delete [] threads;
+    delete [] states;
+    return created == thread_number ? 0 : -1;
+}
@@ -0,0 +1,14 @@
+#ifndef OWNER_SERVER_H
+#define OWNER_SERVER_H
+#include "http_conn.h"
+
+/*
+    连接归属模式：启动thread_number个事件循环线程，每个线程拥有自己的epollfd，
+    各自从同一组监听socket(TCP和Unix域)上accept连接，连接此后只由接收它的线程读写。
+    连接只在接收时以 EPOLLIN | EPOLLOUT | EPOLLET 注册一次，解析完成后立即尝试写回，
+    只有写到EAGAIN时才等待下一次EPOLLOUT边沿，稳定状态下每个请求不再调用epoll_ctl。
+    函数阻塞直到所有事件循环线程退出，成功返回0
+*/
+int run_owner_server(const int * listenfds, int listen_count, http_conn * users, int max_fd, int thread_number);
+
+#endif
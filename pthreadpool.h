@@ -4,32 +4,159 @@
 #include <list>
 #include <exception>
 #include <cstdio>
+#include <climits>
+#include <time.h>
+#include <sched.h>
+#include <atomic>
+#include <sys/resource.h>
 #include "locker.h"
+#include "log.h"
+#include "metrics.h"
+#include "busypoll.h"
+#include "affinity.h"
+#include "trace.h"
 
-// 线程池类  定义为模板类可便于代码的复用，模板参数T是任务类
+/*
+    请求的优先级通道，由任务类的classify()在append()时给出
+    LANE_CHEAP      :   代价很小的请求，如缓存命中的小GET、不完整请求的重新注册
+    LANE_EXPENSIVE  :   可能较慢的请求，如冷文件、上传等
+*/
+enum LANE { LANE_CHEAP = 0, LANE_EXPENSIVE, LANE_NUMBER };
+
+// 线程池中一个通道的运行统计 供外部查询
+struct threadpool_stats {
+    int depth;              // 当前排队的请求数
+    int weight;             // 通道的权重
+    long long enqueued;     // 成功加入队列的请求总数
+    long long rejected;     // 队列已满被拒绝的请求总数
+    long long served;       // 已经交给工作线程处理的请求总数
+    long long shed;         // 过载时因排队过久被丢弃(返回503)的请求总数
+    bool lifo;              // 当前是否处于过载的LIFO模式
+    long sojourn_p50;       // 排队时间的分位数(微秒)，按2的幂分桶统计，为所在桶的上界
+    long sojourn_p90;
+    long sojourn_p99;
+    long sojourn_max;
+    int threads;            // 线程池当前的线程数(各通道相同)
+    int max_requests;       // 当前的队列上限(所有通道合计)
+};
+
+/*
+    线程池类  定义为模板类可便于代码的复用，模板参数T是任务类
+    T需要提供 process() 处理请求，shed() 在过载丢弃请求时快速应答(如返回503)，
+    以及 classify() 返回请求所属的通道(LANE)
+
+    每个通道一个请求队列，工作线程按权重做平滑加权轮询：所有通道都有积压时，
+    每个通道至少得到 weight / 总权重 的处理份额，昂贵请求的积压不会拖慢廉价请求。
+
+    队列管理参考CoDel：每个请求入队时记录时间，出队时计算排队时间(sojourn time)。
+    如果一个时间窗口(CODEL_INTERVAL)内队首请求的最小排队时间都超过目标值(CODEL_TARGET)，
+    说明队列是持续积压而不是短暂突发，此时切换为LIFO优先处理最新的请求(其客户端大概率还在等待)，
+    并丢弃排队已超过一个时间窗口的最老的请求；积压消除后恢复FIFO。每个通道独立判断。
+
+    autotune()之后由一个控制线程每TUNE_INTERVAL调整线程数和队列上限：
+        增加线程    :   平均排队时间超过TUNE_SOJOURN、工作线程的忙碌率超过TUNE_BUSY_HIGH，
+                        而进程占用的CPU还没有用满可用的核(线程阻塞在缺页、磁盘等I/O上)时，增加1/4(至少1个)，不超过上限
+        减少线程    :   忙碌率连续TUNE_SHRINK_DELAY个周期低于TUNE_BUSY_LOW时减少1/8(至少1个)，不低于下限；
+                        空闲的线程被唤醒后发现线程数多于目标就退出
+        队列上限    :   按Little定律取 目标排队时间 × 线程数 / 平均服务时间，超过上限的请求直接503，
+                        不再使用固定的数量；服务时间变长(冷文件)时上限随之变小
+    工作线程可以join：析构时处理完队列中剩余的请求后全部退出；-A时每个工作线程绑定到进程可用的一个核上。
+*/
 template<typename T>
 class threadpool {
 public:
+    static const long CODEL_TARGET = 5000;      // 目标排队时间(微秒)
+    static const long CODEL_INTERVAL = 100000;  // 时间窗口(微秒)
+    static const int MAX_THREADS = 1024;        // 线程数的上限
+    static const long TUNE_INTERVAL = 100000;   // 自动调整的周期(微秒)
+    static const long TUNE_SOJOURN = 1000;      // 平均排队时间超过它(微秒)才考虑增加线程
+    static const int TUNE_BUSY_HIGH = 80;       // 忙碌率(%)
+    static const int TUNE_BUSY_LOW = 30;
+    static const int TUNE_SHRINK_DELAY = 10;    // 持续空闲多少个周期后减少线程
+    static const int MIN_QUEUE = 64;            // 队列上限的下限
+    static const int MAX_QUEUE = 65536;
+
     // 构造函数 thread_number为线程池中线程的数量，m_max_requests为请求队列中最多允许的、等待处理的请求数量
     threadpool(int thread_number = 8, int max_requests = 10000);
-    ~threadpool();
+    ~threadpool();      // 处理完队列中的请求 等待所有线程退出
+    // 在[min_threads, max_threads]之间自动调整线程数，队列上限按排队不超过target_us推算
+    bool autotune(int min_threads, int max_threads, long target_us);
     bool append(T * request);
+    void set_weight(int lane, int weight);              // 设置通道的权重
+    void stats(threadpool_stats * out, int lane);       // 获取一个通道的运行统计
 
 private:
+    // 一个工作线程
+    enum { SLOT_FREE = 0, SLOT_RUNNING, SLOT_EXITED };
+    struct slot {
+        threadpool * pool;
+        int index;
+        pthread_t tid;
+        std::atomic<int> state;
+    };
+
+    // 队列中的请求及其入队时间
+    struct work {
+        T * request;
+        long enqueue_time;
+    };
+    static const int SOJOURN_BUCKETS = 32;  // 排队时间直方图 第i个桶统计[2^(i-1), 2^i)微秒
+
+    // 一个优先级通道
+    struct lane {
+        std::list< work > queue;    // 请求队列
+        int weight;                 // 权重
+        int current;                // 平滑加权轮询的当前值
+        bool lifo;                  // 是否处于过载的LIFO模式
+        long interval_end;          // 当前时间窗口的结束时间
+        long interval_min;          // 当前时间窗口内队首的最小排队时间
+        long long enqueued;
+        long long rejected;
+        long long served;
+        long long shed;
+        long sojourn_max;
+        long long sojourn_hist[SOJOURN_BUCKETS];
+    };
+
+    static long now_us() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+    }
+    int pick_lane();                                                // 选择下一个出队的通道 调用者需持有队列锁
+    static void record_sojourn(lane & l, long sojourn);             // 记录排队时间 调用者需持有队列锁
+    void update_state(lane & l, long head_sojourn, long now);       // 根据队首的排队时间更新过载状态 调用者需持有队列锁
+    static long percentile(const lane & l, long long total, double p);
+
     // 工作线程运行的函数，不断从工作队列中取出任务并执行
     static void * worker(void * arg);
     void run();
-    // 线程数量
-    int m_thread_number;
+    bool spawn();           // 启动一个工作线程 失败返回false
+    void shutdown();        // 停止并等待所有线程退出
+    static void * tuner(void * arg);
+    void tune();            // 控制线程 周期性地调整线程数和队列上限
 
-    // 线程池数组，大小为m_thread_number
-    pthread_t * m_threads;
+    slot m_slots[MAX_THREADS];
+    int m_running;          // 正在运行的工作线程数 由队列锁保护
+    int m_target;           // 目标线程数 多出的线程在空闲时退出
 
-    // 请求队列中最多允许的，等待处理的请求数量
+    // 请求队列中最多允许的，等待处理的请求数量(所有通道合计)
     int m_max_requests;
 
-    // 请求队列
-    std::list< T* > m_workqueue;
+    // 自动调整
+    int m_min_threads;
+    int m_max_threads;
+    long m_target_us;       // 排队时间的目标 用于推算队列上限
+    pthread_t m_tuner;
+    bool m_tuning;
+    long long m_sojourn_sum;            // 出队请求的排队时间之和(微秒) 由队列锁保护
+    std::atomic<long long> m_busy_us;   // 工作线程处理请求的时间之和
+
+    // 各通道的请求队列
+    lane m_lanes[LANE_NUMBER];
+
+    // 所有通道中排队的请求总数
+    int m_depth;
 
     // 保护请求队列的互斥锁
     locker m_queuelocker;
@@ -37,35 +164,44 @@ private:
     // 信号量用来判断是否有任务需要处理
     sem m_queuestat;
     
-    // 是否结束线程
+    // 是否结束线程 由队列锁保护
     bool m_stop;
 
 };
 
 template<typename T> 
 threadpool<T>::threadpool(int thread_number, int max_requests):
-    m_thread_number(thread_number), m_max_requests(max_requests),
-    m_stop(false), m_threads(NULL) {
-        if((thread_number <= 0) || (max_requests <= 0)) {
+    m_running(0), m_target(thread_number), m_max_requests(max_requests),
+    m_min_threads(thread_number), m_max_threads(thread_number), m_target_us(0), m_tuning(false),
+    m_sojourn_sum(0), m_busy_us(0), m_depth(0), m_stop(false) {
+        if((thread_number <= 0) || (thread_number > MAX_THREADS) || (max_requests <= 0)) {
             throw std::exception();
         }
-
-        m_threads = new pthread_t [m_thread_number];
-
-        if(!m_threads) {
-            throw std::exception(); // 线程池数组创建失败
+        for(int i = 0; i < LANE_NUMBER; i++) {
+            lane & l = m_lanes[i];
+            l.weight = (i == LANE_CHEAP) ? 4 : 1;   // 默认廉价请求至少得到80%的份额
+            l.current = 0;
+            l.lifo = false;
+            l.interval_end = 0;
+            l.interval_min = LONG_MAX;
+            l.enqueued = l.rejected = l.served = l.shed = 0;
+            l.sojourn_max = 0;
+            for(int j = 0; j < SOJOURN_BUCKETS; j++) {
+                l.sojourn_hist[j] = 0;
+            }
+        }
+        for(int i = 0; i < MAX_THREADS; i++) {
+            m_slots[i].pool = this;
+            m_slots[i].index = i;
+            m_slots[i].state.store(SLOT_FREE);
         }
 
-        // 创建thread_number 个线程，并将它们设置为脱离线程
+        // 创建thread_number 个线程
         for(int i = 0; i < thread_number; i++) {
-            printf("create the %d th thread\n", i);
-            if(pthread_create(m_threads + i, NULL, worker, this) != 0) {
-                // 线程创建失败 则删除线程池数组
-                delete [] m_threads;
-                throw std::exception();
-            }
-            if(pthread_detach(m_threads[i])) {
-                delete [] m_threads;
+            LOG_INFO("create the %d th thread", i);
+            if(!spawn()) {
+                // 线程创建失败 已创建的线程退出后再抛出异常
+                shutdown();
                 throw std::exception();
             }
         }
@@ -73,22 +209,124 @@ threadpool<T>::threadpool(int thread_number, int max_requests):
 
 template<typename T> 
 threadpool<T>::~threadpool() {
-    delete [] m_threads;
-    m_stop == true;
+    shutdown();
+}
+
+template<typename T>
+void threadpool<T>::shutdown() {
+    m_queuelocker.lock();
+    m_stop = true;
+    m_queuelocker.unlock();
+    if(m_tuning) {
+        pthread_join(m_tuner, NULL);    // 控制线程退出后线程数不再变化
+        m_tuning = false;
+    }
+    m_queuelocker.lock();
+    int running = m_running;
+    m_queuelocker.unlock();
+    // 每个线程多一次唤醒 队列空了之后各自退出
+    for(int i = 0; i < running; i++) {
+        m_queuestat.post();
+    }
+    for(int i = 0; i < MAX_THREADS; i++) {
+        if(m_slots[i].state.load() != SLOT_FREE) {
+            pthread_join(m_slots[i].tid, NULL);
+            m_slots[i].state.store(SLOT_FREE);
+        }
+    }
+}
+
+template<typename T>
+bool threadpool<T>::spawn() {
+    for(int i = 0; i < MAX_THREADS; i++) {
+        slot & t = m_slots[i];
+        int state = t.state.load(std::memory_order_acquire);
+        if(state == SLOT_RUNNING) {
+            continue;
+        }
+        if(state == SLOT_EXITED) {
+            pthread_join(t.tid, NULL);  // 回收之前退出的线程
+            t.state.store(SLOT_FREE);
+        }
+        m_queuelocker.lock();
+        m_running++;
+        m_queuelocker.unlock();
+        t.state.store(SLOT_RUNNING, std::memory_order_release);
+        if(pthread_create(&t.tid, NULL, worker, &t) != 0) {
+            t.state.store(SLOT_FREE);
+            m_queuelocker.lock();
+            m_running--;
+            m_queuelocker.unlock();
+            return false;
+        }
+        affinity_pin_thread(t.tid, 1 + i);  // 第0个核留给Reactor线程
+        metrics_add(M_POOL_THREADS_STARTED);
+        return true;
+    }
+    return false;
+}
+
+template<typename T>
+bool threadpool<T>::autotune(int min_threads, int max_threads, long target_us) {
+    if(m_tuning || min_threads <= 0 || max_threads < min_threads || max_threads > MAX_THREADS || target_us <= 0) {
+        return false;
+    }
+    m_queuelocker.lock();
+    m_min_threads = min_threads;
+    m_max_threads = max_threads;
+    m_target_us = target_us;
+    int target = m_target < min_threads ? min_threads : (m_target > max_threads ? max_threads : m_target);
+    int grow = target - m_target;
+    m_target = target;
+    m_queuelocker.unlock();
+    for(int i = 0; i < grow; i++) {
+        spawn();
+    }
+    for(int i = 0; i < -grow; i++) {
+        m_queuestat.post();
+    }
+    if(pthread_create(&m_tuner, NULL, tuner, this) != 0) {
+        return false;
+    }
+    m_tuning = true;
+    LOG_INFO("threadpool autotune: %d-%d threads, queue target %ld us", min_threads, max_threads, target_us);
+    return true;
+}
+
+template<typename T>
+void threadpool<T>::set_weight(int lane, int weight) {
+    if(lane < 0 || lane >= LANE_NUMBER || weight <= 0) {
+        return;
+    }
+    m_queuelocker.lock();
+    m_lanes[lane].weight = weight;
+    m_queuelocker.unlock();
 }
 
 template<typename T> 
 bool threadpool<T>::append(T * request) {
+    // 在加锁之前完成分类
+    int index = request->classify();
+    if(index < 0 || index >= LANE_NUMBER) {
+        index = LANE_EXPENSIVE;
+    }
+    lane & l = m_lanes[index];
+
     // 操作工作队列时一定要加锁，因为其被所有线程共享
     m_queuelocker.lock();
-    if(m_workqueue.size() > m_max_requests) {
+    if(m_depth > m_max_requests) {
         // 如果请求队列中的数量超过最大承受请求数量 则不再添加
+        l.rejected++;
         m_queuelocker.unlock();
         return false;
     }
     // 未达到最大请求数量则可以成功添加
-    m_workqueue.push_back(request);
+    work w = { request, now_us() };
+    l.queue.push_back(w);
+    l.enqueued++;
+    m_depth++;
     m_queuelocker.unlock();
+    metrics_add(M_QUEUE_IN);
     m_queuestat.post();
     return true;
 
@@ -96,31 +334,266 @@ bool threadpool<T>::append(T * request) {
 
 // 定义线程执行的函数
 template<typename T>
-void * threadpool<T>::worker(void* arg) {       // worker为静态函数通过将this指针作为参数传入，从而对其内部成员进行操作
-    threadpool* pool = (threadpool*) arg;
-    pool->run();
-    return pool;
+void * threadpool<T>::worker(void* arg) {       // worker为静态函数通过slot中的pool指针对其内部成员进行操作
+    slot * self = (slot *) arg;
+    self->pool->run();
+    metrics_add(M_POOL_THREADS_EXITED);
+    // 交还线程私有的指标分片和日志、追踪缓冲区 反复增减线程时由新线程继续使用
+    metrics_thread_exit();
+    log_thread_exit();
+    trace_thread_exit();
+    self->state.store(SLOT_EXITED, std::memory_order_release);
+    return NULL;
 }
 
 template<typename T> 
 void threadpool<T>::run() {
-    while(!m_stop) {
-        m_queuestat.wait();
+    spin_policy spin;   // -b时先自旋等待新请求 省去一次唤醒
+    while(true) {
+        if(!spin.spin([this]() { return m_queuestat.trywait(); })) {
+            m_queuestat.wait();
+        }
         m_queuelocker.lock();
-        if(m_workqueue.empty()) {
+        int index = pick_lane();
+        if(index < 0) {
+            // 没有请求可取：停止时或线程数多于目标时退出
+            bool quit = m_stop || m_running > m_target;
+            if(quit) {
+                m_running--;
+            }
             m_queuelocker.unlock();
+            if(quit) {
+                break;
+            }
             continue;
         }
-        T * request = m_workqueue.front();
-        m_workqueue.pop_front();
+        lane & l = m_lanes[index];
+        long now = now_us();
+        std::list< work > expired;     // 过载时被丢弃的请求 出锁后再应答
+        if(l.lifo) {
+            // 丢弃排队已超过一个时间窗口的最老的请求 其客户端很可能已经超时
+            while(l.queue.size() > 1 && now - l.queue.front().enqueue_time > CODEL_INTERVAL) {
+                expired.splice(expired.end(), l.queue, l.queue.begin());
+            }
+        }
+        update_state(l, now - l.queue.front().enqueue_time, now);
+
+        work w;
+        if(l.lifo) {
+            w = l.queue.back();
+            l.queue.pop_back();
+        } else {
+            w = l.queue.front();
+            l.queue.pop_front();
+        }
+        record_sojourn(l, now - w.enqueue_time);
+        m_sojourn_sum += now - w.enqueue_time;
+        l.served++;
+        l.shed += expired.size();
+        m_depth -= 1 + expired.size();
         m_queuelocker.unlock();
-        if(!request) {
+        metrics_add(M_QUEUE_OUT, 1 + expired.size());
+        metrics_record(H_QUEUE, (now - w.enqueue_time) * 1000);
+
+        for(typename std::list< work >::iterator it = expired.begin(); it != expired.end(); ++it) {
+            if(it->request) {
+                it->request->shed();
+            }
+        }
+        if(!w.request) {
             continue;
         }
-        request->process();
+        w.request->process();
+        m_busy_us.fetch_add(now_us() - now, std::memory_order_relaxed);
+    }
+}
+
+template<typename T>
+void * threadpool<T>::tuner(void * arg) {
+    ((threadpool *)arg)->tune();
+    return NULL;
+}
+
+template<typename T>
+void threadpool<T>::tune() {
+    cpu_set_t set;
+    int cpus = sched_getaffinity(0, sizeof(set), &set) == 0 ? CPU_COUNT(&set) : 1;
+    long long last_served = 0, last_sojourn = 0, last_busy = 0;
+    long last_cpu = 0, last_time = now_us();
+    double service_us = 0;      // 平均服务时间 空闲时保持上次的值
+    int idle = 0;
+    while(true) {
+        struct timespec ts = { 0, TUNE_INTERVAL * 1000 };
+        nanosleep(&ts, NULL);
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        long cpu = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000L + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+        long now = now_us();
+        long long busy = m_busy_us.load(std::memory_order_relaxed);
+
+        m_queuelocker.lock();
+        if(m_stop) {
+            m_queuelocker.unlock();
+            break;
+        }
+        long long served = 0;
+        long head = 0;      // 最老的请求已经排队的时间 工作线程都阻塞时出队的请求很少，需要看队首
+        for(int i = 0; i < LANE_NUMBER; i++) {
+            served += m_lanes[i].served;
+            if(!m_lanes[i].queue.empty() && now - m_lanes[i].queue.front().enqueue_time > head) {
+                head = now - m_lanes[i].queue.front().enqueue_time;
+            }
+        }
+        long long dserved = served - last_served;
+        long sojourn = dserved > 0 ? (long)((m_sojourn_sum - last_sojourn) / dserved) : 0;
+        int running = m_running;
+        int target = m_target;
+        long elapsed = now - last_time;
+        int busy_percent = (int)((busy - last_busy) * 100 / ((long long)elapsed * (running > 0 ? running : 1)));
+        bool cpu_free = (cpu - last_cpu) < (long)(elapsed * cpus * 0.9);
+        if(dserved > 0) {
+            double sample = (double)(busy - last_busy) / dserved;
+            service_us = service_us > 0 ? service_us * 0.8 + sample * 0.2 : sample;
+        }
+
+        // 线程数
+        int change = 0;
+        if((sojourn > TUNE_SOJOURN || head > TUNE_SOJOURN) && busy_percent >= TUNE_BUSY_HIGH && cpu_free && target < m_max_threads) {
+            change = target / 4 > 1 ? target / 4 : 1;
+            change = target + change > m_max_threads ? m_max_threads - target : change;
+            idle = 0;
+        } else if(busy_percent < TUNE_BUSY_LOW && target > m_min_threads) {
+            if(++idle >= TUNE_SHRINK_DELAY) {
+                change = -(target / 8 > 1 ? target / 8 : 1);
+                change = target + change < m_min_threads ? m_min_threads - target : change;
+                idle = 0;
+            }
+        } else {
+            idle = 0;
+        }
+        m_target = target + change;
+
+        // 队列上限 排队target_us可以处理完的请求数
+        if(service_us > 0) {
+            double limit = (double)m_target_us * m_target / service_us;
+            m_max_requests = limit < MIN_QUEUE ? MIN_QUEUE : (limit > MAX_QUEUE ? MAX_QUEUE : (int)limit);
+        }
+        int max_requests = m_max_requests;
+        last_served = served;
+        last_sojourn = m_sojourn_sum;
+        m_queuelocker.unlock();
 
+        if(change != 0) {
+            LOG_INFO("threadpool %d -> %d threads: sojourn %ld us, head %ld us, busy %d%%, cpu %s, service %.1f us, queue limit %d",
+                     target, target + change, sojourn, head, busy_percent, cpu_free ? "free" : "saturated", service_us, max_requests);
+        }
+        for(int i = 0; i < change; i++) {
+            if(!spawn()) {
+                m_queuelocker.lock();
+                m_target--;
+                m_queuelocker.unlock();
+            }
+        }
+        for(int i = 0; i < -change; i++) {
+            m_queuestat.post();     // 唤醒空闲的线程让它们退出
+        }
+        last_busy = busy;
+        last_cpu = cpu;
+        last_time = now;
     }
 }
 
+// 平滑加权轮询：每次为所有非空通道加上各自的权重，选当前值最大的通道，再减去非空通道的总权重
+template<typename T>
+int threadpool<T>::pick_lane() {
+    int best = -1;
+    int total = 0;
+    for(int i = 0; i < LANE_NUMBER; i++) {
+        lane & l = m_lanes[i];
+        if(l.queue.empty()) {
+            continue;
+        }
+        l.current += l.weight;
+        total += l.weight;
+        if(best < 0 || l.current > m_lanes[best].current) {
+            best = i;
+        }
+    }
+    if(best >= 0) {
+        m_lanes[best].current -= total;
+    }
+    return best;
+}
+
+template<typename T>
+void threadpool<T>::record_sojourn(lane & l, long sojourn) {
+    int bucket = 0;
+    while(bucket < SOJOURN_BUCKETS - 1 && (1L << bucket) <= sojourn) {
+        bucket++;
+    }
+    l.sojourn_hist[bucket]++;
+    if(sojourn > l.sojourn_max) {
+        l.sojourn_max = sojourn;
+    }
+}
+
+template<typename T>
+void threadpool<T>::update_state(lane & l, long head_sojourn, long now) {
+    if(head_sojourn < l.interval_min) {
+        l.interval_min = head_sojourn;
+    }
+    if(now < l.interval_end) {
+        return;
+    }
+    // 一个时间窗口结束 最小排队时间仍超过目标值则认为过载
+    bool lifo = l.interval_min > CODEL_TARGET;
+    if(lifo != l.lifo) {
+        LOG_WARN("threadpool lane %d %s LIFO mode, min sojourn %ld us", (int)(&l - m_lanes), lifo ? "enter" : "leave", l.interval_min);
+    }
+    l.lifo = lifo;
+    l.interval_min = LONG_MAX;
+    l.interval_end = now + CODEL_INTERVAL;
+}
+
+template<typename T>
+long threadpool<T>::percentile(const lane & l, long long total, double p) {
+    if(total == 0) {
+        return 0;
+    }
+    long long rank = (long long)(total * p);
+    long long seen = 0;
+    for(int i = 0; i < SOJOURN_BUCKETS; i++) {
+        seen += l.sojourn_hist[i];
+        if(seen > rank) {
+            return 1L << i;
+        }
+    }
+    return l.sojourn_max;
+}
+
+template<typename T>
+void threadpool<T>::stats(threadpool_stats * out, int index) {
+    m_queuelocker.lock();
+    const lane & l = m_lanes[index];
+    out->depth = l.queue.size();
+    out->weight = l.weight;
+    out->enqueued = l.enqueued;
+    out->rejected = l.rejected;
+    out->served = l.served;
+    out->shed = l.shed;
+    out->lifo = l.lifo;
+    long long total = 0;
+    for(int i = 0; i < SOJOURN_BUCKETS; i++) {
+        total += l.sojourn_hist[i];
+    }
+    out->sojourn_p50 = percentile(l, total, 0.50);
+    out->sojourn_p90 = percentile(l, total, 0.90);
+    out->sojourn_p99 = percentile(l, total, 0.99);
+    out->sojourn_max = l.sojourn_max;
+    out->threads = m_running;
+    out->max_requests = m_max_requests;
+    m_queuelocker.unlock();
+}
+
 
-#endif
\ No newline at end of file
+#endif
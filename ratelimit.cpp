@@ -0,0 +1,144 @@
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include "ratelimit.h"
+#include "metrics.h"
+#include "log.h"
+
+static const int TABLE_BITS = 16;
+static const uint32_t TABLE_SIZE = 1u << TABLE_BITS;   // 槽位数 超过后按近似LRU替换
+static const int PROBE_LIMIT = 8;                       // 线性探测的窗口
+
+enum RATE_LIMIT_LEVEL { RL_IP = 0, RL_NET, RL_LEVEL_NUMBER };
+
+// 一个IP或网段的令牌桶 两个槽位共用一个缓存行
+struct rl_slot {
+    std::atomic<uint64_t> key;      // (级别 + 1) << 32 | 地址，0表示空槽位
+    std::atomic<uint32_t> last;     // 最近一次访问的时刻(秒)，替换时选择最小的
+    uint32_t reserved;
+    std::atomic<uint64_t> tat[RL_KIND_NUMBER];  // 理论到达时间(纳秒) 比当前时刻超前越多，桶中的令牌越少
+};
+
+// 速率为每秒rate个、容量为rate个的令牌桶
+struct rl_limit {
+    uint64_t interval;      // 每个令牌的间隔(纳秒) 0表示不限制
+    uint64_t tolerance;     // 理论到达时间最多超前当前时刻的量 = interval * (容量 - 1)
+};
+
+static rl_slot * g_table = NULL;
+static rl_limit g_limits[RL_LEVEL_NUMBER][RL_KIND_NUMBER];
+
+bool rate_limit_init(const int ip_rates[RL_KIND_NUMBER], const int net_rates[RL_KIND_NUMBER]) {
+    bool enabled = false;
+    for(int kind = 0; kind < RL_KIND_NUMBER; kind++) {
+        const int rates[RL_LEVEL_NUMBER] = { ip_rates[kind], net_rates[kind] };
+        for(int level = 0; level < RL_LEVEL_NUMBER; level++) {
+            rl_limit & limit = g_limits[level][kind];
+            limit.interval = rates[level] > 0 ? 1000000000ULL / rates[level] : 0;
+            limit.tolerance = rates[level] > 0 ? limit.interval * (rates[level] - 1) : 0;
+            enabled = enabled || rates[level] > 0;
+        }
+    }
+    if(!enabled) {
+        return true;
+    }
+
+    // 多进程模式下由所有worker共享 匿名映射的内容为0即全部为空槽位
+    void * table = mmap(NULL, TABLE_SIZE * sizeof(rl_slot), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(table == MAP_FAILED) {
+        LOG_ERROR("rate limit table mmap failure");
+        return false;
+    }
+    g_table = (rl_slot *)table;
+    LOG_INFO("rate limit per ip: %d conn/s %d req/s, per /24: %d conn/s %d req/s",
+             ip_rates[RL_CONNECTION], ip_rates[RL_REQUEST], net_rates[RL_CONNECTION], net_rates[RL_REQUEST]);
+    return true;
+}
+
+bool rate_limit_enabled() {
+    return g_table != NULL;
+}
+
+static inline void touch(rl_slot * slot, uint32_t now) {
+    if(slot->last.load(std::memory_order_relaxed) != now) {
+        slot->last.store(now, std::memory_order_relaxed);
+    }
+}
+
+// 认领或替换槽位后 旧的桶状态不再有意义
+static inline rl_slot * claim(rl_slot * slot, uint32_t now) {
+    for(int kind = 0; kind < RL_KIND_NUMBER; kind++) {
+        slot->tat[kind].store(0, std::memory_order_relaxed);
+    }
+    slot->last.store(now, std::memory_order_relaxed);
+    return slot;
+}
+
+// 查找key的槽位 没有时认领空槽位或替换探测窗口中最久未访问的槽位；竞争失败时返回NULL(本次不限流)
+static rl_slot * lookup(uint64_t key, uint32_t now) {
+    uint32_t hash = (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> (64 - TABLE_BITS));
+    rl_slot * victim = NULL;
+    uint32_t oldest = UINT32_MAX;
+    for(int i = 0; i < PROBE_LIMIT; i++) {
+        rl_slot * slot = g_table + ((hash + i) & (TABLE_SIZE - 1));
+        uint64_t current = slot->key.load(std::memory_order_acquire);
+        if(current == key) {
+            touch(slot, now);
+            return slot;
+        }
+        if(current == 0) {
+            if(slot->key.compare_exchange_strong(current, key, std::memory_order_acq_rel)) {
+                return claim(slot, now);
+            }
+            if(current == key) {
+                return slot;    // 其他线程刚刚认领了同一个key
+            }
+        }
+        uint32_t last = slot->last.load(std::memory_order_relaxed);
+        if(last < oldest) {
+            oldest = last;
+            victim = slot;
+        }
+    }
+
+    uint64_t current = victim->key.load(std::memory_order_relaxed);
+    if(victim->key.compare_exchange_strong(current, key, std::memory_order_acq_rel)) {
+        return claim(victim, now);
+    }
+    return current == key ? victim : NULL;
+}
+
+// 从桶中取一个令牌：理论到达时间最多超前tolerance，取走后再推后interval
+static bool take(rl_slot * slot, RATE_LIMIT_KIND kind, const rl_limit & limit, uint64_t now) {
+    uint64_t tat = slot->tat[kind].load(std::memory_order_relaxed);
+    while(true) {
+        uint64_t base = tat > now ? tat : now;
+        if(base - now > limit.tolerance) {
+            return false;
+        }
+        if(slot->tat[kind].compare_exchange_weak(tat, base + limit.interval, std::memory_order_relaxed)) {
+            return true;
+        }
+    }
+}
+
+bool rate_limit_allow(uint32_t ip, RATE_LIMIT_KIND kind) {
+    if(!g_table || ip == INADDR_ANY) {
+        return true;
+    }
+    uint64_t now = metrics_now();
+    uint32_t seconds = now / 1000000000ULL;
+    const uint32_t addresses[RL_LEVEL_NUMBER] = { ip, ip & htonl(0xffffff00) };
+    for(int level = 0; level < RL_LEVEL_NUMBER; level++) {
+        const rl_limit & limit = g_limits[level][kind];
+        if(!limit.interval) {
+            continue;
+        }
+        // 先检查IP再检查网段 网段拒绝时IP已取走的令牌不归还
+        rl_slot * slot = lookup(((uint64_t)(level + 1) << 32) | addresses[level], seconds);
+        if(slot && !take(slot, kind, limit, now)) {
+            metrics_add(kind == RL_CONNECTION ? M_LIMITED_CONNECTIONS : M_LIMITED_REQUESTS);
+            return false;
+        }
+    }
+    return true;
+}
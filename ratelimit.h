@@ -0,0 +1,34 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdint.h>
+#include <atomic>
+
+/*
+    按客户端IP和所在/24网段的限流
+    每个IP(网段)每种限制一个令牌桶：速率为每秒rate个，容量为rate个(允许一秒的突发)。
+    令牌桶以"理论到达时间"(GCRA)表示：只需一个64位时间戳，放入令牌是惰性的，
+    检查 = 读取时间戳 + 一次CAS，不需要定时补充令牌的线程。
+
+    所有桶位于一张固定大小、开放寻址(线性探测)的哈希表中，不加锁：
+        空槽位用CAS认领；探测窗口内都被占用时，替换窗口中最久未访问的槽位(近似LRU)。
+    替换和并发认领之间的竞争只会让个别客户端的桶被重置或短暂共用，限流是近似的，不影响正确性。
+    表在fork之前用MAP_SHARED映射，多进程模式下所有worker共用同一组桶。
+
+    连接在accept之后检查，超过限制时直接关闭；请求在解析出完整的请求之后检查(不完整的请求头、TLS握手不计数)，
+    超过限制时应答429并关闭连接；HTTP/2按流检查。
+*/
+
+enum RATE_LIMIT_KIND {
+    RL_CONNECTION = 0,      // 新连接
+    RL_REQUEST,             // 请求
+    RL_KIND_NUMBER
+};
+
+// ip_rates/net_rates为每秒允许的连接数和请求数，0表示不限制
+bool rate_limit_init(const int ip_rates[RL_KIND_NUMBER], const int net_rates[RL_KIND_NUMBER]);
+bool rate_limit_enabled();
+// ip为网络字节序的IPv4地址 返回false表示超过限制；ip为0(本机的Unix域连接)时不限制
+bool rate_limit_allow(uint32_t ip, RATE_LIMIT_KIND kind);
+
+#endif
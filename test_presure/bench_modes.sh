@@ -0,0 +1,28 @@
+#!/bin/bash
+# 对比不同事件分发模式的吞吐量和延迟
+# 用法: ./bench_modes.sh <server_binary> <doc_root> [connections] [seconds] [port]
+# 每种模式各启动一次服务器，使用loadgen以keep-alive长连接压测 index.html
+# 额外的loadgen参数可以通过LOADGEN_ARGS传入，例如 LOADGEN_ARGS="-t 2" 或 LOADGEN_ARGS="-R 20000"
+# 服务器不支持流水线(只应答一次读到的第一个请求)，不要传入-p
+
+SERVER=${1:?server binary}
+DOC_ROOT=${2:?doc_root}
+CONNECTIONS=${3:-1000}
+SECONDS_=${4:-10}
+PORT=${5:-10000}
+DIR=$(dirname "$0")
+LOADGEN=${LOADGEN:-$DIR/loadgen}
+
+if [ ! -x "$LOADGEN" ]; then
+    g++ -std=c++20 -O2 -pthread "$DIR/loadgen.cpp" -o "$LOADGEN" || exit 1
+fi
+
+for mode in pool hybrid coro owner; do
+    "$SERVER" -m "$mode" -r "$DOC_ROOT" "$PORT" > /dev/null 2>&1 &
+    pid=$!
+    sleep 1
+    echo "===== mode: $mode ====="
+    "$LOADGEN" -c "$CONNECTIONS" -d "$SECONDS_" $LOADGEN_ARGS "127.0.0.1:$PORT" | tail -n +2
+    kill "$pid"
+    wait "$pid" 2>/dev/null
+done
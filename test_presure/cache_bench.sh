@@ -0,0 +1,51 @@
+#!/bin/bash
+# 用perf stat统计服务器处理每个请求的缓存未命中数，依次压测给出的多个服务器版本以便对比
+# (例如http_conn冷热拆分前后：git worktree检出旧版本另行编译)
+# 用法: ./cache_bench.sh <doc_root> <server_binary>...
+# 环境变量: MODE(默认owner) CONNECTIONS(默认4000) SECONDS_(默认10) PORT(默认10000)
+# 连接数较多时各连接的状态分散在大量缓存行中，热数据的布局对未命中数的影响更明显
+# 需要硬件性能计数器(多数虚拟机和容器中不可用)，以及root或 kernel.perf_event_paranoid <= 1
+
+DOC_ROOT=${1:?doc_root}
+shift
+[ $# -gt 0 ] || { echo "usage: $0 <doc_root> <server_binary>..."; exit 1; }
+MODE=${MODE:-owner}
+CONNECTIONS=${CONNECTIONS:-4000}
+SECONDS_=${SECONDS_:-10}
+PORT=${PORT:-10000}
+DIR=$(dirname "$0")
+LOADGEN=${LOADGEN:-$DIR/loadgen}
+EVENTS=cycles,instructions,cache-references,cache-misses,L1-dcache-load-misses,LLC-load-misses
+
+command -v perf > /dev/null || { echo "perf not found"; exit 1; }
+if [ ! -x "$LOADGEN" ]; then
+    g++ -std=c++20 -O2 -pthread "$DIR/loadgen.cpp" -o "$LOADGEN" || exit 1
+fi
+
+# 服务器已完成的请求数(各状态码之和)
+requests() {
+    curl -s "http://127.0.0.1:$PORT/metrics" | awk '/^webserver_requests_total/ { n += $2 } END { print n + 0 }'
+}
+
+for server in "$@"; do
+    "$server" -m "$MODE" -l warn -r "$DOC_ROOT" "$PORT" > /dev/null 2>&1 &
+    pid=$!
+    sleep 1
+    # 预热1秒后只统计中间的一段 避开建立连接和结束时的开销
+    "$LOADGEN" -c "$CONNECTIONS" -t 2 -d $((SECONDS_ + 2)) "127.0.0.1:$PORT" > /dev/null &
+    lg=$!
+    sleep 1
+    before=$(requests)
+    perf stat -x, -e "$EVENTS" -p "$pid" -o /tmp/cache_bench.$$ -- sleep "$SECONDS_" 2> /dev/null
+    after=$(requests)
+    wait "$lg"
+    kill "$pid"
+    wait "$pid" 2> /dev/null
+
+    echo "===== $server ($MODE, $CONNECTIONS connections) ====="
+    awk -F, -v n=$((after - before)) '
+        $3 ~ /^[a-zA-Z]/ && $1 ~ /^[0-9]+$/ { printf "%-24s %14d %10.2f /req\n", $3, $1, $1 / n }
+        $1 ~ /not supported|not counted/ { printf "%-24s %14s\n", $3, $1 }
+        END { printf "%-24s %14d\n", "requests", n }' /tmp/cache_bench.$$
+    rm -f /tmp/cache_bench.$$
+done
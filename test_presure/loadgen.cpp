@@ -0,0 +1,760 @@
+/*
+    基于epoll的多线程HTTP压测工具 用于代替webbench
+    webbench每个客户端fork一个进程、使用HTTP/1.0短连接、只统计每分钟页面数，无法测量延迟，
+    并且在几千个客户端时自身就成为瓶颈。本工具：
+        每个线程一个epoll循环，负责一部分连接，连接保持keep-alive，可以设置流水线深度
+        闭环模式：每个连接始终保持pipeline个未完成请求，收到应答后立即发送下一个
+        开环模式(-R)：按固定总速率发送，每个请求有预定的发送时刻，延迟从预定时刻开始计算，
+            服务器变慢导致请求积压时，积压的等待时间也计入延迟(coordinated omission校正)，
+            同时单独统计从实际发送开始计算的服务时间
+        URL按权重混合(-u 路径[:权重]，可重复；或 -f 文件，每行"路径 [权重]")
+        延迟记录在HDR(对数线性)直方图中，相对误差小于1%，输出文本和JSON格式的分位数
+        最早的未完成请求超过应答超时(-T，默认2000毫秒)时，该连接上所有未完成的请求计为超时并重新连接；
+            到达测试时长后不再发送，继续等待已发出请求的应答，最多再等一个超时，仍未应答的也计为超时
+    注意：本项目的服务器不支持流水线，一次读到的多个请求只应答第一个，压测它时不要使用-p(否则请求会超时)
+
+    用法: loadgen [-c connections] [-t threads] [-d seconds] [-p pipeline] [-R rate] [-T timeout_ms] [-u path[:weight]]...
+                  [-f url_file] [-j json_file|-] [-C] host:port|unix_socket_path
+    例如: loadgen -c 200 -t 2 -d 10 -u /index.html:9 -u /images/image1.jpg:1 127.0.0.1:10000
+          loadgen -c 100 -t 2 -d 10 -R 20000 -j result.json 127.0.0.1:10000
+          loadgen -c 100 -t 2 -d 10 /tmp/webserver.sock     (以/开头的目标为Unix域socket)
+    编译: g++ -std=c++20 -O2 -pthread loadgen.cpp -o loadgen
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string>
+#include <vector>
+
+#define MAX_EVENT_NUMBER 1024
+#define READ_BUFFER_SIZE (64 * 1024)
+#define MAX_PIPELINE 256
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+    对数线性直方图(HDR) 单位纳秒
+    小于128的值各占一个桶，之后每个2的幂区间再等分为128个桶
+*/
+struct hdr_histogram {
+    static const int SUB_BITS = 7;
+    static const int SUB_COUNT = 1 << SUB_BITS;
+    static const int MAX_BITS = 44;     // 约4.8小时
+    static const int BUCKETS = (MAX_BITS - SUB_BITS + 1) * SUB_COUNT;
+
+    std::vector<uint64_t> counts;
+    uint64_t total;
+    uint64_t max;
+    double sum;
+
+    hdr_histogram() : counts(BUCKETS, 0), total(0), max(0), sum(0) {}
+
+    static int index(uint64_t value) {
+        if(value < (uint64_t)SUB_COUNT) {
+            return value;
+        }
+        int msb = 63 - __builtin_clzll(value);
+        if(msb >= MAX_BITS) {
+            return BUCKETS - 1;
+        }
+        int shift = msb - SUB_BITS;
+        return (shift + 1) * SUB_COUNT + (int)((value >> shift) - SUB_COUNT);
+    }
+
+    // 桶内的最大值
+    static uint64_t upper(int index) {
+        if(index < SUB_COUNT) {
+            return index;
+        }
+        int shift = index / SUB_COUNT - 1;
+        uint64_t sub = index % SUB_COUNT + SUB_COUNT;
+        return ((sub + 1) << shift) - 1;
+    }
+
+    void record(uint64_t value) {
+        counts[index(value)]++;
+        total++;
+        sum += value;
+        if(value > max) {
+            max = value;
+        }
+    }
+
+    void merge(const hdr_histogram & other) {
+        for(int i = 0; i < BUCKETS; i++) {
+            counts[i] += other.counts[i];
+        }
+        total += other.total;
+        sum += other.sum;
+        if(other.max > max) {
+            max = other.max;
+        }
+    }
+
+    uint64_t percentile(double q) const {
+        if(total == 0) {
+            return 0;
+        }
+        uint64_t rank = (uint64_t)(q / 100.0 * total + 0.5);
+        if(rank < 1) {
+            rank = 1;
+        }
+        uint64_t seen = 0;
+        for(int i = 0; i < BUCKETS; i++) {
+            seen += counts[i];
+            if(seen >= rank) {
+                uint64_t value = upper(i);
+                return value < max ? value : max;
+            }
+        }
+        return max;
+    }
+
+    double mean() const {
+        return total ? sum / total : 0;
+    }
+};
+
+struct url_entry {
+    std::string path;
+    std::string request;    // 预先生成的完整请求报文
+    int weight;
+};
+
+// 命令行参数
+static struct {
+    int connections;
+    int threads;
+    int seconds;
+    int pipeline;
+    double rate;            // 开环模式的总速率(请求/秒)，0表示闭环
+    bool close;             // 每个请求后关闭连接(与webbench的行为相同)
+    int timeout;            // 应答超时(毫秒)
+    const char * json;
+    const char * target;
+} g_opt = { 100, 1, 10, 1, 0, false, 2000, NULL, NULL };
+
+static std::vector<url_entry> g_urls;
+static std::vector<int> g_cumulative;   // URL权重的前缀和
+static struct sockaddr_storage g_addr;
+static socklen_t g_addrlen;
+
+struct connection {
+    int fd;
+    int id;                 // 全局编号 开环模式下用于错开各连接的发送时刻
+    bool connected;
+    // 未完成请求的预定发送时刻和实际发送时刻 环形队列
+    uint64_t intended[MAX_PIPELINE];
+    uint64_t sent[MAX_PIPELINE];
+    int head;
+    int inflight;
+    uint64_t next_send;     // 开环模式下一个请求的预定发送时刻
+    std::string wbuf;       // 尚未写出的请求
+    size_t woff;
+    char rbuf[READ_BUFFER_SIZE];
+    size_t rlen;
+    bool in_body;
+    long long body_left;
+    bool close_after;       // 当前应答带有Connection: close
+    int status;
+};
+
+struct worker {
+    pthread_t tid;
+    int index;
+    int epollfd;
+    std::vector<connection *> conns;
+    uint64_t rng;
+    uint64_t start;
+    uint64_t deadline;
+    uint64_t interval;      // 开环模式每个连接相邻请求的间隔
+    uint64_t timeout;       // 应答超时(纳秒)
+
+    // 统计结果
+    hdr_histogram latency;  // 开环模式下从预定时刻计算(已校正)，闭环模式下从发送时刻计算
+    hdr_histogram service;  // 从实际发送时刻计算
+    long long responses;
+    long long non2xx;
+    long long errors;
+    long long timeouts;     // 超时未收到应答的请求数
+    long long reconnects;
+    long long bytes;
+};
+
+static int pick_url(worker * w) {
+    if(g_urls.size() == 1) {
+        return 0;
+    }
+    w->rng ^= w->rng << 13;
+    w->rng ^= w->rng >> 7;
+    w->rng ^= w->rng << 17;
+    int r = w->rng % g_cumulative.back();
+    int i = 0;
+    while(g_cumulative[i] <= r) {
+        i++;
+    }
+    return i;
+}
+
+static bool open_connection(worker * w, connection * c) {
+    c->connected = false;
+    c->fd = socket(g_addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(c->fd < 0) {
+        return false;
+    }
+    if(g_addr.ss_family != AF_UNIX) {
+        int one = 1;
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    if(connect(c->fd, (struct sockaddr *)&g_addr, g_addrlen) < 0 && errno != EINPROGRESS) {
+        close(c->fd);
+        c->fd = -1;
+        return false;
+    }
+    c->head = 0;
+    c->inflight = 0;
+    c->wbuf.clear();
+    c->woff = 0;
+    c->rlen = 0;
+    c->in_body = false;
+    c->body_left = 0;
+    c->close_after = false;
+
+    epoll_event event;
+    event.data.ptr = c;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    epoll_ctl(w->epollfd, EPOLL_CTL_ADD, c->fd, &event);
+    return true;
+}
+
+// 关闭并重新建立连接 未收到应答的请求计为错误(到达测试时长后只关闭)
+// 开环模式下next_send不变，重连期间到期的请求在连接建立后补发，等待时间计入延迟
+static void reconnect(worker * w, connection * c, bool error) {
+    if(error || c->inflight > 0) {
+        w->errors += c->inflight > 0 ? c->inflight : 1;
+    }
+    epoll_ctl(w->epollfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+    c->inflight = 0;
+    if(now_ns() >= w->deadline) {
+        return;
+    }
+    w->reconnects++;
+    if(!open_connection(w, c)) {
+        w->errors++;
+    }
+}
+
+static bool flush(connection * c) {
+    while(c->woff < c->wbuf.size()) {
+        ssize_t n = send(c->fd, c->wbuf.data() + c->woff, c->wbuf.size() - c->woff, MSG_NOSIGNAL);
+        if(n < 0) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                return true;    // 等待EPOLLOUT
+            } else if(errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        c->woff += n;
+    }
+    c->wbuf.clear();
+    c->woff = 0;
+    return true;
+}
+
+static void enqueue(worker * w, connection * c, uint64_t intended, uint64_t now) {
+    int slot = (c->head + c->inflight) % MAX_PIPELINE;
+    c->intended[slot] = intended;
+    c->sent[slot] = now;
+    c->inflight++;
+    c->wbuf += g_urls[pick_url(w)].request;
+}
+
+// 按当前模式补足未完成的请求并写出
+static bool fill(worker * w, connection * c, uint64_t now) {
+    if(!c->connected || c->close_after || now >= w->deadline) {
+        return true;
+    }
+    int depth = g_opt.close ? 1 : g_opt.pipeline;
+    if(g_opt.rate > 0) {
+        while(c->inflight < depth && c->next_send <= now) {
+            enqueue(w, c, c->next_send, now);
+            c->next_send += w->interval;
+        }
+    } else {
+        while(c->inflight < depth) {
+            enqueue(w, c, now, now);
+        }
+    }
+    return flush(c);
+}
+
+static void complete(worker * w, connection * c, uint64_t now) {
+    if(now < w->deadline) {
+        w->latency.record(now - c->intended[c->head]);
+        w->service.record(now - c->sent[c->head]);
+        w->responses++;
+        if(c->status < 200 || c->status >= 300) {
+            w->non2xx++;
+        }
+    }
+    c->head = (c->head + 1) % MAX_PIPELINE;
+    c->inflight--;
+}
+
+// 解析读缓冲区中的应答 返回false表示格式错误
+static bool parse(worker * w, connection * c, uint64_t now) {
+    size_t pos = 0;
+    while(pos < c->rlen) {
+        if(c->in_body) {
+            size_t n = c->rlen - pos;
+            if((long long)n > c->body_left) {
+                n = c->body_left;
+            }
+            pos += n;
+            c->body_left -= n;
+            if(c->body_left > 0) {
+                break;
+            }
+            c->in_body = false;
+            if(c->inflight == 0) {
+                return false;   // 多出来的应答
+            }
+            complete(w, c, now);
+            continue;
+        }
+
+        char * begin = c->rbuf + pos;
+        c->rbuf[c->rlen] = '\0';
+        char * end = strstr(begin, "\r\n\r\n");
+        if(!end) {
+            break;
+        }
+        *end = '\0';
+        if(strncmp(begin, "HTTP/1.", 7) != 0 || strlen(begin) < 12) {
+            return false;
+        }
+        c->status = atoi(begin + 9);
+        char * length = strcasestr(begin, "\r\nContent-Length:");
+        c->body_left = length ? atoll(length + 17) : 0;
+        char * conn = strcasestr(begin, "\r\nConnection:");
+        if(conn && strncasecmp(conn + 13 + strspn(conn + 13, " "), "close", 5) == 0) {
+            c->close_after = true;
+        }
+        c->in_body = true;
+        pos = end + 4 - c->rbuf;
+        if(c->body_left == 0) {
+            c->in_body = false;
+            if(c->inflight == 0) {
+                return false;
+            }
+            complete(w, c, now);
+        }
+    }
+    // 未处理完的应答头移到缓冲区开头
+    if(pos > 0) {
+        memmove(c->rbuf, c->rbuf + pos, c->rlen - pos);
+        c->rlen -= pos;
+    }
+    return true;
+}
+
+// 读取所有可读数据并解析 返回false表示需要重连
+static bool on_readable(worker * w, connection * c, uint64_t now) {
+    while(true) {
+        if(c->rlen >= READ_BUFFER_SIZE - 1) {
+            return false;   // 应答头过大
+        }
+        ssize_t n = recv(c->fd, c->rbuf + c->rlen, READ_BUFFER_SIZE - 1 - c->rlen, 0);
+        if(n < 0) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            } else if(errno == EINTR) {
+                continue;
+            }
+            return false;
+        } else if(n == 0) {
+            return false;
+        }
+        w->bytes += n;
+        c->rlen += n;
+        if(!parse(w, c, now)) {
+            return false;
+        }
+    }
+    if(c->close_after && c->inflight == 0) {
+        return false;   // 服务器要求关闭 重新连接
+    }
+    return true;
+}
+
+// 最早的未完成请求超过应答超时的连接：所有未完成的请求计为超时 重新连接
+static void check_timeouts(worker * w, uint64_t now) {
+    for(size_t i = 0; i < w->conns.size(); i++) {
+        connection * c = w->conns[i];
+        if(c->fd >= 0 && c->inflight > 0 && now - c->sent[c->head] >= w->timeout) {
+            w->timeouts += c->inflight;
+            c->inflight = 0;
+            reconnect(w, c, false);
+        }
+    }
+}
+
+static bool has_inflight(worker * w) {
+    for(size_t i = 0; i < w->conns.size(); i++) {
+        if(w->conns[i]->fd >= 0 && w->conns[i]->inflight > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void * run(void * arg) {
+    worker * w = (worker *)arg;
+    w->epollfd = epoll_create1(EPOLL_CLOEXEC);
+    double gap = g_opt.rate > 0 ? 1e9 / g_opt.rate : 0;
+    for(size_t i = 0; i < w->conns.size(); i++) {
+        connection * c = w->conns[i];
+        // 开环模式下各连接的第一个请求均匀错开
+        c->next_send = w->start + (uint64_t)(c->id * gap);
+        if(!open_connection(w, c)) {
+            w->errors++;
+        }
+    }
+
+    epoll_event events[MAX_EVENT_NUMBER];
+    uint64_t check_interval = w->timeout / 4 > 1000000ULL ? w->timeout / 4 : 1000000ULL;
+    uint64_t next_check = w->start + check_interval;
+    uint64_t drain_end = w->deadline + w->timeout;
+    while(true) {
+        uint64_t now = now_ns();
+        uint64_t wake;
+        if(now >= w->deadline) {
+            // 不再发送新请求 等待已发出请求的应答
+            if(now >= drain_end || !has_inflight(w)) {
+                break;
+            }
+            wake = drain_end;
+        } else {
+            if(now >= next_check) {
+                check_timeouts(w, now);
+                next_check = now + check_interval;
+            }
+            wake = next_check < w->deadline ? next_check : w->deadline;
+        }
+        // 开环模式下等待到最近一个可以发送的请求的预定时刻
+        if(g_opt.rate > 0 && now < w->deadline) {
+            for(size_t i = 0; i < w->conns.size(); i++) {
+                connection * c = w->conns[i];
+                if(c->connected && c->inflight < g_opt.pipeline && c->next_send < wake) {
+                    wake = c->next_send;
+                }
+            }
+        }
+        struct timespec timeout = { 0, 0 };
+        if(wake > now) {
+            timeout.tv_sec = (wake - now) / 1000000000ULL;
+            timeout.tv_nsec = (wake - now) % 1000000000ULL;
+        }
+        int number = epoll_pwait2(w->epollfd, events, MAX_EVENT_NUMBER, &timeout, NULL);
+        if(number < 0 && errno != EINTR) {
+            perror("epoll_pwait2");
+            break;
+        }
+        now = now_ns();
+        for(int i = 0; i < number; i++) {
+            connection * c = (connection *)events[i].data.ptr;
+            unsigned int ev = events[i].events;
+            if(!c->connected) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if(err != 0 || (ev & (EPOLLERR | EPOLLHUP))) {
+                    reconnect(w, c, true);
+                    continue;
+                }
+                c->connected = true;
+            }
+            bool ok = true;
+            if(ev & EPOLLIN) {
+                ok = on_readable(w, c, now);
+            } else if(ev & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                ok = false;
+            }
+            if(ok && (ev & EPOLLOUT)) {
+                ok = flush(c);
+            }
+            if(ok) {
+                ok = fill(w, c, now);
+            }
+            if(!ok) {
+                reconnect(w, c, false);
+            }
+        }
+        if(g_opt.rate > 0) {
+            for(size_t i = 0; i < w->conns.size(); i++) {
+                connection * c = w->conns[i];
+                if(!fill(w, c, now)) {
+                    reconnect(w, c, false);
+                }
+            }
+        }
+    }
+
+    for(size_t i = 0; i < w->conns.size(); i++) {
+        if(w->conns[i]->fd >= 0) {
+            w->timeouts += w->conns[i]->inflight;   // 到最后仍未应答
+            close(w->conns[i]->fd);
+        }
+    }
+    close(w->epollfd);
+    return NULL;
+}
+
+static void usage(const char * prog) {
+    printf("按照如下格式运行： %s [-c connections] [-t threads] [-d seconds] [-p pipeline] [-R rate] [-T timeout_ms] "
+           "[-u path[:weight]]... [-f url_file] [-j json_file|-] [-C] host:port|unix_socket_path\n", prog);
+}
+
+static bool add_url(const char * path, int weight) {
+    if(path[0] != '/' || weight <= 0) {
+        return false;
+    }
+    url_entry url;
+    url.path = path;
+    url.weight = weight;
+    g_urls.push_back(url);
+    return true;
+}
+
+static bool load_urls(const char * file) {
+    FILE * fp = fopen(file, "r");
+    if(!fp) {
+        perror(file);
+        return false;
+    }
+    char line[1024];
+    char path[1024];
+    while(fgets(line, sizeof(line), fp)) {
+        int weight = 1;
+        if(line[0] == '#' || sscanf(line, "%1023s %d", path, &weight) < 1) {
+            continue;
+        }
+        if(!add_url(path, weight)) {
+            fclose(fp);
+            return false;
+        }
+    }
+    fclose(fp);
+    return true;
+}
+
+static bool resolve(const char * target, std::string & host) {
+    if(target[0] == '/') {
+        struct sockaddr_un * address = (struct sockaddr_un *)&g_addr;
+        if(strlen(target) >= sizeof(address->sun_path)) {
+            return false;
+        }
+        memset(address, 0, sizeof(*address));
+        address->sun_family = AF_UNIX;
+        strcpy(address->sun_path, target);
+        g_addrlen = sizeof(*address);
+        host = "localhost";
+        return true;
+    }
+    const char * colon = strrchr(target, ':');
+    if(!colon) {
+        return false;
+    }
+    host.assign(target, colon - target);
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo * result;
+    if(getaddrinfo(host.c_str(), colon + 1, &hints, &result) != 0) {
+        return false;
+    }
+    memcpy(&g_addr, result->ai_addr, result->ai_addrlen);
+    g_addrlen = result->ai_addrlen;
+    freeaddrinfo(result);
+    return true;
+}
+
+static void print_json(FILE * fp, const hdr_histogram & latency, const hdr_histogram & service,
+                       long long responses, long long non2xx, long long errors, long long timeouts,
+                       long long reconnects, long long bytes, double elapsed) {
+    static const double quantiles[] = { 50, 75, 90, 99, 99.9, 99.99 };
+    fprintf(fp, "{\"target\":\"%s\",\"threads\":%d,\"connections\":%d,\"pipeline\":%d,\"mode\":\"%s\",\"rate\":%.1f,"
+            "\"seconds\":%.3f,\"requests\":%lld,\"non2xx\":%lld,\"errors\":%lld,\"timeouts\":%lld,\"reconnects\":%lld,\"bytes\":%lld,"
+            "\"throughput\":%.1f,",
+            g_opt.target, g_opt.threads, g_opt.connections, g_opt.pipeline, g_opt.rate > 0 ? "open" : "closed",
+            g_opt.rate, elapsed, responses, non2xx, errors, timeouts, reconnects, bytes, responses / elapsed);
+    const hdr_histogram * hists[] = { &latency, &service };
+    const char * names[] = { "latency_us", "service_us" };
+    for(int h = 0; h < 2; h++) {
+        fprintf(fp, "\"%s\":{\"mean\":%.1f,", names[h], hists[h]->mean() / 1000.0);
+        for(size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+            fprintf(fp, "\"p%g\":%.1f,", quantiles[i], hists[h]->percentile(quantiles[i]) / 1000.0);
+        }
+        fprintf(fp, "\"max\":%.1f}%s", hists[h]->max / 1000.0, h == 0 ? "," : "}\n");
+    }
+}
+
+int main(int argc, char * argv[]) {
+    int opt;
+    while((opt = getopt(argc, argv, "c:t:d:p:R:T:u:f:j:C")) != -1) {
+        switch(opt) {
+            case 'c': g_opt.connections = atoi(optarg); break;
+            case 't': g_opt.threads = atoi(optarg); break;
+            case 'd': g_opt.seconds = atoi(optarg); break;
+            case 'p': g_opt.pipeline = atoi(optarg); break;
+            case 'R': g_opt.rate = atof(optarg); break;
+            case 'T': g_opt.timeout = atoi(optarg); break;
+            case 'C': g_opt.close = true; break;
+            case 'j': g_opt.json = optarg; break;
+            case 'f':
+                if(!load_urls(optarg)) {
+                    return 1;
+                }
+                break;
+            case 'u': {
+                std::string path = optarg;
+                int weight = 1;
+                size_t colon = path.rfind(':');
+                if(colon != std::string::npos) {
+                    weight = atoi(path.c_str() + colon + 1);
+                    path.resize(colon);
+                }
+                if(!add_url(path.c_str(), weight)) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            }
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if(optind >= argc || g_opt.connections <= 0 || g_opt.threads <= 0 || g_opt.seconds <= 0
+            || g_opt.pipeline <= 0 || g_opt.pipeline > MAX_PIPELINE || g_opt.rate < 0 || g_opt.timeout <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if(g_opt.threads > g_opt.connections) {
+        g_opt.threads = g_opt.connections;
+    }
+    g_opt.target = argv[optind];
+    std::string host;
+    if(!resolve(g_opt.target, host)) {
+        printf("%s: cannot resolve\n", g_opt.target);
+        return 1;
+    }
+    if(g_urls.empty()) {
+        add_url("/index.html", 1);
+    }
+    int sum = 0;
+    for(size_t i = 0; i < g_urls.size(); i++) {
+        g_urls[i].request = "GET " + g_urls[i].path + " HTTP/1.1\r\nHost: " + host
+                          + (g_opt.close ? "\r\nConnection: close\r\n\r\n" : "\r\nConnection: keep-alive\r\n\r\n");
+        sum += g_urls[i].weight;
+        g_cumulative.push_back(sum);
+    }
+
+    std::vector<worker *> workers;
+    uint64_t start = now_ns() + 10 * 1000000ULL;
+    for(int i = 0; i < g_opt.threads; i++) {
+        worker * w = new worker();
+        w->index = i;
+        w->rng = 0x9e3779b97f4a7c15ULL * (i + 1);
+        w->start = start;
+        w->deadline = start + g_opt.seconds * 1000000000ULL;
+        w->interval = g_opt.rate > 0 ? (uint64_t)(g_opt.connections * 1e9 / g_opt.rate) : 0;
+        w->timeout = g_opt.timeout * 1000000ULL;
+        workers.push_back(w);
+    }
+    for(int i = 0; i < g_opt.connections; i++) {
+        connection * c = new connection();
+        c->fd = -1;
+        c->id = i;
+        workers[i % g_opt.threads]->conns.push_back(c);
+    }
+    for(int i = 0; i < g_opt.threads; i++) {
+        if(pthread_create(&workers[i]->tid, NULL, run, workers[i]) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+
+    hdr_histogram latency, service;
+    long long responses = 0, non2xx = 0, errors = 0, timeouts = 0, reconnects = 0, bytes = 0;
+    for(int i = 0; i < g_opt.threads; i++) {
+        worker * w = workers[i];
+        pthread_join(w->tid, NULL);
+        latency.merge(w->latency);
+        service.merge(w->service);
+        responses += w->responses;
+        non2xx += w->non2xx;
+        errors += w->errors;
+        timeouts += w->timeouts;
+        reconnects += w->reconnects;
+        bytes += w->bytes;
+    }
+    double elapsed = g_opt.seconds;
+
+    printf("loadgen %s: %d threads, %d connections, pipeline %d, %s",
+           g_opt.target, g_opt.threads, g_opt.connections, g_opt.pipeline, g_opt.close ? "close, " : "keep-alive, ");
+    if(g_opt.rate > 0) {
+        printf("open loop %.0f req/s\n", g_opt.rate);
+    } else {
+        printf("closed loop\n");
+    }
+    printf("requests %lld  non-2xx %lld  errors %lld  timeouts %lld  reconnects %lld\n", responses, non2xx, errors, timeouts, reconnects);
+    printf("throughput %.1f req/s  %.2f MB/s\n", responses / elapsed, bytes / elapsed / (1 << 20));
+    if(timeouts > 0 && g_opt.pipeline > 1) {
+        // 服务器丢弃了流水线中的请求时 之后的应答都对应到更早发送的请求上 延迟偏大
+        printf("warning: %lld requests timed out with pipeline %d, the server may not support pipelining "
+               "and the latencies below are unreliable\n", timeouts, g_opt.pipeline);
+    }
+    const hdr_histogram * hists[] = { &latency, &service };
+    const char * names[] = { g_opt.rate > 0 ? "latency(us, corrected)" : "latency(us)", "service(us)" };
+    for(int h = 0; h < (g_opt.rate > 0 ? 2 : 1); h++) {
+        printf("%-24s mean %.1f  p50 %.1f  p75 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  p99.99 %.1f  max %.1f\n",
+               names[h], hists[h]->mean() / 1000.0,
+               hists[h]->percentile(50) / 1000.0, hists[h]->percentile(75) / 1000.0,
+               hists[h]->percentile(90) / 1000.0, hists[h]->percentile(99) / 1000.0,
+               hists[h]->percentile(99.9) / 1000.0, hists[h]->percentile(99.99) / 1000.0,
+               hists[h]->max / 1000.0);
+    }
+
+    if(g_opt.json) {
+        FILE * fp = strcmp(g_opt.json, "-") == 0 ? stdout : fopen(g_opt.json, "w");
+        if(!fp) {
+            perror(g_opt.json);
+            return 1;
+        }
+        print_json(fp, latency, service, responses, non2xx, errors, timeouts, reconnects, bytes, elapsed);
+        if(fp != stdout) {
+            fclose(fp);
+        }
+    }
+    return 0;
+}
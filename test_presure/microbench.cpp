@@ -0,0 +1,359 @@
+/*
+    解析器、应答生成、文件定位和线程池交接的微基准测试
+    每项测试重复5轮取中位数，结果为每次操作的纳秒数；线程池交接另外给出p99。
+    -j 输出JSON Lines格式的结果(每行一项)，-b 与保存的基线比较，
+    比基线慢超过阈值(-T，默认10%)的项标记为REGRESSION并以退出码1结束，便于逐次提交对比。
+
+    用法: microbench [-r doc_root] [-c corpus] [-n scale] [-f filter] [-j json_file|-] [-b baseline] [-T threshold_pct]
+    例如: microbench -r ../resources -c corpus/requests.txt -b microbench_baseline.json
+    更新基线: microbench -r ../resources -c corpus/requests.txt -j microbench_baseline.json
+    编译: g++ -std=c++20 -O2 -pthread microbench.cpp ../http_conn.cpp ../filecache.cpp ../log.cpp ../metrics.cpp ../trace.cpp ../tls.cpp ../h2.cpp ../hpack.cpp ../ratelimit.cpp -lssl -lcrypto -o microbench
+    基线与机器相关，只有在同一台机器上生成的基线才有比较意义
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "../http_conn.h"
+#include "../pthreadpool.h"
+
+struct result {
+    std::string name;
+    double ns_per_op;
+    double p99;         // 只有延迟类测试有意义，其余为0
+};
+
+static std::vector<result> g_results;
+static const char * g_filter = NULL;
+static int g_scale = 1;
+
+static bool selected(const char * name) {
+    return !g_filter || strstr(name, g_filter);
+}
+
+// 运行5轮，每轮iterations次，返回每次操作耗时的中位数
+template<class F>
+static double measure(F f, int iterations) {
+    iterations *= g_scale;
+    f();    // 预热
+    double rounds[5];
+    for(int r = 0; r < 5; r++) {
+        uint64_t start = metrics_now();
+        for(int i = 0; i < iterations; i++) {
+            f();
+        }
+        rounds[r] = (double)(metrics_now() - start) / iterations;
+    }
+    std::sort(rounds, rounds + 5);
+    return rounds[2];
+}
+
+static void report(const char * name, double ns, double p99 = 0) {
+    result r = { name, ns, p99 };
+    g_results.push_back(r);
+    if(p99 > 0) {
+        printf("%-28s %12.1f ns/op   p99 %.1f ns\n", name, ns, p99);
+    } else {
+        printf("%-28s %12.1f ns/op\n", name, ns);
+    }
+}
+
+// 读取语料 每个请求以单独一行%%分隔，#开头的行为注释，行尾转换为\r\n
+static bool load_corpus(const char * file, std::vector<std::string> & corpus) {
+    FILE * fp = fopen(file, "r");
+    if(!fp) {
+        perror(file);
+        return false;
+    }
+    char line[4096];
+    std::string request;
+    while(fgets(line, sizeof(line), fp)) {
+        size_t len = strlen(line);
+        while(len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+        if(request.empty() && line[0] == '#') {
+            continue;
+        }
+        if(strcmp(line, "%%") == 0) {
+            corpus.push_back(request);
+            request.clear();
+            continue;
+        }
+        request.append(line, len);
+        request.append("\r\n");
+    }
+    if(!request.empty()) {
+        corpus.push_back(request);
+    }
+    fclose(fp);
+    for(size_t i = 0; i < corpus.size(); i++) {
+        if(corpus[i].size() >= (size_t)http_conn::READ_BUFFER_SIZE) {
+            printf("%s: request %zu is too large\n", file, i);
+            return false;
+        }
+    }
+    return !corpus.empty();
+}
+
+// 通过友元直接操作http_conn的缓冲区 不经过socket
+class microbench {
+public:
+    static void feed(http_conn & conn, const std::string & request) {
+        memcpy(conn.m_cold->read_buffer, request.data(), request.size());
+        conn.m_cold->read_buffer[request.size()] = '\0';
+        conn.m_read_index = request.size();
+        conn.m_checked_index = 0;
+        conn.m_start_line = 0;
+    }
+
+    static void run_parser(const std::vector<std::string> & corpus) {
+        http_conn conn;
+        conn.init();
+        size_t bytes = 0;
+        for(size_t i = 0; i < corpus.size(); i++) {
+            bytes += corpus[i].size();
+        }
+
+        if(selected("reset")) {
+            report("reset", measure([&]() { conn.init(); }, 200000));
+        }
+        if(selected("parse_line")) {
+            // 只有从状态机：把语料切分成行
+            double ns = measure([&]() {
+                for(size_t i = 0; i < corpus.size(); i++) {
+                    feed(conn, corpus[i]);
+                    while(conn.parse_line() == http_conn::LINE_OK) {
+                        conn.m_start_line = conn.m_checked_index;
+                    }
+                }
+            }, 20000);
+            report("parse_line", ns / corpus.size());
+            printf("%-28s %12.1f MB/s\n", "", bytes / ns * 1000.0);
+        }
+        if(selected("process_read")) {
+            // 完整的解析(含reset和do_request) 按语料平均
+            double ns = measure([&]() {
+                for(size_t i = 0; i < corpus.size(); i++) {
+                    conn.init();
+                    feed(conn, corpus[i]);
+                    conn.process_read();
+                    conn.unmap();
+                }
+            }, 5000);
+            report("process_read", ns / corpus.size());
+        }
+    }
+
+    static void run_request() {
+        http_conn conn;
+        conn.init();
+        char url[http_conn::FILENAME_LEN];
+        conn.m_cold->url = url;
+
+        if(selected("do_request/cache_hit")) {
+            strcpy(url, "/index.html");
+            report("do_request/cache_hit", measure([&]() { conn.do_request(); conn.unmap(); }, 100000));
+        }
+        if(selected("do_request/not_found")) {
+            strcpy(url, "/nope.html");
+            report("do_request/not_found", measure([&]() { conn.do_request(); conn.unmap(); }, 100000));
+        }
+        if(selected("do_request/mmap")) {
+            // 关闭缓存 每次stat+open+mmap+munmap
+            strcpy(url, "/images/readme.txt");
+            g_file_cache.set_capacity(0);
+            report("do_request/mmap", measure([&]() { conn.do_request(); conn.unmap(); }, 20000));
+            g_file_cache.set_capacity(64 << 20);
+        }
+    }
+
+    static void run_response() {
+        http_conn conn;
+        conn.init();
+        if(selected("add_headers")) {
+            report("add_headers", measure([&]() {
+                conn.m_write_index = 0;
+                conn.add_status_line(200, "OK");
+                conn.add_headers(351);
+            }, 200000));
+        }
+        if(selected("process_write/file")) {
+            char url[] = "/index.html";
+            conn.m_cold->url = url;
+            conn.do_request();
+            report("process_write/file", measure([&]() {
+                conn.m_write_index = 0;
+                conn.process_write(http_conn::FILE_REQUEST);
+            }, 200000));
+            conn.unmap();
+        }
+        if(selected("process_write/404")) {
+            report("process_write/404", measure([&]() {
+                conn.m_write_index = 0;
+                conn.process_write(http_conn::NO_RESOURCE);
+            }, 200000));
+        }
+    }
+};
+
+// 线程池基准测试使用的任务 process()记录从append到开始处理的时间
+struct pool_task {
+    uint64_t enqueued;
+    uint64_t handoff;
+    std::atomic<int> * done;
+    int classify() { return LANE_CHEAP; }
+    void process() {
+        handoff = metrics_now() - enqueued;
+        done->fetch_add(1, std::memory_order_release);
+    }
+    void shed() { done->fetch_add(1, std::memory_order_release); }
+};
+
+static void wait_done(std::atomic<int> & done, int target) {
+    while(done.load(std::memory_order_acquire) < target) {
+        sched_yield();
+    }
+}
+
+static void run_threadpool() {
+    threadpool<pool_task> * pool = new threadpool<pool_task>(1);
+    std::atomic<int> done(0);
+
+    if(selected("threadpool/handoff")) {
+        // 空闲的工作线程被唤醒并取出任务的延迟
+        int n = 2000 * g_scale;
+        std::vector<double> samples;
+        pool_task task;
+        task.done = &done;
+        int base = done.load();
+        for(int i = 0; i < n; i++) {
+            task.enqueued = metrics_now();
+            pool->append(&task);
+            wait_done(done, base + i + 1);
+            samples.push_back(task.handoff);
+            usleep(50);     // 让工作线程回到sem_wait
+        }
+        std::sort(samples.begin(), samples.end());
+        report("threadpool/handoff", samples[n / 2], samples[n * 99 / 100]);
+    }
+    if(selected("threadpool/burst")) {
+        // 一次加入一批任务 每个任务的平均入队+出队开销
+        const int BATCH = 1000;
+        std::vector<pool_task> tasks(BATCH);
+        for(int i = 0; i < BATCH; i++) {
+            tasks[i].done = &done;
+        }
+        report("threadpool/burst", measure([&]() {
+            int target = done.load() + BATCH;
+            for(int i = 0; i < BATCH; i++) {
+                tasks[i].enqueued = metrics_now();
+                pool->append(&tasks[i]);
+            }
+            wait_done(done, target);
+        }, 20) / BATCH);
+    }
+    delete pool;
+}
+
+// 读取基线中的"name"和"ns_per_op"
+static bool load_baseline(const char * file, std::vector<result> & baseline) {
+    FILE * fp = fopen(file, "r");
+    if(!fp) {
+        perror(file);
+        return false;
+    }
+    char line[512];
+    while(fgets(line, sizeof(line), fp)) {
+        char name[128];
+        double ns;
+        if(sscanf(line, "{\"name\":\"%127[^\"]\",\"ns_per_op\":%lf", name, &ns) == 2) {
+            result r = { name, ns, 0 };
+            baseline.push_back(r);
+        }
+    }
+    fclose(fp);
+    return true;
+}
+
+static int compare(const std::vector<result> & baseline, double threshold) {
+    int regressions = 0;
+    printf("\n%-28s %12s %12s %9s\n", "benchmark", "baseline", "current", "delta");
+    for(size_t i = 0; i < g_results.size(); i++) {
+        const result & cur = g_results[i];
+        for(size_t j = 0; j < baseline.size(); j++) {
+            if(baseline[j].name != cur.name || baseline[j].ns_per_op <= 0) {
+                continue;
+            }
+            double delta = (cur.ns_per_op - baseline[j].ns_per_op) / baseline[j].ns_per_op * 100;
+            bool regressed = delta > threshold;
+            regressions += regressed;
+            printf("%-28s %12.1f %12.1f %+8.1f%%%s\n", cur.name.c_str(), baseline[j].ns_per_op, cur.ns_per_op, delta,
+                   regressed ? "  REGRESSION" : "");
+        }
+    }
+    return regressions;
+}
+
+int main(int argc, char * argv[]) {
+    const char * corpus_file = "corpus/requests.txt";
+    const char * json = NULL;
+    const char * baseline_file = NULL;
+    double threshold = 10;
+    doc_root = "../resources";
+    int opt;
+    while((opt = getopt(argc, argv, "r:c:n:f:j:b:T:")) != -1) {
+        switch(opt) {
+            case 'r': doc_root = optarg; break;
+            case 'c': corpus_file = optarg; break;
+            case 'n': g_scale = atoi(optarg) > 0 ? atoi(optarg) : 1; break;
+            case 'f': g_filter = optarg; break;
+            case 'j': json = optarg; break;
+            case 'b': baseline_file = optarg; break;
+            case 'T': threshold = atof(optarg); break;
+            default:
+                printf("按照如下格式运行： %s [-r doc_root] [-c corpus] [-n scale] [-f filter] [-j json_file|-] [-b baseline] [-T threshold_pct]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    g_log_level = LOG_LEVEL_OFF;
+    metrics_init(NULL);
+    std::vector<std::string> corpus;
+    if(!load_corpus(corpus_file, corpus)) {
+        return 1;
+    }
+
+    microbench::run_parser(corpus);
+    microbench::run_request();
+    microbench::run_response();
+    run_threadpool();
+
+    if(json) {
+        FILE * fp = strcmp(json, "-") == 0 ? stdout : fopen(json, "w");
+        if(!fp) {
+            perror(json);
+            return 1;
+        }
+        for(size_t i = 0; i < g_results.size(); i++) {
+            fprintf(fp, "{\"name\":\"%s\",\"ns_per_op\":%.1f,\"p99\":%.1f}\n",
+                    g_results[i].name.c_str(), g_results[i].ns_per_op, g_results[i].p99);
+        }
+        if(fp != stdout) {
+            fclose(fp);
+        }
+    }
+    if(baseline_file) {
+        std::vector<result> baseline;
+        if(!load_baseline(baseline_file, baseline)) {
+            return 1;
+        }
+        return compare(baseline, threshold) > 0 ? 1 : 0;
+    }
+    return 0;
+}
@@ -0,0 +1,26 @@
+#!/bin/bash
+# PGO训练负载: 用插桩的服务器在各事件分发模式下分别压测resources/，覆盖缓存命中、大文件、404、
+# 错误请求、流水线、短连接和/metrics，收到SIGTERM时插桩版本写出剖析数据
+# 用法: ./pgo_train.sh <server_binary> <loadgen_binary> <doc_root> [seconds_per_run] [port]
+# 通常由 cmake --build build --target pgo 调用
+
+SERVER=${1:?server binary}
+LOADGEN=${2:?loadgen binary}
+DOC_ROOT=${3:?doc_root}
+SECONDS_=${4:-3}
+PORT=${5:-10099}
+URLS="-u /index.html:16 -u /images/image1.jpg:4 -u /nope.html:2 -u /metrics:1"
+
+for mode in pool hybrid coro owner; do
+    "$SERVER" -m "$mode" -t 4 -l warn -r "$DOC_ROOT" "$PORT" > /dev/null 2>&1 &
+    pid=$!
+    sleep 1
+    echo "===== pgo training: $mode ====="
+    "$LOADGEN" -c 64 -t 2 -d "$SECONDS_" $URLS "127.0.0.1:$PORT" | sed -n 2,3p
+    "$LOADGEN" -c 16 -d 1 -p 8 $URLS "127.0.0.1:$PORT" | sed -n 2p
+    "$LOADGEN" -c 8 -d 1 -C $URLS "127.0.0.1:$PORT" | sed -n 2p
+    # 错误请求走400分支
+    printf 'POST /index.html HTTP/1.0\r\n\r\n' | timeout 1 bash -c "cat > /dev/tcp/127.0.0.1/$PORT" 2>/dev/null
+    kill -TERM "$pid"
+    wait "$pid" 2>/dev/null
+done
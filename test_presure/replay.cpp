@@ -0,0 +1,717 @@
+/*
+    回放服务器捕获(-W)的流量 用真实的请求分布代替固定URL的压测
+    捕获文件记录了每个连接收到的原始字节、时刻和连接的边界。回放时每个捕获的连接对应一个新连接：
+        连接在原来的相对时刻建立，每段数据在原来的相对时刻发送，-s N 把所有间隔缩短为1/N，-s 0 不等待
+        捕获中一段数据之前服务器写完了几个应答，回放时就要先收到同样多的应答才发送它，
+            因此keep-alive上的请求依次发送，流水线发送的请求仍然一起发送，与原来的连接结构相同
+        延迟从完成一个请求的那段数据发出时开始计算，记录在HDR直方图中，输出文本和JSON格式的分位数
+    HTTP/2连接和协议升级(Upgrade)的连接不回放，计入skipped；TLS连接捕获的是明文，回放到服务器的明文端口。
+    捕获时日志缓冲区满会丢弃记录，对应的连接可能不完整，其中收不到应答的请求计为错误。
+
+    用法: replay [-s speed] [-t threads] [-j json_file|-] capture_file host:port|unix_socket_path
+    例如: server -W /tmp/capture.bin -r resources 10000      (运行一段时间后停止)
+          replay -s 10 -t 2 /tmp/capture.bin 127.0.0.1:10000
+    编译: g++ -std=c++20 -O2 -pthread replay.cpp -o replay
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <queue>
+#include <unordered_map>
+
+#define MAX_EVENT_NUMBER 1024
+#define READ_BUFFER_SIZE (64 * 1024)
+#define IDLE_TIMEOUT_NS (10 * 1000000000ULL)   // 这么久没有任何进展时放弃剩下的连接
+
+// 与服务器log.h中的定义相同
+#define CAPTURE_MAGIC "WSCP"
+#define CAPTURE_VERSION 1
+#define CAPTURE_OPEN 'O'
+#define CAPTURE_DATA 'D'
+#define CAPTURE_RESPONSE 'R'
+#define CAPTURE_CLOSE 'C'
+
+#pragma pack(push, 1)
+struct capture_header {
+    char magic[4];
+    uint32_t version;
+};
+
+struct capture_record {
+    uint8_t type;
+    uint8_t reserved;
+    uint16_t length;
+    uint32_t pid;
+    uint64_t conn;
+    uint64_t timestamp_us;
+};
+#pragma pack(pop)
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+    对数线性直方图(HDR) 单位纳秒 与loadgen相同
+    小于128的值各占一个桶，之后每个2的幂区间再等分为128个桶
+*/
+struct hdr_histogram {
+    static const int SUB_BITS = 7;
+    static const int SUB_COUNT = 1 << SUB_BITS;
+    static const int MAX_BITS = 44;     // 约4.8小时
+    static const int BUCKETS = (MAX_BITS - SUB_BITS + 1) * SUB_COUNT;
+
+    std::vector<uint64_t> counts;
+    uint64_t total;
+    uint64_t max;
+    double sum;
+
+    hdr_histogram() : counts(BUCKETS, 0), total(0), max(0), sum(0) {}
+
+    static int index(uint64_t value) {
+        if(value < (uint64_t)SUB_COUNT) {
+            return value;
+        }
+        int msb = 63 - __builtin_clzll(value);
+        if(msb >= MAX_BITS) {
+            return BUCKETS - 1;
+        }
+        int shift = msb - SUB_BITS;
+        return (shift + 1) * SUB_COUNT + (int)((value >> shift) - SUB_COUNT);
+    }
+
+    // 桶内的最大值
+    static uint64_t upper(int index) {
+        if(index < SUB_COUNT) {
+            return index;
+        }
+        int shift = index / SUB_COUNT - 1;
+        uint64_t sub = index % SUB_COUNT + SUB_COUNT;
+        return ((sub + 1) << shift) - 1;
+    }
+
+    void record(uint64_t value) {
+        counts[index(value)]++;
+        total++;
+        sum += value;
+        if(value > max) {
+            max = value;
+        }
+    }
+
+    void merge(const hdr_histogram & other) {
+        for(int i = 0; i < BUCKETS; i++) {
+            counts[i] += other.counts[i];
+        }
+        total += other.total;
+        sum += other.sum;
+        if(other.max > max) {
+            max = other.max;
+        }
+    }
+
+    uint64_t percentile(double q) const {
+        if(total == 0) {
+            return 0;
+        }
+        uint64_t rank = (uint64_t)(q / 100.0 * total + 0.5);
+        if(rank < 1) {
+            rank = 1;
+        }
+        uint64_t seen = 0;
+        for(int i = 0; i < BUCKETS; i++) {
+            seen += counts[i];
+            if(seen >= rank) {
+                uint64_t value = upper(i);
+                return value < max ? value : max;
+            }
+        }
+        return max;
+    }
+
+    double mean() const {
+        return total ? sum / total : 0;
+    }
+};
+
+// 捕获中的一段数据
+struct chunk {
+    uint64_t offset_us;     // 相对捕获开始的时刻
+    int wait;               // 发送之前需要收到的应答数
+    std::string data;
+    int requests;           // 这段数据结束的请求数
+};
+
+// 一个捕获的连接和它回放时的状态
+struct session {
+    uint64_t open_us;       // 相对捕获开始的时刻
+    std::vector<chunk> chunks;
+    int requests;           // 完整请求的总数
+    bool skip;
+
+    int fd;
+    bool connected;
+    bool done;
+    size_t next;            // 下一段要发送的数据
+    int responses;
+    std::deque<uint64_t> inflight;      // 未收到应答的请求的发送时刻
+    std::string wbuf;
+    size_t woff;
+    char rbuf[READ_BUFFER_SIZE];
+    size_t rlen;
+    bool in_body;
+    long long body_left;
+    int status;
+};
+
+struct worker {
+    pthread_t tid;
+    int epollfd;
+    std::vector<session *> sessions;
+    uint64_t start;
+    int remaining;          // 还没有结束的连接数
+
+    // 统计结果
+    hdr_histogram latency;
+    long long responses;
+    long long non2xx;
+    long long errors;
+    long long bytes;
+    uint64_t finish;
+};
+
+// 命令行参数
+static struct {
+    double speed;           // 回放速度倍数 0表示不等待
+    int threads;
+    const char * json;
+    const char * capture;
+    const char * target;
+} g_opt = { 1, 1, NULL, NULL, NULL };
+
+static struct sockaddr_storage g_addr;
+static socklen_t g_addrlen;
+
+/*
+    读取捕获文件 按(pid, 连接句柄)把记录分到各个连接
+    同时按HTTP/1.1的格式切分请求，记下每段数据结束了几个请求，用于限制等待的应答数
+    (丢弃了记录时应答数可能多于请求数，回放时不能等待永远不会到来的应答)
+*/
+static bool load_capture(const char * file, std::vector<session *> & sessions, uint64_t & span_us) {
+    FILE * fp = fopen(file, "r");
+    if(!fp) {
+        perror(file);
+        return false;
+    }
+    capture_header header;
+    if(fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, CAPTURE_MAGIC, 4) != 0
+            || header.version != CAPTURE_VERSION) {
+        printf("%s: not a capture file\n", file);
+        fclose(fp);
+        return false;
+    }
+    struct state {
+        session * s;
+        int responses;      // 目前为止写完的应答数
+        std::string pending;    // 尚未组成完整请求的数据
+    };
+    std::unordered_map<std::string, state> open;
+    uint64_t base = 0, last = 0;
+    capture_record record;
+    std::string data;
+    while(fread(&record, sizeof(record), 1, fp) == 1) {
+        data.resize(record.length);
+        if(record.length > 0 && fread(&data[0], record.length, 1, fp) != 1) {
+            break;  // 服务器还在写入或被中止 忽略不完整的最后一条
+        }
+        if(base == 0) {
+            base = record.timestamp_us;
+        }
+        uint64_t offset = record.timestamp_us > base ? record.timestamp_us - base : 0;
+        last = offset > last ? offset : last;
+        std::string key((const char *)&record.pid, sizeof(record.pid) + sizeof(record.conn));
+        auto it = open.find(key);
+        if(record.type == CAPTURE_OPEN || (it == open.end() && record.type == CAPTURE_DATA)) {
+            session * s = new session();
+            s->open_us = offset;
+            s->fd = -1;
+            sessions.push_back(s);
+            state st = { s, 0, "" };
+            it = open.insert_or_assign(key, st).first;
+        }
+        if(it == open.end()) {
+            continue;
+        }
+        state & st = it->second;
+        session * s = st.s;
+        if(record.type == CAPTURE_DATA) {
+            if(s->chunks.empty() && (data.compare(0, 14, "PRI * HTTP/2.0") == 0)) {
+                s->skip = true;
+            }
+            chunk c;
+            c.offset_us = offset;
+            c.wait = st.responses < s->requests ? st.responses : s->requests;
+            c.requests = 0;
+            c.data = data;
+            st.pending += data;
+            while(true) {
+                size_t end = st.pending.find("\r\n\r\n");
+                if(end == std::string::npos) {
+                    break;
+                }
+                std::string head = st.pending.substr(0, end + 2);
+                long long length = 0;
+                const char * field = strcasestr(head.c_str(), "\r\nContent-Length:");
+                if(field) {
+                    length = atoll(field + 17);
+                }
+                if(strcasestr(head.c_str(), "\r\nUpgrade:")) {
+                    s->skip = true;
+                }
+                if(st.pending.size() < end + 4 + length) {
+                    break;
+                }
+                c.requests++;
+                s->requests++;
+                st.pending.erase(0, end + 4 + length);
+            }
+            s->chunks.push_back(std::move(c));
+        } else if(record.type == CAPTURE_RESPONSE) {
+            st.responses++;
+        } else if(record.type == CAPTURE_CLOSE) {
+            open.erase(it);
+        }
+    }
+    fclose(fp);
+    span_us = last;
+    return true;
+}
+
+static bool open_connection(worker * w, session * s) {
+    s->connected = false;
+    s->fd = socket(g_addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(s->fd < 0) {
+        return false;
+    }
+    if(g_addr.ss_family != AF_UNIX) {
+        int one = 1;
+        setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    if(connect(s->fd, (struct sockaddr *)&g_addr, g_addrlen) < 0 && errno != EINPROGRESS) {
+        close(s->fd);
+        s->fd = -1;
+        return false;
+    }
+    epoll_event event;
+    event.data.ptr = s;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    epoll_ctl(w->epollfd, EPOLL_CTL_ADD, s->fd, &event);
+    return true;
+}
+
+// 结束一个连接 没有收到应答的请求(包括没有发出的)计为错误
+static void finish(worker * w, session * s, uint64_t now) {
+    if(s->done) {
+        return;
+    }
+    s->done = true;
+    w->errors += s->requests - s->responses;
+    if(s->fd >= 0) {
+        epoll_ctl(w->epollfd, EPOLL_CTL_DEL, s->fd, NULL);
+        close(s->fd);
+        s->fd = -1;
+    }
+    w->remaining--;
+    w->finish = now;
+}
+
+static uint64_t due(worker * w, uint64_t offset_us) {
+    return g_opt.speed > 0 ? w->start + (uint64_t)(offset_us * 1000 / g_opt.speed) : w->start;
+}
+
+static bool flush(session * s) {
+    if(!s->connected) {
+        return true;    // 连接建立后由EPOLLOUT写出
+    }
+    while(s->woff < s->wbuf.size()) {
+        ssize_t n = send(s->fd, s->wbuf.data() + s->woff, s->wbuf.size() - s->woff, MSG_NOSIGNAL);
+        if(n < 0) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                return true;
+            } else if(errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        s->woff += n;
+    }
+    s->wbuf.clear();
+    s->woff = 0;
+    return true;
+}
+
+typedef std::pair<uint64_t, session *> timer;
+typedef std::priority_queue<timer, std::vector<timer>, std::greater<timer>> timer_queue;
+
+/*
+    推进一个连接：到时刻就建立连接，依次发送已经到时刻并且等到了足够应答的数据
+    还没到时刻的加入定时器 重复的定时器是无害的；返回false表示连接出错
+*/
+static bool advance(worker * w, session * s, timer_queue & timers, uint64_t now) {
+    if(s->done) {
+        return true;
+    }
+    if(s->fd < 0) {
+        uint64_t at = due(w, s->open_us);
+        if(at > now) {
+            timers.push(timer(at, s));
+            return true;
+        }
+        if(!open_connection(w, s)) {
+            return false;
+        }
+    }
+    while(s->next < s->chunks.size()) {
+        chunk & c = s->chunks[s->next];
+        if(s->responses < c.wait) {
+            break;  // 收到应答后再推进
+        }
+        uint64_t at = due(w, c.offset_us);
+        if(at > now) {
+            timers.push(timer(at, s));
+            break;
+        }
+        s->wbuf += c.data;
+        for(int i = 0; i < c.requests; i++) {
+            s->inflight.push_back(now);
+        }
+        s->next++;
+    }
+    if(!flush(s)) {
+        return false;
+    }
+    if(s->next == s->chunks.size() && s->responses == s->requests) {
+        finish(w, s, now);
+    }
+    return true;
+}
+
+static void complete(worker * w, session * s, uint64_t now) {
+    w->latency.record(now - s->inflight.front());
+    s->inflight.pop_front();
+    s->responses++;
+    w->responses++;
+    if(s->status < 200 || s->status >= 300) {
+        w->non2xx++;
+    }
+}
+
+// 解析读缓冲区中的应答 返回false表示格式错误或多出来的应答
+static bool parse(worker * w, session * s, uint64_t now) {
+    size_t pos = 0;
+    while(pos < s->rlen) {
+        if(s->in_body) {
+            size_t n = s->rlen - pos;
+            if((long long)n > s->body_left) {
+                n = s->body_left;
+            }
+            pos += n;
+            s->body_left -= n;
+            if(s->body_left > 0) {
+                break;
+            }
+            s->in_body = false;
+            complete(w, s, now);
+            continue;
+        }
+        char * begin = s->rbuf + pos;
+        s->rbuf[s->rlen] = '\0';
+        char * end = strstr(begin, "\r\n\r\n");
+        if(!end) {
+            break;
+        }
+        *end = '\0';
+        if(strncmp(begin, "HTTP/1.", 7) != 0 || strlen(begin) < 12 || s->inflight.empty()) {
+            return false;
+        }
+        s->status = atoi(begin + 9);
+        char * length = strcasestr(begin, "\r\nContent-Length:");
+        // 与服务器一致 只按Content-Length确定消息体(服务器不支持HEAD，应答总是带有消息体)
+        s->body_left = length ? atoll(length + 17) : 0;
+        pos = end + 4 - s->rbuf;
+        if(s->body_left > 0) {
+            s->in_body = true;
+        } else {
+            complete(w, s, now);
+        }
+    }
+    if(pos > 0) {
+        memmove(s->rbuf, s->rbuf + pos, s->rlen - pos);
+        s->rlen -= pos;
+    }
+    return true;
+}
+
+// 读取所有可读数据并解析 返回false表示连接已关闭或出错
+static bool on_readable(worker * w, session * s, uint64_t now) {
+    while(true) {
+        if(s->rlen >= READ_BUFFER_SIZE - 1) {
+            return false;   // 应答头过大
+        }
+        ssize_t n = recv(s->fd, s->rbuf + s->rlen, READ_BUFFER_SIZE - 1 - s->rlen, 0);
+        if(n < 0) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                return true;
+            } else if(errno == EINTR) {
+                continue;
+            }
+            return false;
+        } else if(n == 0) {
+            return false;
+        }
+        w->bytes += n;
+        s->rlen += n;
+        if(!parse(w, s, now)) {
+            return false;
+        }
+    }
+}
+
+static void * run(void * arg) {
+    worker * w = (worker *)arg;
+    w->epollfd = epoll_create1(EPOLL_CLOEXEC);
+    timer_queue timers;
+    for(size_t i = 0; i < w->sessions.size(); i++) {
+        timers.push(timer(due(w, w->sessions[i]->open_us), w->sessions[i]));
+    }
+    w->remaining = w->sessions.size();
+    uint64_t progress = now_ns();
+
+    epoll_event events[MAX_EVENT_NUMBER];
+    while(w->remaining > 0) {
+        uint64_t now = now_ns();
+        while(!timers.empty() && timers.top().first <= now) {
+            session * s = timers.top().second;
+            timers.pop();
+            if(!advance(w, s, timers, now)) {
+                finish(w, s, now);
+            }
+        }
+        if(w->remaining == 0) {
+            break;
+        }
+        struct timespec timeout = { 1, 0 };
+        if(!timers.empty()) {
+            uint64_t wait = timers.top().first > now ? timers.top().first - now : 0;
+            timeout.tv_sec = wait / 1000000000ULL;
+            timeout.tv_nsec = wait % 1000000000ULL;
+        }
+        int number = epoll_pwait2(w->epollfd, events, MAX_EVENT_NUMBER, &timeout, NULL);
+        if(number < 0 && errno != EINTR) {
+            perror("epoll_pwait2");
+            break;
+        }
+        now = now_ns();
+        if(number > 0 || (!timers.empty() && timers.top().first <= now)) {
+            progress = now;
+        } else if(now - progress > IDLE_TIMEOUT_NS) {
+            // 服务器不再应答 剩下的请求都计为错误
+            for(size_t i = 0; i < w->sessions.size(); i++) {
+                finish(w, w->sessions[i], now);
+            }
+            break;
+        }
+        for(int i = 0; i < number; i++) {
+            session * s = (session *)events[i].data.ptr;
+            unsigned int ev = events[i].events;
+            if(s->done) {
+                continue;
+            }
+            if(!s->connected) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if(err != 0 || (ev & (EPOLLERR | EPOLLHUP))) {
+                    finish(w, s, now);
+                    continue;
+                }
+                s->connected = true;
+            }
+            bool ok = true;
+            if(ev & EPOLLIN) {
+                ok = on_readable(w, s, now);
+            } else if(ev & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                ok = false;
+            }
+            if(ok) {
+                ok = advance(w, s, timers, now);
+            }
+            if(!ok) {
+                finish(w, s, now);
+            }
+        }
+    }
+    close(w->epollfd);
+    return NULL;
+}
+
+static void usage(const char * prog) {
+    printf("按照如下格式运行： %s [-s speed] [-t threads] [-j json_file|-] capture_file host:port|unix_socket_path\n", prog);
+}
+
+static bool resolve(const char * target) {
+    if(target[0] == '/') {
+        struct sockaddr_un * address = (struct sockaddr_un *)&g_addr;
+        if(strlen(target) >= sizeof(address->sun_path)) {
+            return false;
+        }
+        memset(address, 0, sizeof(*address));
+        address->sun_family = AF_UNIX;
+        strcpy(address->sun_path, target);
+        g_addrlen = sizeof(*address);
+        return true;
+    }
+    const char * colon = strrchr(target, ':');
+    if(!colon) {
+        return false;
+    }
+    std::string host(target, colon - target);
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo * result;
+    if(getaddrinfo(host.c_str(), colon + 1, &hints, &result) != 0) {
+        return false;
+    }
+    memcpy(&g_addr, result->ai_addr, result->ai_addrlen);
+    g_addrlen = result->ai_addrlen;
+    freeaddrinfo(result);
+    return true;
+}
+
+static void print_json(FILE * fp, const hdr_histogram & latency, int sessions, int skipped, double span,
+                       long long responses, long long non2xx, long long errors, long long bytes, double elapsed) {
+    static const double quantiles[] = { 50, 75, 90, 99, 99.9, 99.99 };
+    fprintf(fp, "{\"capture\":\"%s\",\"target\":\"%s\",\"threads\":%d,\"speed\":%g,\"connections\":%d,\"skipped\":%d,"
+            "\"capture_seconds\":%.3f,\"seconds\":%.3f,\"requests\":%lld,\"non2xx\":%lld,\"errors\":%lld,\"bytes\":%lld,"
+            "\"throughput\":%.1f,\"latency_us\":{\"mean\":%.1f,",
+            g_opt.capture, g_opt.target, g_opt.threads, g_opt.speed, sessions, skipped, span, elapsed,
+            responses, non2xx, errors, bytes, responses / elapsed, latency.mean() / 1000.0);
+    for(size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+        fprintf(fp, "\"p%g\":%.1f,", quantiles[i], latency.percentile(quantiles[i]) / 1000.0);
+    }
+    fprintf(fp, "\"max\":%.1f}}\n", latency.max / 1000.0);
+}
+
+int main(int argc, char * argv[]) {
+    int opt;
+    while((opt = getopt(argc, argv, "s:t:j:")) != -1) {
+        switch(opt) {
+            case 's': g_opt.speed = atof(optarg); break;
+            case 't': g_opt.threads = atoi(optarg); break;
+            case 'j': g_opt.json = optarg; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if(optind + 2 != argc || g_opt.speed < 0 || g_opt.threads <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    g_opt.capture = argv[optind];
+    g_opt.target = argv[optind + 1];
+    if(!resolve(g_opt.target)) {
+        printf("%s: cannot resolve\n", g_opt.target);
+        return 1;
+    }
+    std::vector<session *> sessions;
+    uint64_t span_us = 0;
+    if(!load_capture(g_opt.capture, sessions, span_us)) {
+        return 1;
+    }
+
+    // 连接按建立的顺序轮流分给各线程
+    std::vector<worker *> workers;
+    for(int i = 0; i < g_opt.threads; i++) {
+        workers.push_back(new worker());
+    }
+    int replayed = 0, skipped = 0;
+    long long requests = 0;
+    for(size_t i = 0; i < sessions.size(); i++) {
+        session * s = sessions[i];
+        if(s->skip) {
+            skipped++;
+        } else if(!s->chunks.empty()) {
+            workers[replayed++ % g_opt.threads]->sessions.push_back(s);
+            requests += s->requests;
+        }
+    }
+    printf("replay %s -> %s: %d connections (%d skipped), %lld requests over %.3f s, speed %s%g, %d threads\n",
+           g_opt.capture, g_opt.target, replayed, skipped, requests, span_us / 1e6,
+           g_opt.speed > 0 ? "x" : "unpaced ", g_opt.speed, g_opt.threads);
+
+    uint64_t start = now_ns() + 10 * 1000000ULL;
+    for(int i = 0; i < g_opt.threads; i++) {
+        workers[i]->start = start;
+        workers[i]->finish = start;
+        if(pthread_create(&workers[i]->tid, NULL, run, workers[i]) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+
+    hdr_histogram latency;
+    long long responses = 0, non2xx = 0, errors = 0, bytes = 0;
+    uint64_t finish = start;
+    for(int i = 0; i < g_opt.threads; i++) {
+        worker * w = workers[i];
+        pthread_join(w->tid, NULL);
+        latency.merge(w->latency);
+        responses += w->responses;
+        non2xx += w->non2xx;
+        errors += w->errors;
+        bytes += w->bytes;
+        finish = w->finish > finish ? w->finish : finish;
+    }
+    double elapsed = finish > start ? (finish - start) / 1e9 : 1e-9;
+
+    printf("requests %lld  non-2xx %lld  errors %lld\n", responses, non2xx, errors);
+    printf("elapsed %.3f s  throughput %.1f req/s  %.2f MB/s\n", elapsed, responses / elapsed, bytes / elapsed / (1 << 20));
+    printf("%-24s mean %.1f  p50 %.1f  p75 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  p99.99 %.1f  max %.1f\n",
+           "latency(us)", latency.mean() / 1000.0,
+           latency.percentile(50) / 1000.0, latency.percentile(75) / 1000.0,
+           latency.percentile(90) / 1000.0, latency.percentile(99) / 1000.0,
+           latency.percentile(99.9) / 1000.0, latency.percentile(99.99) / 1000.0,
+           latency.max / 1000.0);
+
+    if(g_opt.json) {
+        FILE * fp = strcmp(g_opt.json, "-") == 0 ? stdout : fopen(g_opt.json, "w");
+        if(!fp) {
+            perror(g_opt.json);
+            return 1;
+        }
+        print_json(fp, latency, replayed, skipped, span_us / 1e6, responses, non2xx, errors, bytes, elapsed);
+        if(fp != stdout) {
+            fclose(fp);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,118 @@
+#include <string.h>
+#include <openssl/err.h>
+#include "tls.h"
+#include "log.h"
+#include "metrics.h"
+
+static SSL_CTX * g_ssl_ctx = NULL;
+
+// 把OpenSSL错误队列中的错误写入日志
+static void log_ssl_errors(const char * what) {
+    unsigned long err;
+    char buf[256];
+    while((err = ERR_get_error()) != 0) {
+        ERR_error_string_n(err, buf, sizeof(buf));
+        LOG_ERROR("%s: %s", what, buf);
+    }
+}
+
+// ALPN：客户端支持时优先选择HTTP/2 否则HTTP/1.1
+static int select_alpn(SSL * ssl, const unsigned char ** out, unsigned char * outlen,
+                       const unsigned char * in, unsigned int inlen, void * arg) {
+    static const unsigned char protocols[] = "\x02h2\x08http/1.1";
+    if(SSL_select_next_proto((unsigned char **)out, outlen, protocols, sizeof(protocols) - 1, in, inlen) != OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_NOACK;    // 没有共同的协议时不选择 按HTTP/1.1处理
+    }
+    return SSL_TLSEXT_ERR_OK;
+}
+
+bool tls_init(const char * cert_file, const char * key_file) {
+    SSL_CTX * ctx = SSL_CTX_new(TLS_server_method());
+    if(!ctx) {
+        log_ssl_errors("SSL_CTX_new");
+        return false;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    if(SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1
+            || SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1
+            || SSL_CTX_check_private_key(ctx) != 1) {
+        log_ssl_errors(cert_file);
+        SSL_CTX_free(ctx);
+        return false;
+    }
+
+    SSL_CTX_set_options(ctx, SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE);
+#ifdef SSL_OP_ENABLE_KTLS
+    // 握手完成后由OpenSSL设置TCP_ULP并把密钥交给内核 不支持的内核或套件上自动退回用户态
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#else
+    LOG_INFO("tls: kTLS unavailable (OpenSSL %s), records are encrypted in user space", OpenSSL_version(OPENSSL_VERSION));
+#endif
+    // 非阻塞写：每次写出一个记录就返回，EAGAIN后重试时缓冲区地址可以变化(内容相同)
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+
+    // TLS 1.2的session id缓存 以及TLS 1.3/1.2的无状态session ticket(默认开启，密钥在进程内随机生成)
+    static const unsigned char session_context[] = "webserver";
+    SSL_CTX_set_session_id_context(ctx, session_context, sizeof(session_context) - 1);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, 20000);
+    SSL_CTX_set_timeout(ctx, 3600);
+    SSL_CTX_set_num_tickets(ctx, 1);    // TLS 1.3默认发两张 一个连接只需要一张
+    SSL_CTX_set_alpn_select_cb(ctx, select_alpn, NULL);
+
+    g_ssl_ctx = ctx;
+    LOG_INFO("tls enabled with %s", cert_file);
+    return true;
+}
+
+bool tls_enabled() {
+    return g_ssl_ctx != NULL;
+}
+
+SSL * tls_new(int fd) {
+    SSL * ssl = SSL_new(g_ssl_ctx);
+    if(!ssl) {
+        return NULL;
+    }
+    // socket BIO：kTLS需要直接操作文件描述符
+    if(SSL_set_fd(ssl, fd) != 1) {
+        SSL_free(ssl);
+        return NULL;
+    }
+    SSL_set_accept_state(ssl);
+    return ssl;
+}
+
+bool tls_established(SSL * ssl) {
+#ifdef SSL_OP_ENABLE_KTLS
+    bool ktls = BIO_get_ktls_send(SSL_get_wbio(ssl));
+#else
+    bool ktls = false;      // OpenSSL 3.0之前没有kTLS
+#endif
+    metrics_add(M_TLS_HANDSHAKES);
+    if(SSL_session_reused(ssl)) {
+        metrics_add(M_TLS_RESUMED);
+    }
+    if(ktls) {
+        metrics_add(M_TLS_KTLS);
+    }
+    LOG_DEBUG("tls %s %s resumed %d ktls %d", SSL_get_version(ssl), SSL_get_cipher_name(ssl), SSL_session_reused(ssl), ktls);
+    return ktls;
+}
+
+bool tls_alpn_h2(SSL * ssl) {
+    const unsigned char * proto;
+    unsigned int len;
+    SSL_get0_alpn_selected(ssl, &proto, &len);
+    return len == 2 && memcmp(proto, "h2", 2) == 0;
+}
+
+void tls_close(SSL * ssl, bool established) {
+    if(established) {
+        // 只发送close_notify 不等待对方的回应
+        ERR_clear_error();
+        SSL_shutdown(ssl);
+    }
+    ERR_clear_error();
+    SSL_free(ssl);
+}
@@ -0,0 +1,24 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <openssl/ssl.h>
+
+/*
+    HTTPS
+    握手和会话管理由OpenSSL完成：TLS 1.2/1.3，服务端会话缓存和session ticket，断开重连时可以复用会话省去完整握手；
+    SSL_CTX在fork之前创建，多进程模式下所有worker共用同一组ticket密钥，重连到其他worker也能复用。
+    握手完成后尝试启用内核TLS(kTLS，setsockopt(TCP_ULP, "tls"))：记录层的加密由内核完成，
+    应答仍然直接writev到socket，文件内容不经过OpenSSL的缓冲区；内核或OpenSSL(3.0之前)不支持时退回SSL_write。
+    读取始终经过SSL_read(kTLS接收时OpenSSL内部直接读取明文)。
+    ALPN优先选择"h2"，协商成功的连接握手后直接使用HTTP/2。
+    测试证书用 tools/gen_test_cert.sh 生成。
+*/
+
+bool tls_init(const char * cert_file, const char * key_file);  // 加载证书和私钥，创建全局的SSL_CTX
+bool tls_enabled();
+SSL * tls_new(int fd);                  // 为新接收的连接创建SSL对象(服务端模式)
+bool tls_established(SSL * ssl);        // 握手完成后调用，统计握手结果，返回是否启用了kTLS发送
+bool tls_alpn_h2(SSL * ssl);            // 握手时ALPN协商的协议是否为HTTP/2
+void tls_close(SSL * ssl, bool established);    // 发送close_notify(不等待对方)并释放SSL对象
+
+#endif
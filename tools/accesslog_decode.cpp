@@ -0,0 +1,74 @@
+/*
+    二进制访问日志的离线解码工具
+    用法: accesslog_decode access_log_file
+    每条请求输出一行: 时间 fd 方法 路径 状态码 字节数 延迟(微秒)
+*/
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <unordered_map>
+#include "../log.h"
+
+static const char * method_names[] = { "GET", "POST", "HEAD", "PUT", "DELETE", "TRACE", "OPTIONS", "CONNECT" };
+
+int main(int argc, char * argv[]) {
+    if(argc != 2) {
+        printf("按照如下格式运行： %s access_log_file\n", argv[0]);
+        return 1;
+    }
+    FILE * fp = fopen(argv[1], "rb");
+    if(!fp) {
+        perror("fopen");
+        return 1;
+    }
+
+    access_log_header header;
+    if(fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, ACCESS_LOG_MAGIC, 4) != 0) {
+        printf("%s: not an access log\n", argv[1]);
+        return 1;
+    }
+    if(header.version != ACCESS_LOG_VERSION) {
+        printf("%s: unsupported version %u\n", argv[1], header.version);
+        return 1;
+    }
+
+    std::unordered_map<uint32_t, std::string> paths;
+    long long requests = 0;
+    int type;
+    while((type = fgetc(fp)) != EOF) {
+        if(type == ACCESS_RECORD_PATH) {
+            access_path def;
+            char path[65536];
+            if(fread(&def, sizeof(def), 1, fp) != 1 || fread(path, 1, def.length, fp) != def.length) {
+                break;
+            }
+            paths[def.path_id] = std::string(path, def.length);
+        } else if(type == ACCESS_RECORD_REQUEST) {
+            access_record record;
+            if(fread(&record, sizeof(record), 1, fp) != 1) {
+                break;
+            }
+            time_t sec = record.timestamp_us / 1000000;
+            struct tm tm;
+            localtime_r(&sec, &tm);
+            char when[32];
+            strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+
+            std::unordered_map<uint32_t, std::string>::iterator it = paths.find(record.path_id);
+            char unknown[32];
+            snprintf(unknown, sizeof(unknown), "path#%08x", record.path_id);
+            printf("%s.%06d fd=%d %s %s %u %u %uus\n", when, (int)(record.timestamp_us % 1000000), record.fd,
+                   record.method < 8 ? method_names[record.method] : "?",
+                   it != paths.end() ? it->second.c_str() : unknown,
+                   record.status, record.bytes, record.latency_us);
+            requests++;
+        } else {
+            printf("corrupted record type %d at offset %ld\n", type, ftell(fp) - 1);
+            break;
+        }
+    }
+    fclose(fp);
+    fprintf(stderr, "%lld requests\n", requests);
+    return 0;
+}
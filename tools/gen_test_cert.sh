@@ -0,0 +1,13 @@
+#!/bin/bash
+# 生成本地测试HTTPS用的自签名证书(ECDSA P-256，签名比RSA快得多)，证书对localhost和127.0.0.1有效
+# 用法: tools/gen_test_cert.sh [输出目录，默认当前目录]
+# 然后: ./server -C cert.pem -K key.pem -r resources 9006
+#      curl --cacert cert.pem https://localhost:9006/index.html   (或 curl -k)
+set -e
+DIR=${1:-.}
+mkdir -p "$DIR"
+openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:prime256v1 -nodes -days 365 \
+    -subj "/CN=localhost" -addext "subjectAltName=DNS:localhost,IP:127.0.0.1" \
+    -keyout "$DIR/key.pem" -out "$DIR/cert.pem" 2>/dev/null
+chmod 600 "$DIR/key.pem"
+echo "$DIR/cert.pem $DIR/key.pem"
@@ -0,0 +1,74 @@
+/*
+    从共享内存中读取服务器的指标 不需要服务器做任何系统调用
+    用法: metrics_dump shm_name [interval_seconds]
+    例如: metrics_dump /webserver.10000 1
+    不指定间隔时输出一次Prometheus文本；指定间隔时每隔interval秒输出一次请求速率和延迟分位数
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../metrics.h"
+
+int main(int argc, char * argv[]) {
+    if(argc < 2) {
+        printf("按照如下格式运行： %s shm_name [interval_seconds]\n", argv[0]);
+        return 1;
+    }
+    int fd = shm_open(argv[1], O_RDONLY, 0);
+    if(fd < 0) {
+        perror("shm_open");
+        return 1;
+    }
+    struct stat st;
+    if(fstat(fd, &st) < 0 || (size_t)st.st_size < metrics_region_size(0)) {
+        printf("%s: too small\n", argv[1]);
+        return 1;
+    }
+    const metrics_region * region = (const metrics_region *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(region == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    if(memcmp(region->magic, METRICS_MAGIC, 8) != 0 || region->version != METRICS_VERSION
+            || metrics_region_size(region->max_shards) > (size_t)st.st_size) {
+        printf("%s: not a metrics region\n", argv[1]);
+        return 1;
+    }
+
+    if(argc < 3) {
+        static char buf[256 * 1024];
+        int len = metrics_render(region, buf, sizeof(buf));
+        fwrite(buf, 1, len, stdout);
+        return 0;
+    }
+
+    int interval = atoi(argv[2]);
+    if(interval <= 0) {
+        interval = 1;
+    }
+    metrics_snapshot * prev = new metrics_snapshot;
+    metrics_snapshot * cur = new metrics_snapshot;
+    metrics_collect(region, prev);
+    while(true) {
+        sleep(interval);
+        metrics_collect(region, cur);
+        printf("req/s %8.0f  open %6lld  queue %5lld  shed %6llu  p50 %8.1fus  p99 %8.1fus  p999 %8.1fus\n",
+               (double)(cur->counters[M_REQUESTS] - prev->counters[M_REQUESTS]) / interval,
+               (long long)(cur->counters[M_ACCEPTS] - cur->counters[M_CLOSES]),
+               (long long)(cur->counters[M_QUEUE_IN] - cur->counters[M_QUEUE_OUT]),
+               (unsigned long long)(cur->counters[M_SHED] - prev->counters[M_SHED]),
+               metrics_percentile(*cur, H_LATENCY, 0.5) / 1e3,
+               metrics_percentile(*cur, H_LATENCY, 0.99) / 1e3,
+               metrics_percentile(*cur, H_LATENCY, 0.999) / 1e3);
+        fflush(stdout);
+        metrics_snapshot * tmp = prev;
+        prev = cur;
+        cur = tmp;
+    }
+    return 0;
+}
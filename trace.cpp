@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include "trace.h"
+#include "locker.h"
+
+bool g_trace_enabled = false;
+
+static int g_trace_fd = -1;
+static uint64_t g_sample_threshold = 0;     // 随机数小于该值时采样
+static double g_ns_per_tick = 1.0;          // trace_now的单位换算为纳秒
+static uint64_t g_tick_base = 0;            // 追踪开始时的trace_now
+static const size_t FLUSH_SIZE = 64 * 1024;     // 缓冲区超过该大小时由所属线程直接写出
+static std::atomic<bool> g_running(false);
+static pthread_t g_flusher;
+
+static const struct { int begin; int end; const char * name; } spans[] = {
+    { TP_WAKE, TP_READ, "dispatch" },
+    { TP_READ, TP_READ_END, "read" },
+    { TP_ENQUEUE, TP_DEQUEUE, "queue" },
+    { TP_PARSE, TP_PARSE_END, "parse" },
+    { TP_HANDLE, TP_HANDLE_END, "do_request" },
+    { TP_WRITE, TP_WRITE_END, "write" },
+};
+
+// 每个线程的事件缓冲区
+struct trace_buffer {
+    std::string data;
+    locker lock;        // 所属线程追加事件时与后台写出线程竞争
+};
+static std::vector<trace_buffer *> g_buffers;
+static std::vector<trace_buffer *> g_free_buffers;     // 已退出的线程交还的缓冲区
+static locker g_buffers_locker;
+static thread_local trace_buffer * t_buffer = NULL;
+
+int trace_tid() {
+    static thread_local int tid = 0;
+    if(tid == 0) {
+        tid = syscall(SYS_gettid);
+    }
+    return tid;
+}
+
+void trace_thread_exit() {
+    if(!t_buffer) {
+        return;
+    }
+    g_buffers_locker.lock();
+    g_free_buffers.push_back(t_buffer);
+    g_buffers_locker.unlock();
+    t_buffer = NULL;
+}
+
+// 测量trace_now与CLOCK_MONOTONIC的比例
+static void calibrate() {
+    struct timespec a, b;
+    clock_gettime(CLOCK_MONOTONIC, &a);
+    uint64_t t0 = trace_now();
+    struct timespec ts = { 0, 20 * 1000000 };
+    nanosleep(&ts, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &b);
+    uint64_t t1 = trace_now();
+    double ns = (b.tv_sec - a.tv_sec) * 1e9 + (b.tv_nsec - a.tv_nsec);
+    g_ns_per_tick = (t1 > t0) ? ns / (t1 - t0) : 1.0;
+    g_tick_base = t0;
+}
+
+static void write_all(int fd, const char * data, size_t len) {
+    while(len > 0) {
+        ssize_t n = ::write(fd, data, len);
+        if(n < 0) {
+            return;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+// 以O_APPEND方式一次写出整个缓冲区 多个线程的写出不会交错
+static void flush(trace_buffer * buffer) {
+    buffer->lock.lock();
+    if(!buffer->data.empty()) {
+        write_all(g_trace_fd, buffer->data.data(), buffer->data.size());
+        buffer->data.clear();
+    }
+    buffer->lock.unlock();
+}
+
+static void flush_all() {
+    g_buffers_locker.lock();
+    for(size_t i = 0; i < g_buffers.size(); i++) {
+        flush(g_buffers[i]);
+    }
+    g_buffers_locker.unlock();
+}
+
+// 每100ms把所有线程缓冲区中的事件写出 采样率低时事件也能及时落盘
+static void * flusher(void * arg) {
+    while(g_running.load(std::memory_order_acquire)) {
+        struct timespec ts = { 0, 100 * 1000000 };
+        nanosleep(&ts, NULL);
+        flush_all();
+    }
+    return NULL;
+}
+
+bool trace_init(const char * file, double sample_rate) {
+    g_trace_fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if(g_trace_fd < 0) {
+        return false;
+    }
+    // 1.0转换为uint64_t会溢出 单独处理
+    g_sample_threshold = sample_rate >= 1 ? UINT64_MAX : (uint64_t)(sample_rate * 18446744073709551616.0);
+    calibrate();
+
+    // Trace Event格式允许省略数组的结尾，进程被杀死时文件仍然可以打开
+    char header[256];
+    int len = snprintf(header, sizeof(header),
+        "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"threads\"}},\n"
+        "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":2,\"args\":{\"name\":\"connections\"}},\n");
+    write_all(g_trace_fd, header, len);
+    g_running.store(true, std::memory_order_release);
+    if(pthread_create(&g_flusher, NULL, flusher, NULL) != 0) {
+        g_running.store(false, std::memory_order_release);
+        return false;
+    }
+    g_trace_enabled = sample_rate > 0;
+    return true;
+}
+
+void trace_shutdown() {
+    if(!g_running.exchange(false)) {
+        return;
+    }
+    g_trace_enabled = false;
+    pthread_join(g_flusher, NULL);
+    flush_all();
+    close(g_trace_fd);
+    g_trace_fd = -1;
+}
+
+bool trace_sample() {
+    // xorshift64* 每个线程独立的随机数序列
+    static thread_local uint64_t state = 0;
+    if(state == 0) {
+        state = trace_now() ^ ((uint64_t)trace_tid() << 32) ^ 0x9e3779b97f4a7c15ULL;
+    }
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 2685821657736338717ULL < g_sample_threshold;
+}
+
+static double to_us(uint64_t tick) {
+    return (tick - g_tick_base) * g_ns_per_tick / 1000.0;
+}
+
+void trace_submit(const trace_record & r) {
+    if(g_trace_fd < 0) {
+        return;
+    }
+    if(!t_buffer) {
+        g_buffers_locker.lock();
+        if(!g_free_buffers.empty()) {
+            t_buffer = g_free_buffers.back();
+            g_free_buffers.pop_back();
+        } else {
+            t_buffer = new trace_buffer;
+            g_buffers.push_back(t_buffer);
+        }
+        g_buffers_locker.unlock();
+    }
+
+    // url中的引号和反斜杠替换掉 保证输出合法的JSON
+    char url[sizeof(r.url)];
+    int i = 0;
+    for(; i < (int)sizeof(url) - 1 && r.url[i]; i++) {
+        unsigned char c = r.url[i];
+        url[i] = (c == '"' || c == '\\' || c < 0x20) ? '_' : c;
+    }
+    url[i] = '\0';
+
+    char event[512];
+    uint64_t first = 0;
+    t_buffer->lock.lock();
+    for(size_t s = 0; s < sizeof(spans) / sizeof(spans[0]); s++) {
+        uint64_t begin = r.ts[spans[s].begin];
+        uint64_t end = r.ts[spans[s].end];
+        if(!begin || !end || end < begin) {
+            continue;
+        }
+        if(!first || begin < first) {
+            first = begin;
+        }
+        int len = snprintf(event, sizeof(event),
+            "{\"name\":\"%s\",\"cat\":\"stage\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+            "\"args\":{\"fd\":%d,\"url\":\"%s\"}},\n",
+            spans[s].name, r.tid[spans[s].begin], to_us(begin), (end - begin) * g_ns_per_tick / 1000.0, r.fd, url);
+        t_buffer->data.append(event, len);
+    }
+    if(first && r.ts[TP_WRITE_END]) {
+        // 每个连接一条时间线 显示请求的整体耗时
+        int len = snprintf(event, sizeof(event),
+            "{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"X\",\"pid\":2,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+            "\"args\":{\"status\":%d}},\n",
+            url, r.fd, to_us(first), (r.ts[TP_WRITE_END] - first) * g_ns_per_tick / 1000.0, r.status);
+        t_buffer->data.append(event, len);
+    }
+    bool full = t_buffer->data.size() >= FLUSH_SIZE;
+    t_buffer->lock.unlock();
+    if(full) {
+        flush(t_buffer);
+    }
+}
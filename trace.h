@@ -0,0 +1,61 @@
+#ifndef TRACE_H
+#define TRACE_H
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/*
+    按请求采样的阶段追踪
+    请求开始时按采样率决定是否追踪，被追踪的请求在每个阶段的开始和结束处记录时间戳(x86上为TSC，
+    其他平台为CLOCK_MONOTONIC)和所在线程，请求完成后在当前线程的缓冲区中生成Chrome Trace Event格式的事件，
+    缓冲区满时由所属线程、否则由后台线程每100ms追加写入追踪文件。文件可以直接用 chrome://tracing 或 ui.perfetto.dev 打开，
+    每个线程一条时间线，另有每个连接一条时间线显示请求的整体耗时。
+*/
+
+// 追踪点 成对出现 分别为一个阶段的开始和结束
+enum TRACE_POINT {
+    TP_WAKE = 0,        // epoll_wait返回
+    TP_READ,            // 开始读取(与TP_WAKE之间为事件分发的等待)
+    TP_READ_END,
+    TP_ENQUEUE,         // 加入线程池队列
+    TP_DEQUEUE,         // 工作线程取出
+    TP_PARSE,           // process_read
+    TP_PARSE_END,
+    TP_HANDLE,          // do_request
+    TP_HANDLE_END,
+    TP_WRITE,           // 应答生成完毕 开始写
+    TP_WRITE_END,       // 响应全部写完(包括等待EPOLLOUT的时间)
+    TRACE_POINT_NUMBER
+};
+
+// 一个被追踪请求的全部时间戳
+struct trace_record {
+    int fd;
+    int status;
+    char url[64];
+    uint64_t ts[TRACE_POINT_NUMBER];    // 时间戳(trace_now的单位)，0表示该阶段没有发生
+    int tid[TRACE_POINT_NUMBER];        // 记录时间戳的线程
+};
+
+extern bool g_trace_enabled;
+
+bool trace_init(const char * file, double sample_rate);
+void trace_shutdown();          // 写出所有线程缓冲区中的事件
+bool trace_sample();            // 按采样率决定是否追踪一个新请求
+void trace_submit(const trace_record & record);
+int trace_tid();                // 当前线程的线程ID
+void trace_thread_exit();       // 线程退出前交还事件缓冲区 其中的事件仍由后台线程写出
+
+static inline uint64_t trace_now() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+#endif
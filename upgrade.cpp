@@ -0,0 +1,341 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <limits.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/signalfd.h>
+#include <atomic>
+#include "upgrade.h"
+#include "http_conn.h"
+#include "config.h"
+#include "log.h"
+
+static const uint32_t HANDOFF_MAGIC = 0x57534846;  // "WSHF"
+static const int HANDOFF_ACK_TIMEOUT = 30;          // 等待新进程确认的秒数
+static const char HANDOFF_ACK[] = "READY\n";
+
+// 旧进程发给新进程的消息头 监听socket放在SCM_RIGHTS辅助数据中
+struct handoff_header {
+    uint32_t magic;
+    uint32_t count;
+};
+
+struct upgrade_state {
+    int listener;                   // 等待新进程连接的Unix socket
+    int sigfd;                      // SIGHUP/SIGUSR2
+    int fds[HANDOFF_MAX_FDS];
+    int count;
+    char exe[PATH_MAX];             // 启动时可执行文件的路径 升级时exec该路径
+    char ** argv;                   // 新进程的参数 在原参数后追加-I
+    void (*on_handoff)();
+    pid_t child;                    // 正在启动的新进程
+};
+
+static upgrade_state g_upgrade;
+static int g_handoff_conn = -1;     // 新进程与旧进程之间的连接 确认之后关闭
+
+static volatile sig_atomic_t g_drain = 0;
+static std::atomic<time_t> g_drain_deadline(0);
+
+void upgrade_block_signals() {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGUSR2);
+    sigprocmask(SIG_BLOCK, &set, NULL);
+}
+
+void drain_start() {
+    g_drain = 1;
+    http_conn::m_draining = true;
+}
+
+bool draining() {
+    if(!g_drain) {
+        return false;
+    }
+    // 第一次发现排空时确定期限 信号处理函数中不方便做
+    if(g_drain_deadline.load(std::memory_order_relaxed) == 0) {
+        time_t expected = 0;
+        if(g_drain_deadline.compare_exchange_strong(expected, time(NULL) + g_config.drain_seconds)) {
+            LOG_INFO("draining %d connections, deadline %ds", http_conn::m_user_count.load(), g_config.drain_seconds);
+        }
+    }
+    return true;
+}
+
+bool drain_finished() {
+    if(!draining()) {
+        return false;
+    }
+    return http_conn::m_user_count == 0 || time(NULL) >= g_drain_deadline.load(std::memory_order_relaxed);
+}
+
+// fork并exec新进程 子进程中只能使用异步信号安全的调用
+static pid_t spawn(const char * path) {
+    pid_t pid = fork();
+    if(pid != 0) {
+        return pid;
+    }
+    // exec会保留信号屏蔽和没有设置CLOEXEC的描述符 新进程不能持有旧进程的连接
+    sigset_t empty;
+    sigemptyset(&empty);
+    sigprocmask(SIG_SETMASK, &empty, NULL);
+    if(close_range(3, ~0U, 0) != 0) {
+        for(int fd = 3; fd < 65536; fd++) {
+            close(fd);
+        }
+    }
+    execv(path, g_upgrade.argv);
+    _exit(127);
+}
+
+// 把监听socket交给连接上来的新进程 收到确认后返回true
+static bool serve_handoff(int conn) {
+    // 只接受同一用户(或root)的进程
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if(getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0 || (cred.uid != geteuid() && cred.uid != 0)) {
+        LOG_WARN("handoff: rejected peer uid %d", (int)cred.uid);
+        return false;
+    }
+
+    handoff_header header = { HANDOFF_MAGIC, (uint32_t)g_upgrade.count };
+    struct iovec iov = { &header, sizeof(header) };
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * g_upgrade.count);
+    struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * g_upgrade.count);
+    memcpy(CMSG_DATA(cmsg), g_upgrade.fds, sizeof(int) * g_upgrade.count);
+    if(sendmsg(conn, &msg, MSG_NOSIGNAL) != (ssize_t)sizeof(header)) {
+        LOG_WARN("handoff: send failure: %s", strerror(errno));
+        return false;
+    }
+
+    // 新进程开始服务之后才回复 启动失败时连接关闭或超时 旧进程继续服务
+    struct timeval tv = { HANDOFF_ACK_TIMEOUT, 0 };
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    char ack[sizeof(HANDOFF_ACK) - 1];
+    if(recv(conn, ack, sizeof(ack), MSG_WAITALL) != (ssize_t)sizeof(ack) || memcmp(ack, HANDOFF_ACK, sizeof(ack)) != 0) {
+        LOG_WARN("handoff: new process pid %d did not confirm, keep serving", (int)cred.pid);
+        return false;
+    }
+    LOG_INFO("handoff: %d listening sockets taken over by pid %d", g_upgrade.count, (int)cred.pid);
+    return true;
+}
+
+// 控制线程：处理SIGHUP/SIGUSR2 等待新进程接管
+static void * upgrade_thread(void * arg) {
+    struct pollfd fds[2];
+    fds[0].fd = g_upgrade.sigfd;
+    fds[0].events = POLLIN;
+    fds[1].fd = g_upgrade.listener;
+    fds[1].events = POLLIN;
+    while(true) {
+        int number = poll(fds, 2, g_upgrade.child > 0 ? 1000 : -1);
+        if(g_upgrade.child > 0) {
+            int status;
+            pid_t pid = waitpid(g_upgrade.child, &status, WNOHANG);
+            if(pid == g_upgrade.child || (pid < 0 && errno == ECHILD)) {
+                // 多进程模式下也可能已被master回收
+                LOG_ERROR("new process pid %d exited before taking over", g_upgrade.child);
+                g_upgrade.child = 0;
+            }
+        }
+        if(number <= 0) {
+            continue;
+        }
+
+        if(fds[0].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            if(read(g_upgrade.sigfd, &info, sizeof(info)) == sizeof(info)) {
+                // SIGUSR2执行磁盘上的新版本 SIGHUP重新执行当前映像
+                const char * path = info.ssi_signo == SIGUSR2 ? g_upgrade.exe : "/proc/self/exe";
+                if(g_upgrade.child > 0) {
+                    LOG_WARN("upgrade already in progress (pid %d), signal %d ignored", g_upgrade.child, (int)info.ssi_signo);
+                } else if((g_upgrade.child = spawn(path)) < 0) {
+                    LOG_ERROR("upgrade: fork failure: %s", strerror(errno));
+                    g_upgrade.child = 0;
+                } else {
+                    LOG_INFO("%s: started %s as pid %d", info.ssi_signo == SIGUSR2 ? "upgrade" : "reload", path, g_upgrade.child);
+                }
+            }
+        }
+
+        if(fds[1].revents & POLLIN) {
+            int conn = accept4(g_upgrade.listener, NULL, NULL, SOCK_CLOEXEC);
+            if(conn < 0) {
+                continue;
+            }
+            bool ok = serve_handoff(conn);
+            close(conn);
+            if(ok) {
+                // 路径已由新进程重新绑定 这里只关闭不删除
+                close(g_upgrade.listener);
+                close(g_upgrade.sigfd);
+                g_upgrade.on_handoff();
+                return NULL;
+            }
+        }
+    }
+    return NULL;
+}
+
+bool upgrade_start(const char * path, const int * fds, int count, char * argv[], void (*on_handoff)()) {
+    if(count > HANDOFF_MAX_FDS) {
+        LOG_WARN("handoff: only the first %d of %d listening sockets can be handed off", HANDOFF_MAX_FDS, count);
+        count = HANDOFF_MAX_FDS;
+    }
+    memcpy(g_upgrade.fds, fds, sizeof(int) * count);
+    g_upgrade.count = count;
+    g_upgrade.on_handoff = on_handoff;
+    g_upgrade.child = 0;
+
+    // 可执行文件被替换后readlink的结果带" (deleted)"后缀
+    ssize_t len = readlink("/proc/self/exe", g_upgrade.exe, sizeof(g_upgrade.exe) - 1);
+    if(len <= 0) {
+        LOG_ERROR("readlink /proc/self/exe failure: %s", strerror(errno));
+        return false;
+    }
+    g_upgrade.exe[len] = '\0';
+    const char * deleted = " (deleted)";
+    if(len > (ssize_t)strlen(deleted) && strcmp(g_upgrade.exe + len - strlen(deleted), deleted) == 0) {
+        g_upgrade.exe[len - strlen(deleted)] = '\0';
+    }
+
+    int argc = 0;
+    bool inherit = false;
+    while(argv[argc]) {
+        inherit = inherit || strcmp(argv[argc], "-I") == 0;
+        argc++;
+    }
+    g_upgrade.argv = new char*[argc + 2];
+    memcpy(g_upgrade.argv, argv, sizeof(char *) * argc);
+    g_upgrade.argv[argc] = inherit ? NULL : (char *)"-I";
+    g_upgrade.argv[argc + 1] = NULL;
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(address.sun_path)) {
+        LOG_ERROR("handoff path too long: %s", path);
+        return false;
+    }
+    strcpy(address.sun_path, path);
+    // 路径可能是上一个进程留下的 接管完成后旧进程不再使用它
+    unlink(path);
+    g_upgrade.listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(g_upgrade.listener < 0 || bind(g_upgrade.listener, (struct sockaddr *)&address, sizeof(address)) != 0
+            || chmod(path, 0600) != 0 || listen(g_upgrade.listener, 1) != 0) {
+        LOG_ERROR("handoff listen on %s failure: %s", path, strerror(errno));
+        if(g_upgrade.listener >= 0) {
+            close(g_upgrade.listener);
+        }
+        return false;
+    }
+
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGUSR2);
+    g_upgrade.sigfd = signalfd(-1, &set, SFD_CLOEXEC);
+    if(g_upgrade.sigfd < 0) {
+        LOG_ERROR("signalfd failure: %s", strerror(errno));
+        close(g_upgrade.listener);
+        return false;
+    }
+
+    // 控制线程屏蔽所有信号 进程级信号交给其他线程或master的sigtimedwait
+    sigset_t all, old_mask;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old_mask);
+    pthread_t thread;
+    int ret = pthread_create(&thread, NULL, upgrade_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    if(ret != 0) {
+        close(g_upgrade.listener);
+        close(g_upgrade.sigfd);
+        return false;
+    }
+    pthread_detach(thread);
+    LOG_INFO("waiting for upgrade on %s (SIGUSR2 upgrade, SIGHUP reload)", path);
+    return true;
+}
+
+int handoff_receive(const char * path, int * fds, int max) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(address.sun_path)) {
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(sock < 0) {
+        return -1;
+    }
+    if(connect(sock, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        LOG_WARN("handoff: no running instance on %s: %s", path, strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    handoff_header header;
+    struct iovec iov = { &header, sizeof(header) };
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t n = recvmsg(sock, &msg, MSG_WAITALL);
+    struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+    int count = 0;
+    int received[HANDOFF_MAX_FDS];
+    if(cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(received, CMSG_DATA(cmsg), sizeof(int) * count);
+    }
+    if(n != (ssize_t)sizeof(header) || header.magic != HANDOFF_MAGIC || (int)header.count != count
+            || count > max || (msg.msg_flags & MSG_CTRUNC)) {
+        LOG_ERROR("handoff: invalid message from %s", path);
+        for(int i = 0; i < count; i++) {
+            close(received[i]);
+        }
+        close(sock);
+        return -1;
+    }
+    memcpy(fds, received, sizeof(int) * count);
+    g_handoff_conn = sock;
+    LOG_INFO("handoff: received %d listening sockets from %s", count, path);
+    return count;
+}
+
+void handoff_ready() {
+    if(g_handoff_conn < 0) {
+        return;
+    }
+    if(send(g_handoff_conn, HANDOFF_ACK, sizeof(HANDOFF_ACK) - 1, MSG_NOSIGNAL) != (ssize_t)sizeof(HANDOFF_ACK) - 1) {
+        LOG_ERROR("handoff: confirm failure: %s", strerror(errno));
+    }
+    close(g_handoff_conn);
+    g_handoff_conn = -1;
+}
@@ -0,0 +1,37 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+/*
+    不中断服务的升级与重新加载
+    运行中的进程在一个Unix socket(默认"/tmp/webserver.端口.sock")上等待接管：
+        SIGUSR2 :   升级，fork并exec磁盘上的可执行文件(可能已被替换为新版本)，参数不变并追加-I
+        SIGHUP  :   重新加载，fork并exec当前正在运行的映像(/proc/self/exe)，重新读取文档目录、缓存等状态
+    新进程带-I启动时连接该socket，用SCM_RIGHTS收到旧进程的全部监听socket，不再自己bind，
+    开始服务后回复确认；旧进程收到确认后才停止accept并开始排空，新进程启动失败时旧进程照常服务。
+    监听socket始终有进程持有，内核中排队的连接不会被拒绝或重置。
+    排空：关闭监听socket，之后的应答都带Connection: close，连接处理完当前请求后关闭；
+    连接数降为0或超过期限(-D秒)后事件循环退出。SIGQUIT直接触发排空，用于平滑停止。
+*/
+
+static const int DRAIN_CHECK_MS = 100;      // 事件循环检查排空状态的间隔(毫秒)
+static const int HANDOFF_MAX_FDS = 253;     // 一次最多交接的监听socket数(SCM_MAX_FD)
+
+// 在创建任何线程之前调用 屏蔽由控制线程通过signalfd处理的SIGHUP和SIGUSR2
+void upgrade_block_signals();
+
+/*
+    开始在path上等待接管，并处理SIGHUP/SIGUSR2。fds为交接给新进程的监听socket，
+    argv为本进程的启动参数，交接成功后调用on_handoff(在控制线程中)
+*/
+bool upgrade_start(const char * path, const int * fds, int count, char * argv[], void (*on_handoff)());
+
+// 新进程：从path上的旧进程接收监听socket，返回收到的数量，没有可接管的进程时返回-1
+int handoff_receive(const char * path, int * fds, int max);
+// 新进程：已开始服务，通知旧进程开始排空
+void handoff_ready();
+
+void drain_start();         // 开始排空 可以在信号处理函数中调用
+bool draining();            // 是否正在排空
+bool drain_finished();      // 排空已完成(没有连接或超过期限) 事件循环应当退出
+
+#endif
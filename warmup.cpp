@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include "warmup.h"
+#include "filecache.h"
+#include "metrics.h"
+#include "log.h"
+
+struct warm_file {
+    std::string path;       // 完整路径
+    uint64_t hits;
+};
+
+static std::string g_manifest;
+static std::string g_doc_root;
+static bool g_persist = false;
+static std::vector<warm_file> g_files;
+static std::atomic<size_t> g_next(0);           // 下一个要预热的文件
+static std::atomic<int> g_loaders(0);           // 仍在运行的预热线程数
+static std::atomic<long long> g_loaded_files(0);
+static std::atomic<long long> g_loaded_bytes(0);
+static uint64_t g_start_ns;
+static std::atomic<bool> g_running(false);
+static pthread_t g_loader_threads[WARMUP_THREADS];
+static int g_loader_count = 0;
+static pthread_t g_saver;
+static bool g_saver_started = false;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// 读取清单 按顺序选出数量和总大小都在限制之内的文件
+static bool load_manifest(int top_n, size_t budget) {
+    FILE * fp = fopen(g_manifest.c_str(), "r");
+    if(!fp) {
+        if(errno != ENOENT) {
+            LOG_WARN("warmup: open %s failure: %s", g_manifest.c_str(), strerror(errno));
+        }
+        return false;
+    }
+    char line[1024 + 64];
+    char path[1024];
+    size_t total = 0;
+    while(fgets(line, sizeof(line), fp) && (int)g_files.size() < top_n) {
+        unsigned long long hits, size;
+        if(line[0] == '#' || sscanf(line, "%llu %llu %1023s", &hits, &size, path) != 3) {
+            continue;
+        }
+        // 只接受网站根目录之下的路径
+        if(path[0] != '/' || strstr(path, "/../") || total + size > budget) {
+            continue;
+        }
+        total += size;
+        warm_file file = { g_doc_root + path, hits / 2 };
+        g_files.push_back(file);
+    }
+    fclose(fp);
+    LOG_INFO("warmup: %zu files, %zu KB from %s", g_files.size(), total >> 10, g_manifest.c_str());
+    return true;
+}
+
+// 预热一个文件 返回读入的字节数
+static off_t warm(const warm_file & file) {
+    struct stat st;
+    if(stat(file.path.c_str(), &st) < 0 || !S_ISREG(st.st_mode) || !(st.st_mode & S_IROTH) || st.st_size == 0) {
+        return 0;
+    }
+    if(g_file_cache.preload(file.path.c_str(), st, file.hits)) {
+        return st.st_size;
+    }
+    if(g_file_cache.contains(file.path.c_str())) {
+        return 0;   // 请求已经先一步把它加载进缓存
+    }
+    // 不能缓存的大文件 只读入页缓存
+    int fd = open(file.path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        return 0;
+    }
+    posix_fadvise(fd, 0, st.st_size, POSIX_FADV_WILLNEED);
+    close(fd);
+    return st.st_size;
+}
+
+static void * loader(void *) {
+    size_t i;
+    while(g_running.load(std::memory_order_acquire) && (i = g_next.fetch_add(1)) < g_files.size()) {
+        off_t bytes = warm(g_files[i]);
+        if(bytes > 0) {
+            g_loaded_files++;
+            g_loaded_bytes += bytes;
+            metrics_add(M_WARMUP_FILES);
+            metrics_add(M_WARMUP_BYTES, bytes);
+        }
+    }
+    if(g_loaders.fetch_sub(1) == 1) {
+        LOG_INFO("warmup: loaded %lld files, %lld KB in %.1f ms", g_loaded_files.load(), g_loaded_bytes.load() >> 10,
+                 (now_ns() - g_start_ns) / 1e6);
+    }
+    metrics_thread_exit();
+    log_thread_exit();
+    return NULL;
+}
+
+// 把文件缓存中的文件写入清单 先写临时文件再rename，崩溃时不会留下不完整的清单
+static void save_manifest() {
+    std::vector<file_cache::hot_file> files;
+    g_file_cache.snapshot(files);
+    if(files.empty()) {
+        return;     // 没有缓存任何文件时保留原来的清单
+    }
+    std::string tmp = g_manifest + ".tmp";
+    FILE * fp = fopen(tmp.c_str(), "w");
+    if(!fp) {
+        LOG_WARN("warmup: open %s failure: %s", tmp.c_str(), strerror(errno));
+        return;
+    }
+    fprintf(fp, "# webserver warmup manifest: hits bytes path\n");
+    for(size_t i = 0; i < files.size(); i++) {
+        if(files[i].path.compare(0, g_doc_root.size(), g_doc_root) != 0) {
+            continue;
+        }
+        fprintf(fp, "%llu %lld %s\n", (unsigned long long)files[i].hits, (long long)files[i].size,
+                files[i].path.c_str() + g_doc_root.size());
+    }
+    if(fclose(fp) != 0 || rename(tmp.c_str(), g_manifest.c_str()) != 0) {
+        LOG_WARN("warmup: save %s failure: %s", g_manifest.c_str(), strerror(errno));
+        unlink(tmp.c_str());
+        return;
+    }
+    LOG_DEBUG("warmup: saved %zu files to %s", files.size(), g_manifest.c_str());
+}
+
+static void * saver(void *) {
+    int elapsed = 0;
+    while(g_running.load(std::memory_order_acquire)) {
+        struct timespec ts = { 1, 0 };
+        nanosleep(&ts, NULL);
+        if(++elapsed >= WARMUP_SAVE_INTERVAL) {
+            elapsed = 0;
+            save_manifest();
+        }
+    }
+    metrics_thread_exit();
+    log_thread_exit();
+    return NULL;
+}
+
+bool warmup_start(const char * manifest, const char * doc_root, int top_n, size_t budget, bool persist) {
+    g_manifest = manifest;
+    g_doc_root = doc_root;
+    g_persist = persist;
+    g_start_ns = now_ns();
+    if(!g_file_cache.enabled()) {
+        LOG_WARN("warmup: file cache disabled, only the page cache is warmed and %s is not updated", manifest);
+        g_persist = false;
+    }
+    g_running.store(true, std::memory_order_release);
+    if(load_manifest(top_n, budget) && !g_files.empty()) {
+        int threads = (int)g_files.size() < WARMUP_THREADS ? (int)g_files.size() : WARMUP_THREADS;
+        g_loaders.store(threads);
+        for(int i = 0; i < threads; i++) {
+            if(pthread_create(&g_loader_threads[i], NULL, loader, NULL) != 0) {
+                g_loaders.fetch_sub(threads - i);
+                break;
+            }
+            g_loader_count++;
+        }
+    }
+    if(g_persist) {
+        if(pthread_create(&g_saver, NULL, saver, NULL) != 0) {
+            return false;
+        }
+        g_saver_started = true;
+    }
+    return true;
+}
+
+void warmup_stop() {
+    if(!g_running.exchange(false)) {
+        return;
+    }
+    for(int i = 0; i < g_loader_count; i++) {
+        pthread_join(g_loader_threads[i], NULL);
+    }
+    g_loader_count = 0;
+    if(g_saver_started) {
+        pthread_join(g_saver, NULL);
+        g_saver_started = false;
+    }
+    if(g_persist) {
+        save_manifest();
+    }
+}
@@ -0,0 +1,25 @@
+#ifndef WARMUP_H
+#define WARMUP_H
+
+#include <stddef.h>
+
+/*
+    重启后的缓存预热(-F manifest[:top_n[:budget_mb]])
+    重启后文件缓存是空的，每个文件的stat/open/mmap和缺页都要在满负载下重新付出一次，p99在几分钟内都很差。
+        保存    :   每隔WARMUP_SAVE_INTERVAL秒和排空退出(SIGQUIT、升级)时，把文件缓存中的文件按命中次数排序写入清单
+                    (文本，每行"命中次数 字节数 相对网站根目录的路径"，先写临时文件再rename)；
+                    多进程模式下只由第0个worker保存
+        预热    :   启动时读取清单，按顺序取前top_n个(默认1000)、总大小不超过budget_mb(默认为-c的缓存容量)的文件，
+                    由后台线程在开始accept的同时加载：能缓存的文件放入文件缓存并预先触发缺页，
+                    其余的只用posix_fadvise读入页缓存；命中次数减半后作为缓存项的初始值，使排名跨越多次重启逐渐更新
+    预热的文件数和字节数见webserver_warmup_files_total、webserver_warmup_bytes_total。
+*/
+
+static const int WARMUP_SAVE_INTERVAL = 60;     // 保存清单的间隔(秒)
+static const int WARMUP_THREADS = 2;            // 预热的后台线程数
+
+// 开始预热 persist为true时定期保存清单；清单不存在时只保存
+bool warmup_start(const char * manifest, const char * doc_root, int top_n, size_t budget, bool persist);
+void warmup_stop();     // 等待预热结束 保存最后一次清单
+
+#endif